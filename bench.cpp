@@ -0,0 +1,362 @@
+#include "double_double.h"
+#include "dual.h"
+#include "grid.h"
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+
+// Throughput benchmarks for the parser, the evaluator backends and the grid renderer.
+//   bench [--quick] [--json <file>]
+// Prints a table and, with --json, writes the same numbers with stable keys so runs of different commits
+// can be diffed. Times are the best of several runs; ns values are per call, per evaluation or per pixel.
+// The jit rows of types other than double and complex<double> run the bytecode interpreter.
+
+#ifndef BENCH_BUILD_TYPE
+#define BENCH_BUILD_TYPE "unknown"
+#endif
+
+namespace
+{
+	using Clock = std::chrono::steady_clock;
+
+	volatile double g_sink;
+
+	struct Settings
+	{
+		double minSeconds = 0.05;
+		size_t runs = 5;
+		size_t maxDepth = 10;
+		size_t evalCount = 4096;
+		size_t gridSize = 512;
+		size_t gridIter = 256;
+	};
+
+	// ns per op of the fastest of settings.runs runs, each repeating f until minSeconds passed
+	template <typename F>
+	double MeasureNs(const Settings& settings, const size_t opsPerCall, F&& f)
+	{
+		size_t reps = 1;
+		for (;;)
+		{
+			const Clock::time_point start = Clock::now();
+			for (size_t i = 0; i < reps; i++)
+				f();
+			if (std::chrono::duration<double>(Clock::now() - start).count() >= settings.minSeconds / 4 || reps >= (size_t(1) << 30))
+				break;
+			reps *= 2;
+		}
+		double best = 1e300;
+		for (size_t run = 0; run < settings.runs; run++)
+		{
+			const Clock::time_point start = Clock::now();
+			for (size_t i = 0; i < reps; i++)
+				f();
+			best = std::min(best, std::chrono::duration<double, std::nano>(Clock::now() - start).count() / static_cast<double>(reps * opsPerCall));
+		}
+		return best;
+	}
+
+	// Full binary tree of the given depth over z and c, cycling through operators and functions
+	std::string MakeExpression(const size_t depth, size_t& counter)
+	{
+		static const char* const leaves[] = { "z", "c", "0.5", "z", "2", "c" };
+		if (0 == depth)
+			return leaves[counter++ % std::size(leaves)];
+		const size_t k = counter++;
+		const std::string lhs = MakeExpression(depth - 1, counter);
+		const std::string rhs = MakeExpression(depth - 1, counter);
+		switch (k % 6)
+		{
+		case 0: return "(" + lhs + "+" + rhs + ")";
+		case 1: return lhs + "*" + rhs;
+		case 2: return "(" + lhs + "-" + rhs + ")";
+		case 3: return "sin(" + lhs + ")*" + rhs;
+		case 4: return lhs + "/(" + rhs + "+3)";
+		default: return "exp(" + lhs + "-" + rhs + ")";
+		}
+	}
+
+	template <typename T> const char* TypeName();
+	template <> const char* TypeName<float>() { return "float"; }
+	template <> const char* TypeName<double>() { return "double"; }
+	template <> const char* TypeName<std::complex<float>>() { return "complex<float>"; }
+	template <> const char* TypeName<std::complex<double>>() { return "complex<double>"; }
+	template <> const char* TypeName<mth::DoubleDouble>() { return "double-double"; }
+	template <> const char* TypeName<mth::DoubleDoubleComplex>() { return "complex<double-double>"; }
+	template <> const char* TypeName<mth::Dual<std::complex<double>>>() { return "dual<complex<double>>"; }
+
+	const char* BackendName(const size_t backend)
+	{
+		static const char* const names[] = { "tree", "bytecode", "jit" };
+		return names[backend];
+	}
+
+	template <typename T>
+	double SinkValue(const T& t) { return static_cast<double>(mth::NumberTraits<T>::Real(t)); }
+	template <typename T>
+	double SinkValue(const mth::Dual<T>& t) { return SinkValue(t.value); }
+
+	// Minimal writer for the JSON report, keys are emitted in call order
+	class JsonWriter
+	{
+		std::ostringstream m_out;
+		std::vector<bool> m_first;
+
+		void Separate()
+		{
+			if (!m_first.empty())
+			{
+				if (!m_first.back())
+					m_out << ',';
+				m_first.back() = false;
+			}
+		}
+		void Key(const char* key)
+		{
+			Separate();
+			String(key);
+			m_out << ':';
+		}
+		void String(const std::string& s)
+		{
+			m_out << '"';
+			for (const char ch : s)
+			{
+				if ('"' == ch || '\\' == ch)
+					m_out << '\\';
+				m_out << ch;
+			}
+			m_out << '"';
+		}
+
+	public:
+		void BeginObject(const char* key = nullptr) { key ? Key(key) : Separate(); m_out << '{'; m_first.push_back(true); }
+		void EndObject() { m_out << '}'; m_first.pop_back(); }
+		void BeginArray(const char* key) { Key(key); m_out << '['; m_first.push_back(true); }
+		void EndArray() { m_out << ']'; m_first.pop_back(); }
+		void Value(const char* key, const std::string& value) { Key(key); String(value); }
+		void Value(const char* key, const double value) { Key(key); m_out << value; }
+		void Value(const char* key, const size_t value) { Key(key); m_out << value; }
+		void Value(const char* key, const bool value) { Key(key); m_out << (value ? "true" : "false"); }
+		std::string Str() const { return m_out.str(); }
+	};
+
+	void BenchParse(const Settings& settings, JsonWriter& json)
+	{
+		std::printf("parse\n%8s %10s %14s %14s\n", "depth", "chars", "parse ns", "compile ns");
+		json.BeginArray("parse");
+		for (size_t depth = 1; depth <= settings.maxDepth; depth++)
+		{
+			size_t counter = 0;
+			const std::string expression = MakeExpression(depth, counter);
+			FunctionParser parser;
+			const double parseNs = MeasureNs(settings, 1, [&]() { parser.Parse(expression); });
+			const double compileNs = MeasureNs(settings, 1, [&]() {
+				const CompiledFunction<std::complex<double>> function(parser);
+				g_sink = static_cast<double>(function.SupportedPrecision());
+			});
+			std::printf("%8zu %10zu %14.0f %14.0f\n", depth, expression.size(), parseNs, compileNs);
+			json.BeginObject();
+			json.Value("depth", depth);
+			json.Value("chars", expression.size());
+			json.Value("parse_ns", parseNs);
+			json.Value("compile_ns", compileNs);
+			json.EndObject();
+		}
+		json.EndArray();
+	}
+
+	template <typename T>
+	void BenchEval(const Settings& settings, const char* expression, JsonWriter& json)
+	{
+		using Traits = mth::NumberTraits<T>;
+		const FunctionParser parser(expression);
+		const size_t n = settings.evalCount;
+		std::vector<T> c(n), z(n), out(n);
+		for (size_t i = 0; i < n; i++)
+		{
+			const double t = static_cast<double>(i) / static_cast<double>(n);
+			c[i] = Traits::FromComplex(std::complex<double>(0.3 * std::cos(7 * t), 0.3 * std::sin(5 * t)));
+			z[i] = Traits::FromComplex(std::complex<double>(0.8 * std::sin(11 * t), 0.6 * std::cos(3 * t)));
+		}
+		constexpr size_t CSlot = FunctionParser::VariableSlot(-1), ZSlot = FunctionParser::VariableSlot(0);
+		for (size_t backend = 0; backend < 3; backend++)
+		{
+			json.BeginObject();
+			json.Value("expression", std::string(expression));
+			json.Value("type", std::string(TypeName<T>()));
+			json.Value("backend", std::string(BackendName(backend)));
+			std::shared_ptr<const CompiledFunction<T>> function;
+			try
+			{
+				function = std::make_shared<const CompiledFunction<T>>(parser, static_cast<typename CompiledFunction<T>::Backend>(backend));
+			}
+			catch (const FuncParseExcept& ex)
+			{
+				json.Value("skipped", std::string(ex.what()));
+				json.EndObject();
+				continue;
+			}
+			EvalContext<T> context(function);
+			std::vector<const T*> inputs(context.VariableCount(), nullptr);
+			if (CSlot < inputs.size())
+				inputs[CSlot] = c.data();
+			if (ZSlot < inputs.size())
+				inputs[ZSlot] = z.data();
+			const double scalarNs = MeasureNs(settings, n, [&]() {
+				for (size_t i = 0; i < n; i++)
+				{
+					if (CSlot < inputs.size())
+						context.Variables()[CSlot] = c[i];
+					if (ZSlot < inputs.size())
+						context.Variables()[ZSlot] = z[i];
+					out[i] = context();
+				}
+				g_sink = SinkValue(out[n / 2]);
+			});
+			const double batchNs = MeasureNs(settings, n, [&]() {
+				context.Evaluate(inputs.data(), out.data(), n);
+				g_sink = SinkValue(out[n / 2]);
+			});
+			std::printf("%-28s %-24s %-9s %10.2f %10.2f\n", expression, TypeName<T>(), BackendName(backend), scalarNs, batchNs);
+			json.Value("scalar_ns", scalarNs);
+			json.Value("batch_ns", batchNs);
+			json.EndObject();
+		}
+	}
+
+	void BenchEvaluators(const Settings& settings, JsonWriter& json)
+	{
+		static const char* const expressions[] = { "z*z+c", "z^3+c*z-0.5", "z*z*z*z+z*c/(z+2)", "sin(z)*c+exp(z)/3", "log(z+2)*cosh(c)" };
+		std::printf("\neval (ns per evaluation)\n%-28s %-24s %-9s %10s %10s\n", "expression", "type", "backend", "scalar", "batch");
+		json.BeginArray("eval");
+		for (const char* expression : expressions)
+		{
+			BenchEval<float>(settings, expression, json);
+			BenchEval<double>(settings, expression, json);
+			BenchEval<std::complex<float>>(settings, expression, json);
+			BenchEval<std::complex<double>>(settings, expression, json);
+			BenchEval<mth::DoubleDouble>(settings, expression, json);
+			BenchEval<mth::DoubleDoubleComplex>(settings, expression, json);
+			BenchEval<mth::Dual<std::complex<double>>>(settings, expression, json);
+		}
+		json.EndArray();
+	}
+
+	void BenchGrid(const Settings& settings, JsonWriter& json)
+	{
+		static const char* const expressions[] = { "z*z+c", "z^3+c", "sin(z)*c" };
+		const size_t hardware = std::max<size_t>(std::thread::hardware_concurrency(), 1);
+		std::vector<size_t> threadCounts;
+		for (size_t threads = 1; threads < hardware; threads *= 2)
+			threadCounts.push_back(threads);
+		threadCounts.push_back(hardware);
+
+		const size_t size = settings.gridSize;
+		const GridRegion<double> region = { -2.0, -1.5, 1.0, 1.5, size, size };
+		std::vector<size_t> iterations(size * size);
+		std::printf("\ngrid %zux%zu, maxIter %zu\n%-12s %-9s %8s %12s %12s %9s\n", size, size, settings.gridIter, "expression", "backend", "threads", "Mpixels/s", "Giter/s", "speedup");
+		json.BeginArray("grid");
+		for (const char* expression : expressions)
+		{
+			const FunctionParser parser(expression);
+			for (const size_t backend : { size_t(1), size_t(2) })
+			{
+				const auto function = std::make_shared<const CompiledFunction<std::complex<double>>>(parser, static_cast<CompiledFunction<std::complex<double>>::Backend>(backend));
+				double single = 0.0;
+				for (const size_t threads : threadCounts)
+				{
+					WorkStealingPool pool(threads);
+					GridRenderer<std::complex<double>> renderer(function, pool);
+					GridRenderer<std::complex<double>>::Options options;
+					options.maxIter = settings.gridIter;
+					const double pixelNs = MeasureNs(settings, size * size, [&]() { renderer.Render(region, options, iterations.data()); });
+					size_t total = 0;
+					for (const size_t count : iterations)
+						total += count;
+					const double mpixels = 1e3 / pixelNs;
+					const double giter = static_cast<double>(total) / (pixelNs * static_cast<double>(size * size));
+					if (1 == threads)
+						single = mpixels;
+					std::printf("%-12s %-9s %8zu %12.2f %12.3f %9.2f\n", expression, BackendName(backend), threads, mpixels, giter, mpixels / single);
+					json.BeginObject();
+					json.Value("expression", std::string(expression));
+					json.Value("backend", std::string(BackendName(backend)));
+					json.Value("threads", threads);
+					json.Value("width", size);
+					json.Value("height", size);
+					json.Value("max_iter", settings.gridIter);
+					json.Value("mpixels_per_s", mpixels);
+					json.Value("giterations_per_s", giter);
+					json.Value("speedup", mpixels / single);
+					json.EndObject();
+				}
+			}
+		}
+		json.EndArray();
+	}
+
+	std::string CompilerName()
+	{
+#if defined(__clang__)
+		return "clang " __clang_version__;
+#elif defined(__GNUC__)
+		return "gcc " __VERSION__;
+#elif defined(_MSC_VER)
+		return "msvc " + std::to_string(_MSC_VER);
+#else
+		return "unknown";
+#endif
+	}
+}
+
+int main(int argc, char** argv)
+{
+	Settings settings;
+	const char* jsonPath = nullptr;
+	for (int i = 1; i < argc; i++)
+	{
+		const std::string arg = argv[i];
+		if ("--quick" == arg)
+		{
+			settings.minSeconds = 0.005;
+			settings.runs = 2;
+			settings.maxDepth = 6;
+			settings.evalCount = 512;
+			settings.gridSize = 128;
+			settings.gridIter = 64;
+		}
+		else if ("--json" == arg && i + 1 < argc)
+			jsonPath = argv[++i];
+		else
+		{
+			std::fprintf(stderr, "usage: %s [--quick] [--json <file>]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	JsonWriter json;
+	json.BeginObject();
+	json.Value("version", size_t(1));
+	json.Value("compiler", CompilerName());
+	json.Value("build_type", std::string(BENCH_BUILD_TYPE));
+	json.Value("jit", FunctionJit::Supported());
+	json.Value("hardware_threads", static_cast<size_t>(std::thread::hardware_concurrency()));
+	BenchParse(settings, json);
+	BenchEvaluators(settings, json);
+	BenchGrid(settings, json);
+	json.EndObject();
+
+	if (jsonPath)
+	{
+		std::ofstream file(jsonPath);
+		file << json.Str() << '\n';
+		if (!file)
+		{
+			std::fprintf(stderr, "cannot write %s\n", jsonPath);
+			return 1;
+		}
+	}
+	return 0;
+}
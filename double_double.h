@@ -0,0 +1,156 @@
+#pragma once
+
+#include "parser.h"
+#include <cmath>
+
+namespace mth
+{
+	// Unevaluated sum hi + lo with |lo| <= ulp(hi) / 2, about 106 bits of mantissa. Only the operations
+	// needed at FunctionParser::Precision::Extended: arithmetic, comparisons, abs and sqrt.
+	struct DoubleDouble
+	{
+		double hi, lo;
+
+		constexpr DoubleDouble(const double value = 0.0) : hi(value), lo(0.0) {}
+		constexpr DoubleDouble(const double h, const double l) : hi(h), lo(l) {}
+
+		explicit operator double() const { return hi + lo; }
+		explicit operator float() const { return static_cast<float>(hi + lo); }
+
+		static DoubleDouble TwoSum(const double a, const double b)
+		{
+			const double s = a + b;
+			const double v = s - a;
+			return DoubleDouble(s, (a - (s - v)) + (b - v));
+		}
+		static DoubleDouble QuickTwoSum(const double a, const double b)
+		{
+			const double s = a + b;
+			return DoubleDouble(s, b - (s - a));
+		}
+		static DoubleDouble TwoProd(const double a, const double b)
+		{
+			const double p = a * b;
+#if defined(__FMA__) || defined(__AVX2__)
+			return DoubleDouble(p, std::fma(a, b, -p));
+#else
+			// Dekker split, exact without fma as long as nothing overflows
+			constexpr double split = 134217729.0; // 2^27 + 1
+			const double ta = split * a, tb = split * b;
+			const double ah = ta - (ta - a), al = a - ah;
+			const double bh = tb - (tb - b), bl = b - bh;
+			return DoubleDouble(p, ((ah * bh - p) + ah * bl + al * bh) + al * bl);
+#endif
+		}
+
+		DoubleDouble operator-() const { return DoubleDouble(-hi, -lo); }
+		DoubleDouble& operator+=(const DoubleDouble& rhs) { return *this = *this + rhs; }
+		DoubleDouble& operator-=(const DoubleDouble& rhs) { return *this = *this - rhs; }
+		DoubleDouble& operator*=(const DoubleDouble& rhs) { return *this = *this * rhs; }
+		DoubleDouble& operator/=(const DoubleDouble& rhs) { return *this = *this / rhs; }
+
+		friend DoubleDouble operator+(const DoubleDouble& a, const DoubleDouble& b)
+		{
+			const DoubleDouble s = TwoSum(a.hi, b.hi);
+			const DoubleDouble t = TwoSum(a.lo, b.lo);
+			const DoubleDouble u = QuickTwoSum(s.hi, s.lo + t.hi);
+			return QuickTwoSum(u.hi, u.lo + t.lo);
+		}
+		friend DoubleDouble operator-(const DoubleDouble& a, const DoubleDouble& b) { return a + -b; }
+		friend DoubleDouble operator*(const DoubleDouble& a, const DoubleDouble& b)
+		{
+			const DoubleDouble p = TwoProd(a.hi, b.hi);
+			return QuickTwoSum(p.hi, p.lo + (a.hi * b.lo + a.lo * b.hi));
+		}
+		friend DoubleDouble operator/(const DoubleDouble& a, const DoubleDouble& b)
+		{
+			// one Newton correction of the double quotient
+			const double q1 = a.hi / b.hi;
+			const DoubleDouble r = a - b * DoubleDouble(q1);
+			const double q2 = r.hi / b.hi;
+			const DoubleDouble s = r - b * DoubleDouble(q2);
+			return DoubleDouble(q1) + DoubleDouble(q2) + DoubleDouble(s.hi / b.hi);
+		}
+
+		friend bool operator==(const DoubleDouble& a, const DoubleDouble& b) { return a.hi == b.hi && a.lo == b.lo; }
+		friend bool operator!=(const DoubleDouble& a, const DoubleDouble& b) { return !(a == b); }
+		friend bool operator<(const DoubleDouble& a, const DoubleDouble& b) { return a.hi < b.hi || (a.hi == b.hi && a.lo < b.lo); }
+		friend bool operator>(const DoubleDouble& a, const DoubleDouble& b) { return b < a; }
+		friend bool operator<=(const DoubleDouble& a, const DoubleDouble& b) { return !(b < a); }
+		friend bool operator>=(const DoubleDouble& a, const DoubleDouble& b) { return !(a < b); }
+
+		friend DoubleDouble abs(const DoubleDouble& a) { return a.hi < 0.0 ? -a : a; }
+		friend DoubleDouble sqrt(const DoubleDouble& a)
+		{
+			if (a.hi <= 0.0)
+				return DoubleDouble(std::sqrt(a.hi));
+			const double root = std::sqrt(a.hi);
+			const DoubleDouble square = TwoProd(root, root);
+			return QuickTwoSum(root, (a - square).hi / (2.0 * root));
+		}
+
+		friend std::ostream& operator<<(std::ostream& os, const DoubleDouble& a) { return os << a.hi + a.lo; }
+	};
+
+	struct DoubleDoubleComplex
+	{
+		DoubleDouble re, im;
+
+		constexpr DoubleDoubleComplex(const DoubleDouble& r = DoubleDouble(), const DoubleDouble& i = DoubleDouble()) : re(r), im(i) {}
+
+		const DoubleDouble& real() const { return re; }
+		const DoubleDouble& imag() const { return im; }
+
+		DoubleDoubleComplex operator-() const { return DoubleDoubleComplex(-re, -im); }
+		DoubleDoubleComplex& operator+=(const DoubleDoubleComplex& rhs) { return *this = *this + rhs; }
+		DoubleDoubleComplex& operator-=(const DoubleDoubleComplex& rhs) { return *this = *this - rhs; }
+		DoubleDoubleComplex& operator*=(const DoubleDoubleComplex& rhs) { return *this = *this * rhs; }
+		DoubleDoubleComplex& operator/=(const DoubleDoubleComplex& rhs) { return *this = *this / rhs; }
+
+		friend DoubleDoubleComplex operator+(const DoubleDoubleComplex& a, const DoubleDoubleComplex& b) { return DoubleDoubleComplex(a.re + b.re, a.im + b.im); }
+		friend DoubleDoubleComplex operator-(const DoubleDoubleComplex& a, const DoubleDoubleComplex& b) { return DoubleDoubleComplex(a.re - b.re, a.im - b.im); }
+		friend DoubleDoubleComplex operator*(const DoubleDoubleComplex& a, const DoubleDoubleComplex& b)
+		{
+			return DoubleDoubleComplex(a.re * b.re - a.im * b.im, a.re * b.im + a.im * b.re);
+		}
+		friend DoubleDoubleComplex operator/(const DoubleDoubleComplex& a, const DoubleDoubleComplex& b)
+		{
+			DoubleDoubleComplex q = a;
+			ComplexDivide(q.re, q.im, b.re, b.im);
+			return q;
+		}
+		friend bool operator==(const DoubleDoubleComplex& a, const DoubleDoubleComplex& b) { return a.re == b.re && a.im == b.im; }
+		friend bool operator!=(const DoubleDoubleComplex& a, const DoubleDoubleComplex& b) { return !(a == b); }
+
+		friend std::ostream& operator<<(std::ostream& os, const DoubleDoubleComplex& a) { return os << '(' << a.re << ',' << a.im << ')'; }
+	};
+
+	template <> struct NumberTraits<DoubleDouble>
+	{
+		using Scalar = DoubleDouble;
+		static constexpr bool isComplex = false;
+		static Scalar Real(const DoubleDouble& t) { return t; }
+		static Scalar Imag(const DoubleDouble& /*t*/) { return Scalar(); }
+		static DoubleDouble Make(const Scalar& re, const Scalar& /*im*/) { return re; }
+		static DoubleDouble FromComplex(const std::complex<double>& c) { return DoubleDouble(c.real()); }
+		static constexpr bool transcendental = false;
+		static constexpr bool dual = false;
+		static DoubleDouble Pos(const DoubleDouble& t) { return abs(t); }
+		static DoubleDouble Re(const DoubleDouble& t) { return t; }
+		static DoubleDouble Im(const DoubleDouble& /*t*/) { return DoubleDouble(); }
+	};
+	template <> struct NumberTraits<DoubleDoubleComplex>
+	{
+		using Scalar = DoubleDouble;
+		static constexpr bool isComplex = true;
+		static Scalar Real(const DoubleDoubleComplex& t) { return t.re; }
+		static Scalar Imag(const DoubleDoubleComplex& t) { return t.im; }
+		static DoubleDoubleComplex Make(const Scalar& re, const Scalar& im) { return DoubleDoubleComplex(re, im); }
+		static DoubleDoubleComplex FromComplex(const std::complex<double>& c) { return DoubleDoubleComplex(c.real(), c.imag()); }
+		static constexpr bool transcendental = false;
+		static constexpr bool dual = false;
+		static DoubleDoubleComplex Pos(const DoubleDoubleComplex& t) { return DoubleDoubleComplex(abs(t.re), abs(t.im)); }
+		static DoubleDoubleComplex Re(const DoubleDoubleComplex& t) { return DoubleDoubleComplex(abs(t.re)); }
+		static DoubleDoubleComplex Im(const DoubleDoubleComplex& t) { return DoubleDoubleComplex(abs(t.im)); }
+	};
+}
@@ -0,0 +1,91 @@
+#pragma once
+
+#include "parser.h"
+#include <cmath>
+
+namespace mth
+{
+	// value + derivative * eps with eps^2 = 0. Evaluating a function on Dual inputs yields f and the derivative
+	// along the seeded direction in one pass, e.g. z = Dual(z, 1), c = Dual(c, 0) for df/dz. Only the
+	// holomorphic functions have rules, abs, pos, ang, re and im throw NotDifferentiable.
+	template <typename T>
+	struct Dual
+	{
+		T value, derivative;
+
+		Dual(const T& v = T(), const T& d = T()) : value(v), derivative(d) {}
+
+		Dual operator-() const { return Dual(-value, -derivative); }
+		Dual& operator+=(const Dual& rhs) { return *this = *this + rhs; }
+		Dual& operator-=(const Dual& rhs) { return *this = *this - rhs; }
+		Dual& operator*=(const Dual& rhs) { return *this = *this * rhs; }
+		Dual& operator/=(const Dual& rhs) { return *this = *this / rhs; }
+
+		friend Dual operator+(const Dual& a, const Dual& b) { return Dual(a.value + b.value, a.derivative + b.derivative); }
+		friend Dual operator-(const Dual& a, const Dual& b) { return Dual(a.value - b.value, a.derivative - b.derivative); }
+		friend Dual operator*(const Dual& a, const Dual& b) { return Dual(a.value * b.value, a.derivative * b.value + a.value * b.derivative); }
+		friend Dual operator/(const Dual& a, const Dual& b)
+		{
+			const T q = a.value / b.value;
+			return Dual(q, (a.derivative - q * b.derivative) / b.value);
+		}
+		friend bool operator==(const Dual& a, const Dual& b) { return a.value == b.value && a.derivative == b.derivative; }
+		friend bool operator!=(const Dual& a, const Dual& b) { return !(a == b); }
+
+		friend Dual pow(const Dual& a, const Dual& b)
+		{
+			using std::pow;
+			using std::log;
+			const T p = pow(a.value, b.value);
+			// d(a^b) = b a^(b-1) da + a^b log(a) db, the second term is skipped for constant exponents so
+			// that integer powers of zero stay finite
+			T d = b.value * pow(a.value, b.value - T(1)) * a.derivative;
+			if (b.derivative != T())
+				d += p * log(a.value) * b.derivative;
+			return Dual(p, d);
+		}
+		friend Dual sin(const Dual& a) { using std::sin; using std::cos; return Dual(sin(a.value), cos(a.value) * a.derivative); }
+		friend Dual cos(const Dual& a) { using std::sin; using std::cos; return Dual(cos(a.value), -sin(a.value) * a.derivative); }
+		friend Dual tan(const Dual& a)
+		{
+			using std::tan;
+			const T t = tan(a.value);
+			return Dual(t, (T(1) + t * t) * a.derivative);
+		}
+		friend Dual sinh(const Dual& a) { using std::sinh; using std::cosh; return Dual(sinh(a.value), cosh(a.value) * a.derivative); }
+		friend Dual cosh(const Dual& a) { using std::sinh; using std::cosh; return Dual(cosh(a.value), sinh(a.value) * a.derivative); }
+		friend Dual tanh(const Dual& a)
+		{
+			using std::tanh;
+			const T t = tanh(a.value);
+			return Dual(t, (T(1) - t * t) * a.derivative);
+		}
+		friend Dual exp(const Dual& a)
+		{
+			using std::exp;
+			const T e = exp(a.value);
+			return Dual(e, e * a.derivative);
+		}
+		friend Dual log(const Dual& a) { using std::log; return Dual(log(a.value), a.derivative / a.value); }
+		friend Dual abs(const Dual&) { throw FuncParseExcept(FuncParseExcept::NotDifferentiable, 0); }
+		friend Dual ang(const Dual&) { throw FuncParseExcept(FuncParseExcept::NotDifferentiable, 0); }
+
+		friend std::ostream& operator<<(std::ostream& os, const Dual& a) { return os << '(' << a.value << ',' << a.derivative << ')'; }
+	};
+
+	// Scalar is the Dual itself: the batch kernels treat it as one real-like lane value
+	template <typename T> struct NumberTraits<Dual<T>>
+	{
+		using Scalar = Dual<T>;
+		static constexpr bool isComplex = false;
+		static Scalar Real(const Dual<T>& t) { return t; }
+		static Scalar Imag(const Dual<T>& /*t*/) { return Scalar(); }
+		static Dual<T> Make(const Scalar& re, const Scalar& /*im*/) { return re; }
+		static Dual<T> FromComplex(const std::complex<double>& c) { return Dual<T>(NumberTraits<T>::FromComplex(c)); }
+		static constexpr bool transcendental = true;
+		static constexpr bool dual = true;
+		static Dual<T> Pos(const Dual<T>&) { throw FuncParseExcept(FuncParseExcept::NotDifferentiable, 0); }
+		static Dual<T> Re(const Dual<T>&) { throw FuncParseExcept(FuncParseExcept::NotDifferentiable, 0); }
+		static Dual<T> Im(const Dual<T>&) { throw FuncParseExcept(FuncParseExcept::NotDifferentiable, 0); }
+	};
+}
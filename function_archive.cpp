@@ -0,0 +1,165 @@
+#include "function_archive.h"
+#include <fstream>
+
+#if defined(_WIN32)
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+std::vector<unsigned char> FunctionArchive::Writer::Build() const
+{
+	const size_t count = m_entries.size();
+	size_t offset = FunctionImage::Align(sizeof(Header) + count * sizeof(Entry));
+	std::vector<Entry> entries(count);
+	for (size_t i = 0; i < count; i++)
+	{
+		entries[i].nameOffset = offset;
+		entries[i].nameLength = m_entries[i].first.size();
+		offset = FunctionImage::Align(offset + m_entries[i].first.size());
+	}
+	for (size_t i = 0; i < count; i++)
+	{
+		entries[i].imageOffset = offset;
+		entries[i].imageSize = m_entries[i].second.size();
+		offset = FunctionImage::Align(offset + m_entries[i].second.size());
+	}
+
+	std::vector<unsigned char> archive(offset, 0);
+	const Header header = { Magic, Version, 0, count, offset };
+	std::memcpy(archive.data(), &header, sizeof(header));
+	if (count)
+		std::memcpy(archive.data() + sizeof(Header), entries.data(), count * sizeof(Entry));
+	for (size_t i = 0; i < count; i++)
+	{
+		std::memcpy(archive.data() + entries[i].nameOffset, m_entries[i].first.data(), m_entries[i].first.size());
+		std::memcpy(archive.data() + entries[i].imageOffset, m_entries[i].second.data(), m_entries[i].second.size());
+	}
+	return archive;
+}
+
+bool FunctionArchive::Writer::Save(const char* const path) const
+{
+	const std::vector<unsigned char> archive = Build();
+	std::ofstream file(path, std::ios::binary | std::ios::trunc);
+	file.write(reinterpret_cast<const char*>(archive.data()), static_cast<std::streamsize>(archive.size()));
+	return static_cast<bool>(file);
+}
+
+static void Unmap(void* const mapping, const size_t size)
+{
+#if defined(_WIN32)
+	UnmapViewOfFile(mapping);
+#else
+	munmap(mapping, size);
+#endif
+}
+
+FunctionArchive::FunctionArchive(PrivateTag, const unsigned char* data, const size_t size, void* mapping, std::vector<unsigned char> buffer) :
+	m_data(data),
+	m_size(size),
+	m_mapping(mapping),
+	m_buffer(std::move(buffer))
+{
+	if (!m_mapping)
+		m_data = m_buffer.data();
+	try
+	{
+		Index();
+	}
+	catch (...)
+	{
+		if (m_mapping)
+			Unmap(m_mapping, m_size);
+		throw;
+	}
+}
+
+FunctionArchive::~FunctionArchive()
+{
+	if (m_mapping)
+		Unmap(m_mapping, m_size);
+}
+
+// Everything Load touches is checked here, the images themselves are validated when loaded
+void FunctionArchive::Index()
+{
+	if (m_size < sizeof(Header))
+		throw FuncParseExcept(FuncParseExcept::InvalidImage, 0);
+	const Header& header = *reinterpret_cast<const Header*>(m_data);
+	if (Magic != header.magic || Version != header.version || header.size != m_size ||
+		header.count > (m_size - sizeof(Header)) / sizeof(Entry))
+		throw FuncParseExcept(FuncParseExcept::InvalidImage, 0);
+	const Entry* const entries = reinterpret_cast<const Entry*>(m_data + sizeof(Header));
+	for (size_t i = 0; i < header.count; i++)
+	{
+		const Entry& entry = entries[i];
+		if (entry.nameOffset > m_size || entry.nameLength > m_size - entry.nameOffset ||
+			entry.imageOffset > m_size || entry.imageSize > m_size - entry.imageOffset || entry.imageOffset % 8)
+			throw FuncParseExcept(FuncParseExcept::InvalidImage, sizeof(Header) + i * sizeof(Entry));
+		m_lookup.emplace(std::string_view(reinterpret_cast<const char*>(m_data + entry.nameOffset), static_cast<size_t>(entry.nameLength)), i);
+	}
+}
+
+std::shared_ptr<const FunctionArchive> FunctionArchive::Open(const char* const path)
+{
+#if defined(_WIN32)
+	HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (INVALID_HANDLE_VALUE == file)
+		return nullptr;
+	LARGE_INTEGER fileSize;
+	HANDLE mapping = nullptr;
+	if (GetFileSizeEx(file, &fileSize) && fileSize.QuadPart > 0)
+		mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	CloseHandle(file);
+	if (!mapping)
+		return nullptr;
+	void* view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+	CloseHandle(mapping);
+	if (!view)
+		return nullptr;
+	const size_t size = static_cast<size_t>(fileSize.QuadPart);
+#else
+	const int file = open(path, O_RDONLY);
+	if (file < 0)
+		return nullptr;
+	struct stat info;
+	void* view = MAP_FAILED;
+	if (0 == fstat(file, &info) && info.st_size > 0)
+		view = mmap(nullptr, static_cast<size_t>(info.st_size), PROT_READ, MAP_PRIVATE, file, 0);
+	close(file);
+	if (MAP_FAILED == view)
+		return nullptr;
+	const size_t size = static_cast<size_t>(info.st_size);
+#endif
+	return std::make_shared<const FunctionArchive>(PrivateTag(), static_cast<const unsigned char*>(view), size, view, std::vector<unsigned char>());
+}
+
+std::shared_ptr<const FunctionArchive> FunctionArchive::FromBuffer(std::vector<unsigned char> buffer)
+{
+	const size_t size = buffer.size();
+	return std::make_shared<const FunctionArchive>(PrivateTag(), nullptr, size, nullptr, std::move(buffer));
+}
+
+const FunctionArchive::Entry& FunctionArchive::GetEntry(const size_t index) const
+{
+	if (index >= Count())
+		throw FuncParseExcept(FuncParseExcept::IndexOutOfRange, index);
+	return reinterpret_cast<const Entry*>(m_data + sizeof(Header))[index];
+}
+
+std::string_view FunctionArchive::Name(const size_t index) const
+{
+	const Entry& entry = GetEntry(index);
+	return std::string_view(reinterpret_cast<const char*>(m_data + entry.nameOffset), static_cast<size_t>(entry.nameLength));
+}
+
+size_t FunctionArchive::Find(const std::string_view name) const
+{
+	const auto found = m_lookup.find(name);
+	return found == m_lookup.end() ? NotFound : found->second;
+}
@@ -0,0 +1,83 @@
+#pragma once
+
+#include "parser.h"
+#include <unordered_map>
+
+// Read-only collection of named FunctionImages, normally mapped from a file. Layout: Header, Entry[count],
+// then the UTF-8 names and the images, every image 8-byte aligned. Functions loaded from the archive run
+// from the mapping and keep the archive alive.
+class FunctionArchive : public std::enable_shared_from_this<FunctionArchive>
+{
+public:
+	static constexpr unsigned Magic = 0x4b415046; // "FPAK"
+	static constexpr unsigned short Version = 1;
+
+	struct Header
+	{
+		unsigned magic;
+		unsigned short version;
+		unsigned short reserved;
+		unsigned long long count;
+		unsigned long long size;
+	};
+	struct Entry
+	{
+		unsigned long long nameOffset;
+		unsigned long long nameLength;
+		unsigned long long imageOffset;
+		unsigned long long imageSize;
+	};
+
+	class Writer
+	{
+		std::vector<std::pair<std::string, std::vector<unsigned char>>> m_entries;
+
+	public:
+		template <typename NumberType>
+		void Add(const std::string_view name, const CompiledFunction<NumberType>& function)
+		{
+			m_entries.emplace_back(std::string(name), function.Serialize());
+		}
+		inline size_t Count() const { return m_entries.size(); }
+
+		std::vector<unsigned char> Build() const;
+		bool Save(const char* const path) const;
+	};
+
+private:
+	const unsigned char* m_data;
+	size_t m_size;
+	void* m_mapping;
+	std::vector<unsigned char> m_buffer;
+	std::unordered_map<std::string_view, size_t> m_lookup;
+
+	struct PrivateTag {};
+	void Index();
+	// throws IndexOutOfRange past Count()
+	const Entry& GetEntry(const size_t index) const;
+
+public:
+	static constexpr size_t NotFound = static_cast<size_t>(-1);
+
+	FunctionArchive(PrivateTag, const unsigned char* data, const size_t size, void* mapping, std::vector<unsigned char> buffer);
+	FunctionArchive(const FunctionArchive&) = delete;
+	FunctionArchive& operator=(const FunctionArchive&) = delete;
+	~FunctionArchive();
+
+	// Maps the file read-only, returns null if it cannot be opened; throws InvalidImage if it is malformed
+	static std::shared_ptr<const FunctionArchive> Open(const char* const path);
+	static std::shared_ptr<const FunctionArchive> FromBuffer(std::vector<unsigned char> buffer);
+
+	inline size_t Count() const { return static_cast<size_t>(reinterpret_cast<const Header*>(m_data)->count); }
+	// Name and Load throw FuncParseExcept::IndexOutOfRange for an index past Count()
+	std::string_view Name(const size_t index) const;
+	size_t Find(const std::string_view name) const;
+
+	template <typename NumberType>
+	std::shared_ptr<const CompiledFunction<NumberType>> Load(const size_t index,
+		const typename CompiledFunction<NumberType>::Backend backend = CompiledFunction<NumberType>::Backend::Bytecode) const
+	{
+		const Entry& entry = GetEntry(index);
+		return std::make_shared<const CompiledFunction<NumberType>>(m_data + entry.imageOffset, static_cast<size_t>(entry.imageSize), shared_from_this(), backend);
+	}
+};
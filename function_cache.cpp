@@ -0,0 +1,134 @@
+#include "function_cache.h"
+#include <cctype>
+
+static bool IsOperandPart(const char ch)
+{
+	return
+		(ch >= 'a' && ch <= 'z') ||
+		(ch >= 'A' && ch <= 'Z') ||
+		(ch >= '0' && ch <= '9') ||
+		'_' == ch || '.' == ch;
+}
+
+FunctionCache::FunctionCache(const size_t capacity) :
+	m_capacity(capacity),
+	m_hits(0),
+	m_misses(0),
+	m_evictions(0) {}
+
+std::string FunctionCache::Normalize(const std::string_view function)
+{
+	std::string normalized;
+	normalized.reserve(function.size());
+	bool space = false;
+	for (const char ch : function)
+	{
+		if (std::isspace(static_cast<unsigned char>(ch)))
+		{
+			space = true;
+			continue;
+		}
+		if (space && !normalized.empty() && IsOperandPart(ch))
+		{
+			// "z 1" must not become "z1", and "- 2" must stay a dangling sign rather than the literal -2
+			const char prev = normalized.back();
+			const bool unarySign = '-' == prev &&
+				(normalized.size() < 2 || !(IsOperandPart(normalized[normalized.size() - 2]) || ')' == normalized[normalized.size() - 2]));
+			if (IsOperandPart(prev) || unarySign)
+				normalized += ' ';
+		}
+		space = false;
+		normalized += ch;
+	}
+	return normalized;
+}
+
+std::shared_ptr<const void> FunctionCache::Find(const Key& key)
+{
+	std::lock_guard<std::mutex> lock(m_lock);
+	const auto found = m_lookup.find(key);
+	if (found == m_lookup.end())
+	{
+		m_misses++;
+		return nullptr;
+	}
+	m_hits++;
+	m_entries.splice(m_entries.begin(), m_entries, found->second);
+	return found->second->function;
+}
+
+std::shared_ptr<const void> FunctionCache::Insert(Key key, std::shared_ptr<const void> function)
+{
+	std::lock_guard<std::mutex> lock(m_lock);
+	// another thread may have compiled the same key meanwhile, keep the entry everyone else already shares
+	const auto found = m_lookup.find(key);
+	if (found != m_lookup.end())
+	{
+		m_entries.splice(m_entries.begin(), m_entries, found->second);
+		return found->second->function;
+	}
+	if (!m_capacity)
+		return function;
+	m_entries.push_front({ std::move(key), function });
+	m_lookup.emplace(m_entries.front().key, m_entries.begin());
+	Trim();
+	return function;
+}
+
+void FunctionCache::Trim()
+{
+	while (m_entries.size() > m_capacity)
+	{
+		m_lookup.erase(m_entries.back().key);
+		m_entries.pop_back();
+		m_evictions++;
+	}
+}
+
+void FunctionCache::Invalidate(const std::string_view function)
+{
+	const std::string text = Normalize(function);
+	std::lock_guard<std::mutex> lock(m_lock);
+	for (auto it = m_entries.begin(); it != m_entries.end();)
+	{
+		if (it->key.text == text)
+		{
+			m_lookup.erase(it->key);
+			it = m_entries.erase(it);
+		}
+		else
+			++it;
+	}
+}
+
+void FunctionCache::Clear()
+{
+	std::lock_guard<std::mutex> lock(m_lock);
+	m_lookup.clear();
+	m_entries.clear();
+}
+
+void FunctionCache::SetCapacity(const size_t capacity)
+{
+	std::lock_guard<std::mutex> lock(m_lock);
+	m_capacity = capacity;
+	Trim();
+}
+
+size_t FunctionCache::Capacity() const
+{
+	std::lock_guard<std::mutex> lock(m_lock);
+	return m_capacity;
+}
+
+FunctionCache::Stats FunctionCache::GetStats() const
+{
+	std::lock_guard<std::mutex> lock(m_lock);
+	return { m_hits, m_misses, m_evictions, m_entries.size() };
+}
+
+void FunctionCache::ResetStats()
+{
+	std::lock_guard<std::mutex> lock(m_lock);
+	m_hits = m_misses = m_evictions = 0;
+}
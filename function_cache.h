@@ -0,0 +1,86 @@
+#pragma once
+
+#include "parser.h"
+#include <list>
+#include <mutex>
+#include <typeindex>
+#include <unordered_map>
+
+// Bounded LRU cache of compiled functions, shared by all threads. Entries are keyed by the normalized
+// source text, the NumberType and the backend; the returned functions are immutable and outlive eviction.
+class FunctionCache
+{
+public:
+	struct Stats
+	{
+		size_t hits;
+		size_t misses;
+		size_t evictions;
+		size_t size;
+	};
+
+private:
+	struct Key
+	{
+		std::string text;
+		std::type_index type;
+		int backend;
+
+		bool operator==(const Key& other) const { return backend == other.backend && type == other.type && text == other.text; }
+	};
+	struct KeyHash
+	{
+		size_t operator()(const Key& key) const
+		{
+			return (std::hash<std::string>()(key.text) * 31 + key.type.hash_code()) * 31 + static_cast<size_t>(key.backend);
+		}
+	};
+	struct Entry
+	{
+		Key key;
+		std::shared_ptr<const void> function;
+	};
+
+	mutable std::mutex m_lock;
+	std::list<Entry> m_entries;
+	std::unordered_map<Key, std::list<Entry>::iterator, KeyHash> m_lookup;
+	size_t m_capacity;
+	size_t m_hits;
+	size_t m_misses;
+	size_t m_evictions;
+
+	std::shared_ptr<const void> Find(const Key& key);
+	std::shared_ptr<const void> Insert(Key key, std::shared_ptr<const void> function);
+	void Trim();
+
+public:
+	FunctionCache(const size_t capacity = 64);
+	FunctionCache(const FunctionCache&) = delete;
+	FunctionCache& operator=(const FunctionCache&) = delete;
+
+	// Whitespace is dropped except where it separates two tokens, so the text parses exactly like the input
+	static std::string Normalize(const std::string_view function);
+
+	// Parse errors propagate as FuncParseExcept with offsets into function, failed parses are not cached
+	template <typename NumberType>
+	std::shared_ptr<const CompiledFunction<NumberType>> Get(const std::string_view function,
+		const typename CompiledFunction<NumberType>::Backend backend = CompiledFunction<NumberType>::Backend::Bytecode)
+	{
+		Key key{ Normalize(function), std::type_index(typeid(NumberType)), static_cast<int>(backend) };
+		if (std::shared_ptr<const void> found = Find(key))
+			return std::static_pointer_cast<const CompiledFunction<NumberType>>(found);
+
+		const FunctionParser parser(function);
+		std::shared_ptr<const void> compiled = std::make_shared<const CompiledFunction<NumberType>>(parser, backend);
+		return std::static_pointer_cast<const CompiledFunction<NumberType>>(Insert(std::move(key), std::move(compiled)));
+	}
+
+	// Drops every entry compiled from this text, for all number types and backends
+	void Invalidate(const std::string_view function);
+	void Clear();
+
+	void SetCapacity(const size_t capacity);
+	size_t Capacity() const;
+	Stats GetStats() const;
+	void ResetStats();
+};
@@ -0,0 +1,145 @@
+#include "parser.h"
+#include <iomanip>
+#include <sstream>
+
+namespace
+{
+	using OpCode = FunctionBytecode::OpCode;
+
+	const char* const OpCodeNames[] = {
+		"const", "var", "dup", "store", "load",
+		"add", "sub", "mul", "div", "pow",
+		"sin", "cos", "tan", "sinh", "cosh", "tanh", "exp", "log", "abs", "pos", "ang", "re", "im"
+	};
+	static_assert(std::size(OpCodeNames) == FunctionProfile::OpCodeCount, "one name per opcode");
+
+	constexpr size_t ExpressionWidth = 40;
+	constexpr size_t HistogramRows = 16;
+
+	void PrintCounter(std::ostream& os, const char* name, const FunctionProfile::Counter& counter, const std::uint64_t totalTicks)
+	{
+		const double perCall = counter.executions ? static_cast<double>(counter.ticks) / static_cast<double>(counter.executions) : 0.0;
+		const double share = totalTicks ? 100.0 * static_cast<double>(counter.ticks) / static_cast<double>(totalTicks) : 0.0;
+		os << std::setw(6) << std::left << name << std::right << std::setw(14) << counter.executions << std::setw(16) << counter.ticks
+			<< std::setw(12) << std::fixed << std::setprecision(1) << perCall << std::setw(8) << share << "%\n";
+	}
+
+	void PrintNode(std::ostream& os, const FunctionProfile& profile, const FunctionParser::FuncElem* elem, const size_t depth, const std::uint64_t totalTicks)
+	{
+		using Type = FunctionParser::FuncElem::Type;
+		if (Type::Function != elem->type && Type::Operator != elem->type)
+			return;
+		std::ostringstream text;
+		elem->Print(text);
+		std::string expression = std::string(2 * depth, ' ') + text.str();
+		if (expression.size() > ExpressionWidth)
+			expression = expression.substr(0, ExpressionWidth - 3) + "...";
+		os << std::setw(ExpressionWidth) << std::left << expression << ' ' << std::right;
+		if (Type::Function == elem->type)
+		{
+			const FunctionParser::Function* function = static_cast<const FunctionParser::Function*>(elem);
+			PrintCounter(os, FunctionParser::Function::Names[static_cast<size_t>(function->name)], profile.Function(function->name), totalTicks);
+			PrintNode(os, profile, function->param, depth + 1, totalTicks);
+		}
+		else
+		{
+			const FunctionParser::Operator* op = static_cast<const FunctionParser::Operator*>(elem);
+			PrintCounter(os, OpCodeNames[static_cast<size_t>(OpCode::Add) + static_cast<size_t>(op->name)], profile.Operator(op->name), totalTicks);
+			PrintNode(os, profile, op->params[0], depth + 1, totalTicks);
+			PrintNode(os, profile, op->params[1], depth + 1, totalTicks);
+		}
+	}
+}
+
+FunctionProfile::FunctionProfile() :
+	m_counters(),
+	m_evaluations(0)
+{
+}
+
+void FunctionProfile::RecordIterations(const size_t steps)
+{
+	if (steps >= m_iterations.size())
+		m_iterations.resize(steps + 1);
+	m_iterations[steps]++;
+}
+
+void FunctionProfile::Reset()
+{
+	*this = FunctionProfile();
+}
+
+void FunctionProfile::Merge(const FunctionProfile& other)
+{
+	for (size_t i = 0; i < OpCodeCount; i++)
+	{
+		m_counters[i].executions += other.m_counters[i].executions;
+		m_counters[i].ticks += other.m_counters[i].ticks;
+	}
+	m_evaluations += other.m_evaluations;
+	if (other.m_iterations.size() > m_iterations.size())
+		m_iterations.resize(other.m_iterations.size());
+	for (size_t i = 0; i < other.m_iterations.size(); i++)
+		m_iterations[i] += other.m_iterations[i];
+}
+
+FunctionProfile::Counter FunctionProfile::Total() const
+{
+	Counter total = {};
+	for (const Counter& counter : m_counters)
+	{
+		total.executions += counter.executions;
+		total.ticks += counter.ticks;
+	}
+	return total;
+}
+
+void FunctionProfile::Print(std::ostream& os, const FunctionParser::FuncElem* root) const
+{
+	const std::ios_base::fmtflags flags = os.flags();
+	const std::streamsize precision = os.precision();
+	const Counter total = Total();
+	os << "evaluations " << m_evaluations;
+	if (m_evaluations)
+		os << ", " << std::fixed << std::setprecision(1) << static_cast<double>(total.ticks) / static_cast<double>(m_evaluations) << " ticks each";
+	os << '\n';
+	if (!Enabled)
+		os << "(built without FUNCTION_PROFILING, no counters collected)\n";
+
+	os << std::setw(ExpressionWidth) << std::left << "node" << ' ' << std::setw(6) << "name" << std::right << std::setw(14) << "executions"
+		<< std::setw(16) << "ticks" << std::setw(12) << "ticks/exec" << std::setw(9) << "share" << '\n';
+	if (root)
+		PrintNode(os, *this, root, 0, total.ticks);
+
+	os << "\nper opcode\n";
+	for (size_t i = 0; i < OpCodeCount; i++)
+		if (m_counters[i].executions)
+			PrintCounter(os, OpCodeNames[i], m_counters[i], total.ticks);
+
+	std::uint64_t runs = 0, steps = 0;
+	for (size_t i = 0; i < m_iterations.size(); i++)
+	{
+		runs += m_iterations[i];
+		steps += m_iterations[i] * i;
+	}
+	if (runs)
+	{
+		os << "\niterations: " << runs << " runs, mean " << std::fixed << std::setprecision(1) << static_cast<double>(steps) / static_cast<double>(runs)
+			<< ", longest " << (m_iterations.size() - 1) << " steps (" << m_iterations.back() << " runs)\n";
+		// the histogram folded into at most HistogramRows ranges of equal width
+		const size_t width = (m_iterations.size() + HistogramRows - 1) / HistogramRows;
+		for (size_t first = 0; first < m_iterations.size(); first += width)
+		{
+			const size_t last = std::min(first + width, m_iterations.size()) - 1;
+			std::uint64_t count = 0;
+			for (size_t i = first; i <= last; i++)
+				count += m_iterations[i];
+			std::ostringstream range;
+			range << first << ".." << last;
+			os << std::setw(14) << range.str() << std::setw(14) << count << ' '
+				<< std::string(static_cast<size_t>(40.0 * static_cast<double>(count) / static_cast<double>(runs) + 0.5), '#') << '\n';
+		}
+	}
+	os.flags(flags);
+	os.precision(precision);
+}
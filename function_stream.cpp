@@ -0,0 +1,102 @@
+#include "function_stream.h"
+
+#if defined(_WIN32)
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+StreamSampleSource::StreamSampleSource(std::istream& input) :
+	m_input(input),
+	m_next(0)
+{
+}
+
+const unsigned char* StreamSampleSource::Read(const size_t size, size_t& got)
+{
+	std::vector<unsigned char>& buffer = m_buffers[m_next];
+	m_next ^= 1;
+	buffer.resize(size);
+	m_input.read(reinterpret_cast<char*>(buffer.data()), static_cast<std::streamsize>(size));
+	got = static_cast<size_t>(m_input.gcount());
+	return buffer.data();
+}
+
+MappedSampleSource::MappedSampleSource(const unsigned char* data, const size_t size) :
+	m_data(data),
+	m_size(size),
+	m_offset(0),
+	m_current(0),
+	m_released(0)
+{
+}
+
+MappedSampleSource::~MappedSampleSource()
+{
+#if defined(_WIN32)
+	UnmapViewOfFile(m_data);
+#else
+	munmap(const_cast<unsigned char*>(m_data), m_size);
+#endif
+}
+
+std::unique_ptr<MappedSampleSource> MappedSampleSource::Open(const char* const path)
+{
+#if defined(_WIN32)
+	HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+	if (INVALID_HANDLE_VALUE == file)
+		return nullptr;
+	LARGE_INTEGER fileSize;
+	HANDLE mapping = nullptr;
+	if (GetFileSizeEx(file, &fileSize) && fileSize.QuadPart > 0)
+		mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	CloseHandle(file);
+	if (!mapping)
+		return nullptr;
+	void* view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+	CloseHandle(mapping);
+	if (!view)
+		return nullptr;
+	const size_t size = static_cast<size_t>(fileSize.QuadPart);
+#else
+	const int file = open(path, O_RDONLY);
+	if (file < 0)
+		return nullptr;
+	struct stat info;
+	void* view = MAP_FAILED;
+	if (0 == fstat(file, &info) && info.st_size > 0)
+		view = mmap(nullptr, static_cast<size_t>(info.st_size), PROT_READ, MAP_PRIVATE, file, 0);
+	close(file);
+	if (MAP_FAILED == view)
+		return nullptr;
+	const size_t size = static_cast<size_t>(info.st_size);
+	madvise(view, size, MADV_SEQUENTIAL);
+#endif
+	return std::unique_ptr<MappedSampleSource>(new MappedSampleSource(static_cast<const unsigned char*>(view), size));
+}
+
+const unsigned char* MappedSampleSource::Read(const size_t size, size_t& got)
+{
+#if !defined(_WIN32)
+	// only the chunk returned last is still referenced, drop the pages below it
+	const size_t page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+	const size_t released = m_current / page * page;
+	if (released > m_released)
+		madvise(const_cast<unsigned char*>(m_data) + m_released, released - m_released, MADV_DONTNEED);
+	m_released = std::max(m_released, released);
+#endif
+	m_current = m_offset;
+	got = std::min(size, m_size - m_offset);
+	const unsigned char* const chunk = m_data + m_offset;
+	m_offset += got;
+
+	// take the page faults here rather than in the evaluation
+	volatile unsigned char sink = 0;
+	for (size_t i = 0; i < got; i += 4096)
+		sink = sink + chunk[i];
+	return chunk;
+}
@@ -0,0 +1,178 @@
+#pragma once
+
+#include "parser.h"
+#include <functional>
+#include <future>
+
+// Column of raw samples for FunctionStream: NumberType values back to back in host byte order and layout,
+// e.g. (re, im) double pairs for complex<double>.
+class SampleSource
+{
+public:
+	virtual ~SampleSource() = default;
+
+	// Returns up to size bytes, fewer only at the end of the data. They stay valid until the second Read after
+	// this one, so a chunk can be evaluated while the next one is read. Only one thread calls Read at a time.
+	virtual const unsigned char* Read(const size_t size, size_t& got) = 0;
+};
+
+// Reads into two alternating buffers, the stream has to be opened in binary mode
+class StreamSampleSource : public SampleSource
+{
+	std::istream& m_input;
+	std::vector<unsigned char> m_buffers[2];
+	size_t m_next;
+
+public:
+	StreamSampleSource(std::istream& input);
+
+	virtual const unsigned char* Read(const size_t size, size_t& got) override;
+};
+
+// Maps a file read-only and hands out pointers into the mapping. Read faults the pages in on the calling
+// thread (the prefetching one in FunctionStream) and releases the pages of chunks that went out of use,
+// so the resident part of the file stays bounded.
+class MappedSampleSource : public SampleSource
+{
+	const unsigned char* m_data;
+	size_t m_size;
+	size_t m_offset;
+	// start of the chunk returned last, the pages below m_released are already dropped
+	size_t m_current;
+	size_t m_released;
+
+	MappedSampleSource(const unsigned char* data, const size_t size);
+
+public:
+	MappedSampleSource(const MappedSampleSource&) = delete;
+	MappedSampleSource& operator=(const MappedSampleSource&) = delete;
+	~MappedSampleSource();
+
+	// Null if the file cannot be opened or is empty
+	static std::unique_ptr<MappedSampleSource> Open(const char* const path);
+
+	virtual const unsigned char* Read(const size_t size, size_t& got) override;
+	inline size_t Size() const { return m_size; }
+};
+
+// Evaluates a function over columns of samples too large to hold in memory. Each bound slot reads from its
+// own SampleSource; a chunk is evaluated with the batch kernels while the next one is read on another
+// thread, so memory use is two chunks per column plus one of results, whatever the length of the data.
+template <typename NumberType>
+class FunctionStream
+{
+public:
+	// returns false to stop the run
+	using Sink = std::function<bool(const NumberType* values, size_t count)>;
+
+	static constexpr size_t DefaultChunkSize = 1 << 16;
+
+	struct Stats
+	{
+		size_t samples;
+		size_t chunks;
+	};
+
+private:
+	struct Chunk
+	{
+		std::vector<const NumberType*> inputs;
+		size_t count;
+	};
+
+	EvalContext<NumberType> m_context;
+	size_t m_chunkSize;
+	std::vector<SampleSource*> m_sources;
+	// used slots without a source, their Variables() value repeated over a chunk
+	std::vector<std::vector<NumberType>> m_broadcast;
+	std::vector<NumberType> m_output;
+	Stats m_stats;
+
+	Chunk ReadChunk() const
+	{
+		Chunk chunk{ std::vector<const NumberType*>(m_sources.size()), m_chunkSize };
+		for (size_t slot = 0; slot < m_sources.size(); slot++)
+		{
+			if (m_sources[slot])
+			{
+				size_t got = 0;
+				chunk.inputs[slot] = reinterpret_cast<const NumberType*>(m_sources[slot]->Read(m_chunkSize * sizeof(NumberType), got));
+				chunk.count = std::min(chunk.count, got / sizeof(NumberType));
+			}
+			else if (!m_broadcast[slot].empty())
+			{
+				chunk.inputs[slot] = m_broadcast[slot].data();
+			}
+		}
+		return chunk;
+	}
+
+public:
+	FunctionStream(std::shared_ptr<const CompiledFunction<NumberType>> function, const size_t chunkSize = DefaultChunkSize) :
+		m_context(std::move(function)),
+		m_chunkSize(std::max<size_t>(chunkSize, 1)),
+		m_sources(m_context.VariableCount(), nullptr),
+		m_broadcast(m_context.VariableCount()),
+		m_stats()
+	{
+	}
+
+	// source (not owned) supplies the values of slot, null takes them from Variables() again
+	void Bind(const size_t slot, SampleSource* const source)
+	{
+		if (slot >= m_sources.size())
+			throw FuncParseExcept(FuncParseExcept::InvalidVariableIndex, 0);
+		m_sources[slot] = source;
+	}
+
+	// Until the shortest bound column ends, results go to sink one chunk at a time; the pointer is only valid
+	// during the call. Returns the number of results handed to sink, zero if no column is bound. Exceptions
+	// from the sources and the sink propagate once the pending read finished.
+	size_t Run(const Sink& sink)
+	{
+		if (std::none_of(m_sources.begin(), m_sources.end(), [](const SampleSource* source) { return source; }))
+			return 0;
+		const NumberType* const variables = m_context.Variables();
+		for (size_t slot = 0; slot < m_sources.size(); slot++)
+		{
+			if (!m_sources[slot] && m_context.Function()->IsSlotUsed(slot))
+				m_broadcast[slot].assign(m_chunkSize, variables[slot]);
+			else
+				m_broadcast[slot].clear();
+		}
+		m_output.resize(m_chunkSize);
+		m_stats = Stats();
+
+		std::future<Chunk> next = std::async(std::launch::async, &FunctionStream::ReadChunk, this);
+		for (;;)
+		{
+			const Chunk chunk = next.get();
+			if (!chunk.count)
+				break;
+			// a short chunk ends the data, there is nothing left to prefetch
+			const bool last = chunk.count < m_chunkSize;
+			if (!last)
+				next = std::async(std::launch::async, &FunctionStream::ReadChunk, this);
+			m_context.Evaluate(chunk.inputs.data(), m_output.data(), chunk.count);
+			const bool more = sink(m_output.data(), chunk.count);
+			m_stats.samples += chunk.count;
+			m_stats.chunks++;
+			if (last || !more)
+				break;
+		}
+		return m_stats.samples;
+	}
+	// Writes the results as raw NumberType values, stops early if output fails
+	size_t Run(std::ostream& output)
+	{
+		return Run([&output](const NumberType* values, const size_t count)
+		{
+			return static_cast<bool>(output.write(reinterpret_cast<const char*>(values), static_cast<std::streamsize>(count * sizeof(NumberType))));
+		});
+	}
+
+	inline NumberType* Variables() { return m_context.Variables(); }
+	inline EvalContext<NumberType>& Context() { return m_context; }
+	inline size_t ChunkSize() const { return m_chunkSize; }
+	inline const Stats& LastStats() const { return m_stats; }
+};
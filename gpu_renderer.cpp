@@ -0,0 +1,523 @@
+#include "gpu_renderer.h"
+#include "mixed_precision.h"
+#include <cstdint>
+#include <iomanip>
+#include <sstream>
+
+#if defined(_WIN32)
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <dlfcn.h>
+#endif
+
+namespace
+{
+	using Type = FunctionParser::FuncElem::Type;
+	using Precision = FunctionParser::Precision;
+
+	// Scalar layer: real is float, double or a double-double pair, store is what the host hands over
+	const char* const PlainScalar =
+		"real r_from(store hi, store lo) { return hi; }\n"
+		"store r_hi(real a) { return a; }\n"
+		"real r_add(real a, real b) { return a + b; }\n"
+		"real r_sub(real a, real b) { return a - b; }\n"
+		"real r_mul(real a, real b) { return a * b; }\n"
+		"real r_div(real a, real b) { return a / b; }\n"
+		"real r_abs(real a) { return fabs(a); }\n";
+
+	// the operations of mth::DoubleDouble, with the fma product
+	const char* const DoubleDoubleScalar =
+		"#pragma OPENCL FP_CONTRACT OFF\n"
+		"typedef struct { double hi, lo; } real;\n"
+		"real r_from(double hi, double lo) { real r; r.hi = hi; r.lo = lo; return r; }\n"
+		"double r_hi(real a) { return a.hi; }\n"
+		"real r_two_sum(double a, double b) { double s = a + b; double v = s - a; return r_from(s, (a - (s - v)) + (b - v)); }\n"
+		"real r_quick_two_sum(double a, double b) { double s = a + b; return r_from(s, b - (s - a)); }\n"
+		"real r_add(real a, real b)\n"
+		"{\n"
+		"\treal s = r_two_sum(a.hi, b.hi), t = r_two_sum(a.lo, b.lo);\n"
+		"\treal u = r_quick_two_sum(s.hi, s.lo + t.hi);\n"
+		"\treturn r_quick_two_sum(u.hi, u.lo + t.lo);\n"
+		"}\n"
+		"real r_sub(real a, real b) { return r_add(a, r_from(-b.hi, -b.lo)); }\n"
+		"real r_mul(real a, real b)\n"
+		"{\n"
+		"\tdouble p = a.hi * b.hi;\n"
+		"\treturn r_quick_two_sum(p, fma(a.hi, b.hi, -p) + (a.hi * b.lo + a.lo * b.hi));\n"
+		"}\n"
+		"real r_div(real a, real b)\n"
+		"{\n"
+		"\tdouble q1 = a.hi / b.hi;\n"
+		"\treal r = r_sub(a, r_mul(b, r_from(q1, 0.0)));\n"
+		"\tdouble q2 = r.hi / b.hi;\n"
+		"\treal s = r_sub(r, r_mul(b, r_from(q2, 0.0)));\n"
+		"\treturn r_add(r_add(r_from(q1, 0.0), r_from(q2, 0.0)), r_from(s.hi / b.hi, 0.0));\n"
+		"}\n"
+		"real r_abs(real a) { return a.hi < 0.0 ? r_from(-a.hi, -a.lo) : a; }\n";
+
+	const char* const ComplexArithmetic =
+		"typedef struct { real re, im; } cplx;\n"
+		"cplx f_make(real re, real im) { cplx r; r.re = re; r.im = im; return r; }\n"
+		"cplx f_add(cplx a, cplx b) { return f_make(r_add(a.re, b.re), r_add(a.im, b.im)); }\n"
+		"cplx f_sub(cplx a, cplx b) { return f_make(r_sub(a.re, b.re), r_sub(a.im, b.im)); }\n"
+		"cplx f_mul(cplx a, cplx b) { return f_make(r_sub(r_mul(a.re, b.re), r_mul(a.im, b.im)), r_add(r_mul(a.re, b.im), r_mul(a.im, b.re))); }\n"
+		"cplx f_div(cplx a, cplx b)\n"
+		"{\n"
+		"\treal d = r_div(r_from((store)1, (store)0), r_add(r_mul(b.re, b.re), r_mul(b.im, b.im)));\n"
+		"\treturn f_make(r_mul(r_add(r_mul(a.re, b.re), r_mul(a.im, b.im)), d), r_mul(r_sub(r_mul(a.im, b.re), r_mul(a.re, b.im)), d));\n"
+		"}\n"
+		"cplx f_powi(cplx x, int n)\n"
+		"{\n"
+		"\tcplx one = f_make(r_from((store)1, (store)0), r_from((store)0, (store)0)), r = one;\n"
+		"\tfor (uint m = n < 0 ? -n : n; m; m >>= 1)\n"
+		"\t{\n"
+		"\t\tif (m & 1)\n"
+		"\t\t\tr = f_mul(r, x);\n"
+		"\t\tif (m > 1)\n"
+		"\t\t\tx = f_mul(x, x);\n"
+		"\t}\n"
+		"\treturn n < 0 ? f_div(one, r) : r;\n"
+		"}\n"
+		"cplx f_pos(cplx a) { return f_make(r_abs(a.re), r_abs(a.im)); }\n"
+		"cplx f_re(cplx a) { return f_make(r_abs(a.re), r_from((store)0, (store)0)); }\n"
+		"cplx f_im(cplx a) { return f_make(r_abs(a.im), r_from((store)0, (store)0)); }\n";
+
+	// same formulas as libstdc++'s complex functions
+	const char* const ComplexTranscendental =
+		"cplx f_exp(cplx a) { real e = exp(a.re); return f_make(e * cos(a.im), e * sin(a.im)); }\n"
+		"cplx f_log(cplx a) { return f_make(log(hypot(a.re, a.im)), atan2(a.im, a.re)); }\n"
+		"cplx f_pow(cplx a, cplx b) { return a.re == 0 && a.im == 0 ? a : f_exp(f_mul(b, f_log(a))); }\n"
+		"cplx f_sin(cplx a) { return f_make(sin(a.re) * cosh(a.im), cos(a.re) * sinh(a.im)); }\n"
+		"cplx f_cos(cplx a) { return f_make(cos(a.re) * cosh(a.im), -sin(a.re) * sinh(a.im)); }\n"
+		"cplx f_tan(cplx a) { return f_div(f_sin(a), f_cos(a)); }\n"
+		"cplx f_sinh(cplx a) { return f_make(sinh(a.re) * cos(a.im), cosh(a.re) * sin(a.im)); }\n"
+		"cplx f_cosh(cplx a) { return f_make(cosh(a.re) * cos(a.im), sinh(a.re) * sin(a.im)); }\n"
+		"cplx f_tanh(cplx a) { return f_div(f_sinh(a), f_cosh(a)); }\n"
+		"cplx f_abs(cplx a) { return f_make(hypot(a.re, a.im), 0); }\n"
+		"cplx f_ang(cplx a) { return f_make(atan2(a.im, a.re), 0); }\n";
+
+	// indexed by FunctionParser::Function::Name and Operator::Name
+	const char* const FunctionNames[] = { "f_sin", "f_cos", "f_tan", "f_sinh", "f_cosh", "f_tanh", "f_exp", "f_log", "f_abs", "f_pos", "f_ang", "f_re", "f_im" };
+	const char* const OperatorNames[] = { "f_add", "f_sub", "f_mul", "f_div", "f_pow" };
+	static_assert(std::size(FunctionNames) == FunctionParser::Function::NameCount, "one name per function");
+
+	bool SmallIntExponent(const FunctionDag& dag, const FunctionDag::Node& node, int& exponent)
+	{
+		if (FunctionParser::Operator::Name::pow != node.op || Type::Constant != dag[node.params[1]].type)
+			return false;
+		const std::complex<double> value = dag[node.params[1]].value;
+		if (value.imag() != 0.0 || value.real() != std::floor(value.real()) || std::abs(value.real()) > FunctionParser::MaxIntPower || value.real() == 0.0)
+			return false;
+		exponent = static_cast<int>(value.real());
+		return true;
+	}
+
+	std::string Source(const FunctionDag& dag, const Precision precision)
+	{
+		const bool single = Precision::Single == precision;
+		const char* const suffix = single ? "f" : "";
+		// hex literals are exact, non-finite folded constants go through the OpenCL macros
+		const auto literal = [&](std::ostream& out, const double value) -> std::ostream&
+		{
+			if (std::isnan(value))
+				return out << "(store)NAN";
+			if (std::isinf(value))
+				return out << (value < 0 ? "-" : "") << "(store)INFINITY";
+			if (single)
+				return out << std::hexfloat << static_cast<float>(value) << std::defaultfloat << suffix;
+			return out << std::hexfloat << value << std::defaultfloat;
+		};
+
+		std::ostringstream os;
+
+		if (!single)
+			os << "#pragma OPENCL EXTENSION cl_khr_fp64 : enable\n";
+		os << "typedef " << (single ? "float" : "double") << " store;\n";
+		if (Precision::Extended == precision)
+			os << DoubleDoubleScalar;
+		else
+			os << "typedef store real;\n" << PlainScalar;
+		os << ComplexArithmetic;
+		if (Precision::Extended != precision)
+			os << ComplexTranscendental;
+
+		// nodes that do not depend on z are evaluated once per pixel, ahead of the loop
+		std::vector<bool> varying(dag.Size(), false);
+		std::ostringstream invariant, body;
+		for (size_t id = 0; id < dag.Size(); id++)
+		{
+			const FunctionDag::Node& node = dag[id];
+			for (const size_t param : node.params)
+				if (FunctionDag::NoParam != param && varying[param])
+					varying[id] = true;
+			if (Type::Variable == node.type && FunctionParser::VariableSlot(node.index) == GpuRenderer::ZSlot)
+				varying[id] = true;
+
+			std::ostringstream& out = varying[id] ? body : invariant;
+			out << (varying[id] ? "\t\t" : "\t") << "const cplx v" << id << " = ";
+			int exponent;
+			switch (node.type)
+			{
+			case Type::Variable:
+			{
+				const size_t slot = FunctionParser::VariableSlot(node.index);
+				if (GpuRenderer::CSlot == slot)
+					out << "c";
+				else if (GpuRenderer::ZSlot == slot)
+					out << "z";
+				else
+					out << "f_make(r_from(vars[" << 2 * slot << "], (store)0), r_from(vars[" << 2 * slot + 1 << "], (store)0))";
+				break;
+			}
+			case Type::Constant:
+				out << "f_make(r_from(";
+				literal(out, node.value.real()) << ", (store)0), r_from(";
+				literal(out, node.value.imag()) << ", (store)0))";
+				break;
+			case Type::Function:
+				if (Precision::Extended == precision && FunctionParser::Function::Name::pos != node.function &&
+					FunctionParser::Function::Name::re != node.function && FunctionParser::Function::Name::im != node.function)
+					throw FuncParseExcept(FuncParseExcept::UnsupportedPrecision, 0);
+				out << FunctionNames[static_cast<size_t>(node.function)] << "(v" << node.params[0] << ")";
+				break;
+			case Type::Operator:
+				if (SmallIntExponent(dag, node, exponent))
+					out << "f_powi(v" << node.params[0] << ", " << exponent << ")";
+				else if (Precision::Extended == precision && FunctionParser::Operator::Name::pow == node.op)
+					throw FuncParseExcept(FuncParseExcept::UnsupportedPrecision, 0);
+				else
+					out << OperatorNames[static_cast<size_t>(node.op)] << "(v" << node.params[0] << ", v" << node.params[1] << ")";
+				break;
+			default:
+				throw FuncParseExcept(FuncParseExcept::UnknownError, 0);
+			}
+			out << ";\n";
+		}
+
+		// frame: minRe, minIm, stepRe, stepIm as (hi, lo) pairs; vars: (re, im) per slot; one count per pixel
+		// of the band starting at firstRow
+		os << "__kernel void iterate(__global const store* frame, __global const store* vars, const uint width, const uint firstRow,\n"
+			"\tconst uint maxIter, const store limit, __global uint* iterations)\n"
+			"{\n"
+			"\tconst uint x = (uint)get_global_id(0), row = (uint)get_global_id(1);\n"
+			"\tconst real re = r_add(r_from(frame[0], frame[1]), r_mul(r_from(frame[4], frame[5]), r_from((store)x + (store)0.5" << suffix << ", (store)0)));\n"
+			"\tconst real im = r_add(r_from(frame[2], frame[3]), r_mul(r_from(frame[6], frame[7]), r_from((store)(firstRow + row) + (store)0.5" << suffix << ", (store)0)));\n"
+			"\tconst cplx c = f_make(re, im);\n"
+			<< invariant.str() <<
+			"\tcplx z = f_make(r_from((store)0, (store)0), r_from((store)0, (store)0));\n"
+			"\tuint n = 0;\n"
+			"\tfor (; n < maxIter && r_hi(z.re) * r_hi(z.re) + r_hi(z.im) * r_hi(z.im) <= limit; n++)\n"
+			"\t{\n"
+			<< body.str() <<
+			"\t\tz = v" << dag.Root() << ";\n"
+			"\t}\n"
+			"\titerations[row * width + x] = n;\n"
+			"}\n";
+		return os.str();
+	}
+
+	// The OpenCL 1.2 entry points used here, all handles are opaque pointers
+	using ClInt = std::int32_t;
+	using ClUint = std::uint32_t;
+	using ClUlong = std::uint64_t;
+	using Handle = void*;
+
+	constexpr ClInt ClSuccess = 0;
+	constexpr ClUlong ClDeviceTypeGpu = 1 << 2;
+	constexpr ClUlong ClDeviceTypeAll = 0xFFFFFFFF;
+	constexpr ClUint ClDeviceName = 0x102B;
+	constexpr ClUint ClDeviceDoubleFpConfig = 0x1032;
+	constexpr ClUlong ClMemWriteOnly = 1 << 1;
+	constexpr ClUlong ClMemReadOnly = 1 << 2;
+	constexpr ClUlong ClMemCopyHostPtr = 1 << 5;
+	constexpr ClUint ClTrue = 1;
+
+	struct OpenCl
+	{
+		ClInt(*GetPlatformIDs)(ClUint, Handle*, ClUint*);
+		ClInt(*GetDeviceIDs)(Handle, ClUlong, ClUint, Handle*, ClUint*);
+		ClInt(*GetDeviceInfo)(Handle, ClUint, size_t, void*, size_t*);
+		Handle(*CreateContext)(const intptr_t*, ClUint, const Handle*, void(*)(const char*, const void*, size_t, void*), void*, ClInt*);
+		Handle(*CreateCommandQueue)(Handle, Handle, ClUlong, ClInt*);
+		Handle(*CreateProgramWithSource)(Handle, ClUint, const char**, const size_t*, ClInt*);
+		ClInt(*BuildProgram)(Handle, ClUint, const Handle*, const char*, void(*)(Handle, void*), void*);
+		Handle(*CreateKernel)(Handle, const char*, ClInt*);
+		Handle(*CreateBuffer)(Handle, ClUlong, size_t, void*, ClInt*);
+		ClInt(*SetKernelArg)(Handle, ClUint, size_t, const void*);
+		ClInt(*EnqueueNDRangeKernel)(Handle, Handle, ClUint, const size_t*, const size_t*, const size_t*, ClUint, const Handle*, Handle*);
+		ClInt(*EnqueueReadBuffer)(Handle, Handle, ClUint, size_t, size_t, void*, ClUint, const Handle*, Handle*);
+		ClInt(*ReleaseMemObject)(Handle);
+		ClInt(*ReleaseKernel)(Handle);
+		ClInt(*ReleaseProgram)(Handle);
+		ClInt(*ReleaseCommandQueue)(Handle);
+		ClInt(*ReleaseContext)(Handle);
+	};
+
+	// null if there is no OpenCL library or it lacks an entry point
+	const OpenCl* LoadOpenCl()
+	{
+		static const std::unique_ptr<const OpenCl> api = []() -> std::unique_ptr<const OpenCl>
+		{
+#if defined(_WIN32)
+			HMODULE library = LoadLibraryA("OpenCL.dll");
+			const auto symbol = [&](const char* name) { return reinterpret_cast<void*>(GetProcAddress(library, name)); };
+#else
+			void* library = dlopen("libOpenCL.so.1", RTLD_NOW | RTLD_LOCAL);
+			if (!library)
+				library = dlopen("libOpenCL.so", RTLD_NOW | RTLD_LOCAL);
+			const auto symbol = [&](const char* name) { return dlsym(library, name); };
+#endif
+			if (!library)
+				return nullptr;
+			std::unique_ptr<OpenCl> loaded = std::make_unique<OpenCl>();
+			bool complete = true;
+			const auto resolve = [&](auto& function, const char* name)
+			{
+				function = reinterpret_cast<std::remove_reference_t<decltype(function)>>(symbol(name));
+				complete = complete && function;
+			};
+			resolve(loaded->GetPlatformIDs, "clGetPlatformIDs");
+			resolve(loaded->GetDeviceIDs, "clGetDeviceIDs");
+			resolve(loaded->GetDeviceInfo, "clGetDeviceInfo");
+			resolve(loaded->CreateContext, "clCreateContext");
+			resolve(loaded->CreateCommandQueue, "clCreateCommandQueue");
+			resolve(loaded->CreateProgramWithSource, "clCreateProgramWithSource");
+			resolve(loaded->BuildProgram, "clBuildProgram");
+			resolve(loaded->CreateKernel, "clCreateKernel");
+			resolve(loaded->CreateBuffer, "clCreateBuffer");
+			resolve(loaded->SetKernelArg, "clSetKernelArg");
+			resolve(loaded->EnqueueNDRangeKernel, "clEnqueueNDRangeKernel");
+			resolve(loaded->EnqueueReadBuffer, "clEnqueueReadBuffer");
+			resolve(loaded->ReleaseMemObject, "clReleaseMemObject");
+			resolve(loaded->ReleaseKernel, "clReleaseKernel");
+			resolve(loaded->ReleaseProgram, "clReleaseProgram");
+			resolve(loaded->ReleaseCommandQueue, "clReleaseCommandQueue");
+			resolve(loaded->ReleaseContext, "clReleaseContext");
+			return complete ? std::move(loaded) : nullptr;
+		}();
+		return api.get();
+	}
+
+	// first GPU, else the first device of any type; null if there is none
+	Handle FindDevice(const OpenCl& cl)
+	{
+		ClUint platformCount = 0;
+		if (ClSuccess != cl.GetPlatformIDs(0, nullptr, &platformCount) || !platformCount)
+			return nullptr;
+		std::vector<Handle> platforms(platformCount);
+		if (ClSuccess != cl.GetPlatformIDs(platformCount, platforms.data(), nullptr))
+			return nullptr;
+		for (const ClUlong type : { ClDeviceTypeGpu, ClDeviceTypeAll })
+		{
+			for (Handle platform : platforms)
+			{
+				Handle device = nullptr;
+				ClUint count = 0;
+				if (ClSuccess == cl.GetDeviceIDs(platform, type, 1, &device, &count) && count)
+					return device;
+			}
+		}
+		return nullptr;
+	}
+
+	template <typename Store>
+	void FillFrame(const GridRegion<mth::DoubleDouble>& region, Store* frame)
+	{
+		const mth::DoubleDouble values[4] = { region.minRe, region.minIm,
+			(region.maxRe - region.minRe) / mth::DoubleDouble(static_cast<double>(region.width)),
+			(region.maxIm - region.minIm) / mth::DoubleDouble(static_cast<double>(region.height)) };
+		for (size_t i = 0; i < 4; i++)
+		{
+			frame[2 * i] = static_cast<Store>(values[i].hi);
+			frame[2 * i + 1] = static_cast<Store>(values[i].lo);
+		}
+	}
+}
+
+struct GpuRenderer::Device
+{
+	const OpenCl& cl;
+	Handle device;
+	Handle context;
+	Handle queue;
+	bool fp64;
+	// programs and kernels per Precision, built on first use
+	Handle programs[3];
+	Handle kernels[3];
+
+	Device(const OpenCl& api, Handle id) :
+		cl(api),
+		device(id),
+		context(nullptr),
+		queue(nullptr),
+		fp64(false),
+		programs(),
+		kernels()
+	{
+		ClInt error = ClSuccess;
+		context = cl.CreateContext(nullptr, 1, &device, nullptr, nullptr, &error);
+		if (ClSuccess == error)
+			queue = cl.CreateCommandQueue(context, device, 0, &error);
+		if (ClSuccess != error)
+		{
+			Release();
+			throw FuncParseExcept(FuncParseExcept::DeviceUnavailable, 0);
+		}
+		ClUlong config = 0;
+		fp64 = ClSuccess == cl.GetDeviceInfo(device, ClDeviceDoubleFpConfig, sizeof(config), &config, nullptr) && config;
+	}
+	~Device()
+	{
+		Release();
+	}
+
+	void Release()
+	{
+		for (size_t i = 0; i < 3; i++)
+		{
+			if (kernels[i])
+				cl.ReleaseKernel(kernels[i]);
+			if (programs[i])
+				cl.ReleaseProgram(programs[i]);
+		}
+		if (queue)
+			cl.ReleaseCommandQueue(queue);
+		if (context)
+			cl.ReleaseContext(context);
+	}
+
+	Handle Kernel(const FunctionDag& dag, const Precision precision)
+	{
+		const size_t tier = static_cast<size_t>(precision);
+		if (kernels[tier])
+			return kernels[tier];
+		const std::string source = Source(dag, precision);
+		const char* text = source.c_str();
+		const size_t length = source.size();
+		ClInt error = ClSuccess;
+		if (!programs[tier])
+			programs[tier] = cl.CreateProgramWithSource(context, 1, &text, &length, &error);
+		if (ClSuccess == error)
+			error = cl.BuildProgram(programs[tier], 1, &device, nullptr, nullptr, nullptr);
+		if (ClSuccess == error)
+			kernels[tier] = cl.CreateKernel(programs[tier], "iterate", &error);
+		if (ClSuccess != error)
+			throw FuncParseExcept(FuncParseExcept::UnknownError, 0);
+		return kernels[tier];
+	}
+};
+
+GpuRenderer::GpuRenderer(const FunctionParser& parser) :
+	m_dag(parser.PseudoCode()),
+	m_supported(parser.SupportedPrecision()),
+	m_variables(std::max(parser.UsedVariables().size(), ZSlot + 1))
+{
+	const OpenCl* cl = LoadOpenCl();
+	Handle device = cl ? FindDevice(*cl) : nullptr;
+	if (!device)
+		throw FuncParseExcept(FuncParseExcept::DeviceUnavailable, 0);
+	m_device = std::make_unique<Device>(*cl, device);
+	if (!m_device->fp64)
+		m_supported = Precision::Single;
+	// build the widest tier up front, so a kernel the driver rejects shows up here
+	m_device->Kernel(m_dag, m_supported);
+}
+
+GpuRenderer::~GpuRenderer() = default;
+
+bool GpuRenderer::Available()
+{
+	const OpenCl* cl = LoadOpenCl();
+	return cl && FindDevice(*cl);
+}
+
+std::string GpuRenderer::KernelSource(const FunctionParser& parser, const Precision precision)
+{
+	if (Precision::Extended == precision && Precision::Extended != parser.SupportedPrecision())
+		throw FuncParseExcept(FuncParseExcept::UnsupportedPrecision, 0);
+	return Source(FunctionDag(parser.PseudoCode()), precision);
+}
+
+std::string GpuRenderer::DeviceName() const
+{
+	char name[256] = {};
+	m_device->cl.GetDeviceInfo(m_device->device, ClDeviceName, sizeof(name) - 1, name, nullptr);
+	return name;
+}
+
+bool GpuRenderer::Render(const GridRegion<mth::DoubleDouble>& region, const Options& options, size_t* iterations, Precision* used)
+{
+	const Precision precision = std::min(std::max(MixedPrecisionRenderer::RequiredPrecision(region), options.minimum), std::min(options.maximum, m_supported));
+	if (used)
+		*used = precision;
+	if (!region.width || !region.height)
+		return true;
+
+	const OpenCl& cl = m_device->cl;
+	Handle kernel = m_device->Kernel(m_dag, precision);
+	const bool single = Precision::Single == precision;
+	const size_t storeSize = single ? sizeof(float) : sizeof(double);
+	std::vector<double> frame(8), vars(2 * m_variables.size());
+	std::vector<float> frameSingle(8), varsSingle(vars.size());
+	FillFrame(region, frame.data());
+	FillFrame(region, frameSingle.data());
+	for (size_t slot = 0; slot < m_variables.size(); slot++)
+	{
+		vars[2 * slot] = m_variables[slot].real();
+		vars[2 * slot + 1] = m_variables[slot].imag();
+	}
+	std::copy(vars.begin(), vars.end(), varsSingle.begin());
+	void* const frameData = single ? static_cast<void*>(frameSingle.data()) : frame.data();
+	void* const varsData = single ? static_cast<void*>(varsSingle.data()) : vars.data();
+
+	const size_t bandHeight = std::max<size_t>(1, std::min(options.bandHeight, region.height));
+	ClInt error = ClSuccess;
+	Handle buffers[3] = {};
+	buffers[0] = cl.CreateBuffer(m_device->context, ClMemReadOnly | ClMemCopyHostPtr, 8 * storeSize, frameData, &error);
+	if (ClSuccess == error)
+		buffers[1] = cl.CreateBuffer(m_device->context, ClMemReadOnly | ClMemCopyHostPtr, vars.size() * storeSize, varsData, &error);
+	if (ClSuccess == error)
+		buffers[2] = cl.CreateBuffer(m_device->context, ClMemWriteOnly, region.width * bandHeight * sizeof(ClUint), nullptr, &error);
+	const ClUint width = static_cast<ClUint>(region.width);
+	const ClUint maxIter = static_cast<ClUint>(std::min<size_t>(options.maxIter, UINT32_MAX));
+	const double limit = options.bailout * options.bailout;
+	const float limitSingle = static_cast<float>(limit);
+	if (ClSuccess == error)
+	{
+		cl.SetKernelArg(kernel, 0, sizeof(Handle), &buffers[0]);
+		cl.SetKernelArg(kernel, 1, sizeof(Handle), &buffers[1]);
+		cl.SetKernelArg(kernel, 2, sizeof(width), &width);
+		cl.SetKernelArg(kernel, 4, sizeof(maxIter), &maxIter);
+		cl.SetKernelArg(kernel, 5, storeSize, single ? static_cast<const void*>(&limitSingle) : &limit);
+		error = cl.SetKernelArg(kernel, 6, sizeof(Handle), &buffers[2]);
+	}
+
+	bool cancelled = false;
+	std::vector<ClUint> band(region.width * bandHeight);
+	for (size_t y = 0; y < region.height && ClSuccess == error; y += bandHeight)
+	{
+		if (options.cancel && options.cancel->load(std::memory_order_relaxed))
+		{
+			cancelled = true;
+			break;
+		}
+		const ClUint firstRow = static_cast<ClUint>(y);
+		const size_t rows = std::min(bandHeight, region.height - y);
+		const size_t global[2] = { region.width, rows };
+		cl.SetKernelArg(kernel, 3, sizeof(firstRow), &firstRow);
+		error = cl.EnqueueNDRangeKernel(m_device->queue, kernel, 2, nullptr, global, nullptr, 0, nullptr, nullptr);
+		if (ClSuccess == error)
+			error = cl.EnqueueReadBuffer(m_device->queue, buffers[2], ClTrue, 0, region.width * rows * sizeof(ClUint), band.data(), 0, nullptr, nullptr);
+		if (ClSuccess == error && iterations)
+			std::copy(band.begin(), band.begin() + region.width * rows, iterations + y * region.width);
+		if (options.progress)
+			options.progress(static_cast<double>(y + rows) / static_cast<double>(region.height));
+	}
+	for (Handle buffer : buffers)
+		if (buffer)
+			cl.ReleaseMemObject(buffer);
+	if (ClSuccess != error)
+		throw FuncParseExcept(FuncParseExcept::DeviceUnavailable, 0);
+	return !cancelled;
+}
@@ -0,0 +1,64 @@
+#pragma once
+
+#include "double_double.h"
+#include "grid.h"
+
+// Escape-time renderer running z <- f(z, c), z0 = 0, on an OpenCL device. The function DAG is translated
+// into OpenCL C once per precision tier and compiled by the driver; the pixel grid is dispatched in bands
+// of rows whose iteration counts are read back as each band finishes. The OpenCL library is loaded at run
+// time, so the build needs no SDK and Available() is simply false on machines without a driver.
+// Tiers follow FunctionParser::Precision: Single runs in float, Double in double and Extended in
+// double-double. The last two need a device with fp64, Extended also a function that SupportedPrecision
+// allows it for.
+class GpuRenderer
+{
+public:
+	using Precision = FunctionParser::Precision;
+	using Complex = std::complex<double>;
+
+	static constexpr size_t CSlot = FunctionParser::VariableSlot(-1);
+	static constexpr size_t ZSlot = FunctionParser::VariableSlot(0);
+
+	struct Options
+	{
+		// rows per dispatch, each band is read back before the next one starts
+		size_t bandHeight = 64;
+		size_t maxIter = 256;
+		double bailout = 2;
+		Precision minimum = Precision::Single;
+		Precision maximum = Precision::Extended;
+		// called on the calling thread after every band with the finished fraction
+		std::function<void(double)> progress;
+		const std::atomic<bool>* cancel = nullptr;
+	};
+
+private:
+	struct Device;
+
+	FunctionDag m_dag;
+	Precision m_supported;
+	std::vector<Complex> m_variables;
+	std::unique_ptr<Device> m_device;
+
+public:
+	// Picks the first GPU, or the first device of any kind if there is none; throws
+	// FuncParseExcept::DeviceUnavailable without one and UnknownError if the driver rejects the kernel.
+	GpuRenderer(const FunctionParser& parser);
+	~GpuRenderer();
+
+	static bool Available();
+	// OpenCL C program with one kernel, iterate, see gpu_renderer.cpp for its arguments. Throws
+	// UnsupportedPrecision for Extended if the function needs more than arithmetic, pos, re and im.
+	static std::string KernelSource(const FunctionParser& parser, const Precision precision);
+
+	// Lowest of the function's SupportedPrecision and what the device can run
+	inline Precision SupportedPrecision() const { return m_supported; }
+	std::string DeviceName() const;
+	// values of the variables other than c and z, indexed by slot like EvalContext::Variables
+	inline Complex* Variables() { return m_variables.data(); }
+	inline size_t VariableCount() const { return m_variables.size(); }
+
+	// Same layout as GridRenderer::Render, c at each pixel centre. The tier is picked like
+	// MixedPrecisionRenderer::Render. Returns false if cancelled.
+	bool Render(const GridRegion<mth::DoubleDouble>& region, const Options& options, size_t* iterations, Precision* used = nullptr);
+};
@@ -0,0 +1,131 @@
+#include "grid.h"
+
+// pool whose worker is running on this thread
+static thread_local const WorkStealingPool* t_workerPool = nullptr;
+
+WorkStealingPool::WorkStealingPool(const size_t threadCount) :
+	m_task(nullptr),
+	m_generation(0),
+	m_pending(0),
+	m_busy(0),
+	m_stop(false),
+	m_error(),
+	m_failed(false)
+{
+	size_t count = threadCount ? threadCount : std::thread::hardware_concurrency();
+	if (!count)
+		count = 1;
+	for (size_t i = 0; i < count; i++)
+		m_queues.push_back(std::make_unique<Queue>());
+	for (size_t i = 0; i < count; i++)
+		m_threads.emplace_back(&WorkStealingPool::WorkerLoop, this, i);
+}
+
+WorkStealingPool::~WorkStealingPool()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_lock);
+		m_stop = true;
+	}
+	m_wake.notify_all();
+	for (std::thread& t : m_threads)
+		t.join();
+}
+
+bool WorkStealingPool::PopTask(const size_t worker, size_t& task)
+{
+	{
+		Queue& own = *m_queues[worker];
+		std::lock_guard<std::mutex> lock(own.lock);
+		if (!own.tasks.empty())
+		{
+			task = own.tasks.back();
+			own.tasks.pop_back();
+			return true;
+		}
+	}
+	for (size_t i = 1; i < m_queues.size(); i++)
+	{
+		Queue& victim = *m_queues[(worker + i) % m_queues.size()];
+		std::lock_guard<std::mutex> lock(victim.lock);
+		if (!victim.tasks.empty())
+		{
+			task = victim.tasks.front();
+			victim.tasks.pop_front();
+			return true;
+		}
+	}
+	return false;
+}
+
+void WorkStealingPool::WorkerLoop(const size_t worker)
+{
+	t_workerPool = this;
+	size_t seenGeneration = 0;
+	for (;;)
+	{
+		const Task* task;
+		{
+			std::unique_lock<std::mutex> lock(m_lock);
+			m_wake.wait(lock, [&] { return m_stop || m_generation != seenGeneration; });
+			if (m_stop)
+				return;
+			seenGeneration = m_generation;
+			task = m_task;
+			m_busy++;
+		}
+		size_t index;
+		size_t completed = 0;
+		while (task && PopTask(worker, index))
+		{
+			completed++;
+			if (m_failed.load(std::memory_order_relaxed))
+				continue;
+			try
+			{
+				(*task)(index, worker);
+			}
+			catch (...)
+			{
+				std::lock_guard<std::mutex> lock(m_lock);
+				if (!m_error)
+					m_error = std::current_exception();
+				m_failed.store(true, std::memory_order_relaxed);
+			}
+		}
+		{
+			std::lock_guard<std::mutex> lock(m_lock);
+			m_pending -= completed;
+			m_busy--;
+		}
+		m_done.notify_all();
+	}
+}
+
+void WorkStealingPool::Run(const size_t taskCount, const Task& task)
+{
+	if (t_workerPool == this)
+		throw std::logic_error("WorkStealingPool::Run called from one of its own tasks");
+	if (!taskCount)
+		return;
+	std::lock_guard<std::mutex> run(m_runLock);
+	{
+		std::lock_guard<std::mutex> lock(m_lock);
+		m_failed.store(false, std::memory_order_relaxed);
+		m_task = &task;
+		m_pending = taskCount;
+		m_generation++;
+		for (size_t i = 0; i < taskCount; i++)
+		{
+			Queue& queue = *m_queues[i % m_queues.size()];
+			std::lock_guard<std::mutex> queueLock(queue.lock);
+			queue.tasks.push_back(i);
+		}
+	}
+	m_wake.notify_all();
+	std::unique_lock<std::mutex> lock(m_lock);
+	m_done.wait(lock, [&] { return 0 == m_pending && 0 == m_busy; });
+	m_task = nullptr;
+	if (m_error)
+		std::rethrow_exception(std::exchange(m_error, nullptr));
+}
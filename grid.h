@@ -0,0 +1,334 @@
+#pragma once
+
+#include "parser.h"
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <utility>
+
+class WorkStealingPool
+{
+public:
+	// task index, worker index
+	using Task = std::function<void(size_t, size_t)>;
+
+private:
+	struct Queue
+	{
+		std::mutex lock;
+		std::deque<size_t> tasks;
+	};
+
+	std::vector<std::thread> m_threads;
+	std::vector<std::unique_ptr<Queue>> m_queues;
+	// held for a whole Run, concurrent calls take turns
+	std::mutex m_runLock;
+	std::mutex m_lock;
+	std::condition_variable m_wake;
+	std::condition_variable m_done;
+	const Task* m_task;
+	size_t m_generation;
+	size_t m_pending;
+	size_t m_busy;
+	bool m_stop;
+	// first exception of the current run; once set the remaining tasks are dropped
+	std::exception_ptr m_error;
+	std::atomic<bool> m_failed;
+
+	bool PopTask(const size_t worker, size_t& task);
+	void WorkerLoop(const size_t worker);
+
+public:
+	WorkStealingPool(const size_t threadCount = 0);
+	~WorkStealingPool();
+
+	// Runs task(i, worker) for every i < taskCount and blocks until all of them finished. If a task throws,
+	// the tasks not yet started are skipped and the first exception is rethrown here. Calls from several
+	// threads are run one after the other; a task must not call Run on its own pool (std::logic_error).
+	void Run(const size_t taskCount, const Task& task);
+	inline size_t ThreadCount() const { return m_threads.size(); }
+};
+
+template <typename Scalar>
+struct GridRegion
+{
+	Scalar minRe, minIm;
+	Scalar maxRe, maxIm;
+	size_t width, height;
+
+	Scalar Re(const size_t x) const { return minRe + (maxRe - minRe) * (static_cast<Scalar>(x) + Scalar(0.5)) / static_cast<Scalar>(width); }
+	Scalar Im(const size_t y) const { return minIm + (maxIm - minIm) * (static_cast<Scalar>(y) + Scalar(0.5)) / static_cast<Scalar>(height); }
+};
+
+template <typename NumberType>
+class GridRenderer
+{
+	using Traits = mth::NumberTraits<NumberType>;
+	using Scalar = typename Traits::Scalar;
+
+public:
+	struct Options
+	{
+		size_t tileSize = 64;
+		size_t maxIter = 256;
+		Scalar bailout = 2;
+		typename EvalContext<NumberType>::InteriorChecks interior;
+		// Mariani-Silver: a tile is evaluated on its border, rectangles whose border has a single iteration
+		// count are filled with it and the others split in two until they are at most minRectangle wide and
+		// high. Ignored when finalValues are requested, filled pixels have none.
+		bool subdivide = false;
+		size_t minRectangle = 6;
+		// called from worker threads, one call at a time, with the finished fraction
+		std::function<void(double)> progress;
+		const std::atomic<bool>* cancel = nullptr;
+	};
+
+private:
+	struct Tile
+	{
+		size_t x, y, width, height;
+	};
+
+	struct Worker
+	{
+		EvalContext<NumberType> context;
+		std::vector<NumberType> c;
+		std::vector<NumberType> z;
+		std::vector<size_t> iterations;
+		// tile-local pixel indices of the next Iterate call and the results of Subdivide
+		std::vector<size_t> pixels;
+		std::vector<size_t> counts;
+		std::vector<char> known;
+
+		Worker(const std::shared_ptr<const CompiledFunction<NumberType>>& function) : context(function) {}
+	};
+
+	std::shared_ptr<const CompiledFunction<NumberType>> m_function;
+	WorkStealingPool& m_pool;
+	std::vector<std::unique_ptr<Worker>> m_workers;
+
+	static std::vector<Tile> MakeTiles(const GridRegion<Scalar>& region, const size_t tileSize)
+	{
+		std::vector<Tile> tiles;
+		for (size_t y = 0; y < region.height; y += tileSize)
+			for (size_t x = 0; x < region.width; x += tileSize)
+				tiles.push_back({ x, y, std::min(tileSize, region.width - x), std::min(tileSize, region.height - y) });
+		return tiles;
+	}
+
+	void RenderTile(Worker& worker, const Tile& tile, const GridRegion<Scalar>& region, const Options& options, size_t* iterations, NumberType* finalValues)
+	{
+		const size_t count = tile.width * tile.height;
+		worker.c.resize(count);
+		worker.z.resize(count);
+		worker.iterations.resize(count);
+		for (size_t y = 0; y < tile.height; y++)
+			for (size_t x = 0; x < tile.width; x++)
+				worker.c[y * tile.width + x] = Traits::Make(region.Re(tile.x + x), region.Im(tile.y + y));
+		worker.context.SetInteriorChecks(options.interior);
+		worker.context.Iterate(worker.c.data(), nullptr, count, options.maxIter, options.bailout, worker.iterations.data(), worker.z.data());
+		for (size_t y = 0; y < tile.height; y++)
+		{
+			const size_t row = (tile.y + y) * region.width + tile.x;
+			if (iterations)
+				std::copy(worker.iterations.begin() + y * tile.width, worker.iterations.begin() + (y + 1) * tile.width, iterations + row);
+			if (finalValues)
+				std::copy(worker.z.begin() + y * tile.width, worker.z.begin() + (y + 1) * tile.width, finalValues + row);
+		}
+	}
+
+	// iterates worker.pixels (indices within tile) into worker.counts
+	void EvaluatePixels(Worker& worker, const Tile& tile, const GridRegion<Scalar>& region, const Options& options)
+	{
+		const size_t count = worker.pixels.size();
+		worker.c.resize(count);
+		worker.iterations.resize(count);
+		for (size_t i = 0; i < count; i++)
+		{
+			const size_t pixel = worker.pixels[i];
+			worker.c[i] = Traits::Make(region.Re(tile.x + pixel % tile.width), region.Im(tile.y + pixel / tile.width));
+		}
+		worker.context.SetInteriorChecks(options.interior);
+		worker.context.Iterate(worker.c.data(), nullptr, count, options.maxIter, options.bailout, worker.iterations.data());
+		for (size_t i = 0; i < count; i++)
+			worker.counts[worker.pixels[i]] = worker.iterations[i];
+	}
+
+	void SubdivideTile(Worker& worker, const Tile& tile, const GridRegion<Scalar>& region, const Options& options, size_t* iterations)
+	{
+		worker.counts.resize(tile.width * tile.height);
+		worker.known.assign(tile.width * tile.height, false);
+		const size_t minRectangle = std::max<size_t>(options.minRectangle, 3);
+		const auto local = [&](const size_t x, const size_t y) { return (y - tile.y) * tile.width + x - tile.x; };
+		const auto add = [&](const size_t x, const size_t y)
+		{
+			const size_t pixel = local(x, y);
+			if (!worker.known[pixel])
+			{
+				worker.known[pixel] = true;
+				worker.pixels.push_back(pixel);
+			}
+		};
+
+		std::vector<Tile> pending(1, tile);
+		while (!pending.empty())
+		{
+			const Tile rect = pending.back();
+			pending.pop_back();
+			const size_t right = rect.x + rect.width - 1, bottom = rect.y + rect.height - 1;
+			worker.pixels.clear();
+			for (size_t x = rect.x; x <= right; x++)
+			{
+				add(x, rect.y);
+				add(x, bottom);
+			}
+			for (size_t y = rect.y + 1; y < bottom; y++)
+			{
+				add(rect.x, y);
+				add(right, y);
+			}
+			EvaluatePixels(worker, tile, region, options);
+			if (rect.width <= 2 || rect.height <= 2)
+				continue;
+
+			const size_t first = worker.counts[local(rect.x, rect.y)];
+			bool uniform = true;
+			for (size_t x = rect.x; uniform && x <= right; x++)
+				uniform = first == worker.counts[local(x, rect.y)] && first == worker.counts[local(x, bottom)];
+			for (size_t y = rect.y + 1; uniform && y < bottom; y++)
+				uniform = first == worker.counts[local(rect.x, y)] && first == worker.counts[local(right, y)];
+			if (uniform)
+			{
+				for (size_t y = rect.y + 1; y < bottom; y++)
+					for (size_t x = rect.x + 1; x < right; x++)
+					{
+						worker.counts[local(x, y)] = first;
+						worker.known[local(x, y)] = true;
+					}
+			}
+			else if (rect.width <= minRectangle && rect.height <= minRectangle)
+			{
+				worker.pixels.clear();
+				for (size_t y = rect.y + 1; y < bottom; y++)
+					for (size_t x = rect.x + 1; x < right; x++)
+						add(x, y);
+				EvaluatePixels(worker, tile, region, options);
+			}
+			else if (rect.width >= rect.height)
+			{
+				// the halves share the middle column, it is only evaluated once
+				const size_t middle = rect.x + rect.width / 2;
+				pending.push_back({ rect.x, rect.y, middle - rect.x + 1, rect.height });
+				pending.push_back({ middle, rect.y, right - middle + 1, rect.height });
+			}
+			else
+			{
+				const size_t middle = rect.y + rect.height / 2;
+				pending.push_back({ rect.x, rect.y, rect.width, middle - rect.y + 1 });
+				pending.push_back({ rect.x, middle, rect.width, bottom - middle + 1 });
+			}
+		}
+		for (size_t y = 0; y < tile.height; y++)
+			std::copy(worker.counts.begin() + y * tile.width, worker.counts.begin() + (y + 1) * tile.width, iterations + (tile.y + y) * region.width + tile.x);
+	}
+
+	// One pass of RenderProgressive: the pixels on the stride grid that the coarser passes did not evaluate,
+	// each filling the stride x stride block it is the corner of
+	void RefineTile(Worker& worker, const Tile& tile, const GridRegion<Scalar>& region, const Options& options, size_t* iterations, const size_t stride, const bool first)
+	{
+		worker.counts.resize(tile.width * tile.height);
+		worker.pixels.clear();
+		for (size_t y = 0; y < tile.height; y += stride)
+			for (size_t x = 0; x < tile.width; x += stride)
+				if (first || (x % (2 * stride)) || (y % (2 * stride)))
+					worker.pixels.push_back(y * tile.width + x);
+		EvaluatePixels(worker, tile, region, options);
+		for (const size_t pixel : worker.pixels)
+		{
+			const size_t x = tile.x + pixel % tile.width, y = tile.y + pixel / tile.width;
+			for (size_t by = y; by < std::min(y + stride, tile.y + tile.height); by++)
+				std::fill(iterations + by * region.width + x, iterations + by * region.width + std::min(x + stride, tile.x + tile.width), worker.counts[pixel]);
+		}
+	}
+
+	// runs render on every tile, progress counts from done of total
+	bool RunTiles(const std::vector<Tile>& tiles, const Options& options, const std::function<void(Worker&, const Tile&)>& render, const size_t done, const size_t total)
+	{
+		std::atomic<size_t> finished(done);
+		std::atomic<bool> cancelled(false);
+		std::mutex progressLock;
+		m_pool.Run(tiles.size(), [&](const size_t task, const size_t worker)
+		{
+			if (cancelled || (options.cancel && *options.cancel))
+			{
+				cancelled = true;
+				return;
+			}
+			render(*m_workers[worker], tiles[task]);
+			const size_t count = ++finished;
+			if (options.progress)
+			{
+				std::lock_guard<std::mutex> lock(progressLock);
+				options.progress(static_cast<double>(count) / static_cast<double>(total));
+			}
+		});
+		return !cancelled;
+	}
+
+public:
+	GridRenderer(std::shared_ptr<const CompiledFunction<NumberType>> function, WorkStealingPool& pool) :
+		m_function(std::move(function)),
+		m_pool(pool)
+	{
+		for (size_t i = 0; i < m_pool.ThreadCount(); i++)
+			m_workers.push_back(std::make_unique<Worker>(m_function));
+	}
+
+	inline EvalContext<NumberType>& WorkerContext(const size_t worker) { return m_workers[worker]->context; }
+
+	// Escape-time render of z <- f(z, c) with c at each pixel centre, buffers are width * height row-major,
+	// either may be null. Returns false if cancelled, leaving unfinished tiles untouched.
+	bool Render(const GridRegion<Scalar>& region, const Options& options, size_t* iterations, NumberType* finalValues = nullptr)
+	{
+		const std::vector<Tile> tiles = MakeTiles(region, std::max<size_t>(options.tileSize, 1));
+		const bool subdivide = options.subdivide && iterations && !finalValues;
+		return RunTiles(tiles, options, [&](Worker& worker, const Tile& tile)
+		{
+			if (subdivide)
+				SubdivideTile(worker, tile, region, options, iterations);
+			else
+				RenderTile(worker, tile, region, options, iterations, finalValues);
+		}, 0, tiles.size());
+	}
+	// Coarse to fine for a quick first frame: passes at strides coarseStep (rounded up to a power of two),
+	// half of it and so on down to 1 each evaluate the pixels new at their stride and fill the block they are
+	// the top left corner of, so after every pass iterations holds the whole picture at that resolution and
+	// the last pass equals Render. pass(stride) is called on the calling thread after each pass; progress
+	// runs once from 0 to 1 over all of them. Returns false if cancelled.
+	bool RenderProgressive(const GridRegion<Scalar>& region, const Options& options, size_t* iterations, const std::function<void(size_t)>& pass,
+		const size_t coarseStep = 8)
+	{
+		size_t stride = 1;
+		while (stride < coarseStep)
+			stride *= 2;
+		// tiles aligned to the coarsest stride, so no block reaches into another tile
+		const std::vector<Tile> tiles = MakeTiles(region, (std::max<size_t>(options.tileSize, 1) + stride - 1) / stride * stride);
+		size_t passes = 0;
+		for (size_t s = stride; s; s /= 2)
+			passes++;
+		for (size_t done = 0; stride; stride /= 2, done++)
+		{
+			const bool first = !done;
+			if (!RunTiles(tiles, options, [&](Worker& worker, const Tile& tile) { RefineTile(worker, tile, region, options, iterations, stride, first); },
+				done * tiles.size(), passes * tiles.size()))
+				return false;
+			if (pass)
+				pass(stride);
+		}
+		return true;
+	}
+};
@@ -0,0 +1,78 @@
+#pragma once
+
+#include "parser.h"
+
+// Function that follows an edited source text, e.g. a formula editor that updates on every keystroke. An
+// edit that only changes literals keeps the compiled program (and its machine code) and just rewrites the
+// constants; anything else compiles anew. The text is always parsed in full, parsing costs a fraction of
+// compiling, so only the compile is incremental.
+template <typename NumberType>
+class IncrementalFunction
+{
+public:
+	using Backend = typename CompiledFunction<NumberType>::Backend;
+
+	enum class Change
+	{
+		None,
+		// same program, the constants were rewritten in place
+		Constants,
+		// new function and context; variables, parameters (by name) and the profile were carried over
+		Recompiled
+	};
+
+private:
+	Backend m_backend;
+	std::string m_source;
+	std::unique_ptr<FunctionParser> m_parser;
+	std::shared_ptr<CompiledFunction<NumberType>> m_function;
+	std::unique_ptr<EvalContext<NumberType>> m_context;
+
+public:
+	IncrementalFunction(const std::string_view function, const Backend backend = Backend::Bytecode) :
+		m_backend(backend),
+		m_source(function),
+		m_parser(std::make_unique<FunctionParser>(function)),
+		m_function(std::make_shared<CompiledFunction<NumberType>>(*m_parser, backend)),
+		m_context(std::make_unique<EvalContext<NumberType>>(m_function))
+	{
+	}
+
+	// Parse and compile errors propagate as FuncParseExcept with offsets into function and leave the previous
+	// function in place. After Recompiled, references to the old Context are no longer valid.
+	Change Update(const std::string_view function)
+	{
+		if (function == m_source)
+			return Change::None;
+
+		std::unique_ptr<FunctionParser> parser = std::make_unique<FunctionParser>(function);
+		if (m_function->PatchConstants(*parser))
+		{
+			m_context->ReloadConstants();
+			m_parser = std::move(parser);
+			m_source = function;
+			return Change::Constants;
+		}
+
+		std::shared_ptr<CompiledFunction<NumberType>> compiled = std::make_shared<CompiledFunction<NumberType>>(*parser, m_backend);
+		std::unique_ptr<EvalContext<NumberType>> context = std::make_unique<EvalContext<NumberType>>(compiled);
+		const NumberType* const variables = m_context->Variables();
+		for (size_t slot = 0; slot < std::min(m_context->VariableCount(), context->VariableCount()); slot++)
+			if (!m_function->IsParameterSlot(slot))
+				context->Variables()[slot] = variables[slot];
+		for (const std::string& name : m_function->Parameters())
+			context->SetParameter(name, variables[m_function->ParameterSlot(name)]);
+		context->SetProfile(m_context->Profile());
+		m_parser = std::move(parser);
+		m_function = std::move(compiled);
+		m_context = std::move(context);
+		m_source = function;
+		return Change::Recompiled;
+	}
+
+	inline const std::string& Source() const { return m_source; }
+	inline const FunctionParser& Parser() const { return *m_parser; }
+	inline std::shared_ptr<const CompiledFunction<NumberType>> Function() const { return m_function; }
+	inline EvalContext<NumberType>& Context() { return *m_context; }
+	inline const EvalContext<NumberType>& Context() const { return *m_context; }
+};
@@ -0,0 +1,374 @@
+#include "parser.h"
+#include <cstring>
+#include <map>
+#include <mutex>
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define FUNCTION_JIT_X64
+#if defined(_WIN32)
+#define FUNCTION_JIT_WIN64
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#endif
+#endif
+
+using OpCode = FunctionBytecode::OpCode;
+using Instruction = FunctionBytecode::Instruction;
+
+typedef void(*JitHelper)(double*);
+
+template <typename T>
+static void ApplyHelper(const OpCode op, T* a)
+{
+	switch (op)
+	{
+	case OpCode::Pow: a[0] = std::pow(a[0], a[1]); break;
+	case OpCode::Sin: a[0] = std::sin(a[0]); break;
+	case OpCode::Cos: a[0] = std::cos(a[0]); break;
+	case OpCode::Tan: a[0] = std::tan(a[0]); break;
+	case OpCode::Sinh: a[0] = std::sinh(a[0]); break;
+	case OpCode::Cosh: a[0] = std::cosh(a[0]); break;
+	case OpCode::Tanh: a[0] = std::tanh(a[0]); break;
+	case OpCode::Exp: a[0] = std::exp(a[0]); break;
+	case OpCode::Log: a[0] = std::log(a[0]); break;
+	case OpCode::Abs: a[0] = std::abs(a[0]); break;
+	case OpCode::Pos: a[0] = mth::pos(a[0]); break;
+	case OpCode::Ang: a[0] = mth::ang(a[0]); break;
+	case OpCode::Re: a[0] = mth::re(a[0]); break;
+	case OpCode::Im: a[0] = mth::im(a[0]); break;
+	default: break;
+	}
+}
+
+template <OpCode op> static void RealHelper(double* a) { ApplyHelper(op, a); }
+template <OpCode op> static void ComplexHelper(double* a) { ApplyHelper(op, reinterpret_cast<std::complex<double>*>(a)); }
+
+static JitHelper GetHelper(const OpCode op, const bool isComplex)
+{
+	static const JitHelper s_realHelpers[] = {
+		RealHelper<OpCode::Pow>, RealHelper<OpCode::Sin>, RealHelper<OpCode::Cos>, RealHelper<OpCode::Tan>,
+		RealHelper<OpCode::Sinh>, RealHelper<OpCode::Cosh>, RealHelper<OpCode::Tanh>, RealHelper<OpCode::Exp>,
+		RealHelper<OpCode::Log>, RealHelper<OpCode::Abs>, RealHelper<OpCode::Pos>, RealHelper<OpCode::Ang>,
+		RealHelper<OpCode::Re>, RealHelper<OpCode::Im>
+	};
+	static const JitHelper s_complexHelpers[] = {
+		ComplexHelper<OpCode::Pow>, ComplexHelper<OpCode::Sin>, ComplexHelper<OpCode::Cos>, ComplexHelper<OpCode::Tan>,
+		ComplexHelper<OpCode::Sinh>, ComplexHelper<OpCode::Cosh>, ComplexHelper<OpCode::Tanh>, ComplexHelper<OpCode::Exp>,
+		ComplexHelper<OpCode::Log>, ComplexHelper<OpCode::Abs>, ComplexHelper<OpCode::Pos>, ComplexHelper<OpCode::Ang>,
+		ComplexHelper<OpCode::Re>, ComplexHelper<OpCode::Im>
+	};
+	const size_t n = static_cast<size_t>(op) - static_cast<size_t>(OpCode::Pow);
+	return isComplex ? s_complexHelpers[n] : s_realHelpers[n];
+}
+
+#ifdef FUNCTION_JIT_X64
+
+// rbx holds the variable array, rbp the scratch array
+static const unsigned char g_VariableBase = 3;
+static const unsigned char g_ScratchBase = 5;
+
+class X64Emitter
+{
+	std::vector<unsigned char> m_code;
+
+	void Byte(const unsigned char b) { m_code.push_back(b); }
+	void Dword(const unsigned v)
+	{
+		for (int i = 0; i < 4; i++)
+			Byte(static_cast<unsigned char>(v >> (8 * i)));
+	}
+	void MemOperand(const unsigned char xmm, const unsigned char base, const size_t offset)
+	{
+		Byte(static_cast<unsigned char>(0x80 | (xmm << 3) | base));
+		Dword(static_cast<unsigned>(offset));
+	}
+
+public:
+	std::vector<unsigned char>& Code() { return m_code; }
+
+	void Prologue()
+	{
+		Byte(0x53);                                   // push rbx
+		Byte(0x55);                                   // push rbp
+#ifdef FUNCTION_JIT_WIN64
+		Byte(0x48); Byte(0x83); Byte(0xEC); Byte(0x28); // sub rsp, 40
+		Byte(0x48); Byte(0x89); Byte(0xCB);             // mov rbx, rcx
+		Byte(0x48); Byte(0x89); Byte(0xD5);             // mov rbp, rdx
+#else
+		Byte(0x48); Byte(0x83); Byte(0xEC); Byte(0x08); // sub rsp, 8
+		Byte(0x48); Byte(0x89); Byte(0xFB);             // mov rbx, rdi
+		Byte(0x48); Byte(0x89); Byte(0xF5);             // mov rbp, rsi
+#endif
+	}
+	void Epilogue()
+	{
+#ifdef FUNCTION_JIT_WIN64
+		Byte(0x48); Byte(0x83); Byte(0xC4); Byte(0x28); // add rsp, 40
+#else
+		Byte(0x48); Byte(0x83); Byte(0xC4); Byte(0x08); // add rsp, 8
+#endif
+		Byte(0x5D);                                   // pop rbp
+		Byte(0x5B);                                   // pop rbx
+		Byte(0xC3);                                   // ret
+	}
+	void Load(const unsigned char xmm, const unsigned char base, const size_t offset)
+	{
+		Byte(0xF2); Byte(0x0F); Byte(0x10); MemOperand(xmm, base, offset);
+	}
+	void Store(const unsigned char base, const size_t offset, const unsigned char xmm)
+	{
+		Byte(0xF2); Byte(0x0F); Byte(0x11); MemOperand(xmm, base, offset);
+	}
+	void Move(const unsigned char dst, const unsigned char src)
+	{
+		Byte(0x66); Byte(0x0F); Byte(0x28); Byte(static_cast<unsigned char>(0xC0 | (dst << 3) | src));
+	}
+	// op: 0x58 add, 0x59 mul, 0x5C sub, 0x5E div
+	void Arith(const unsigned char op, const unsigned char dst, const unsigned char src)
+	{
+		Byte(0xF2); Byte(0x0F); Byte(op); Byte(static_cast<unsigned char>(0xC0 | (dst << 3) | src));
+	}
+	void ArithMem(const unsigned char op, const unsigned char dst, const unsigned char base, const size_t offset)
+	{
+		Byte(0xF2); Byte(0x0F); Byte(op); MemOperand(dst, base, offset);
+	}
+	// op: 0x54 and, 0x55 andn (dst = ~dst & src), 0x56 or, 0x57 xor
+	void Logic(const unsigned char op, const unsigned char dst, const unsigned char src)
+	{
+		Byte(0x66); Byte(0x0F); Byte(op); Byte(static_cast<unsigned char>(0xC0 | (dst << 3) | src));
+	}
+	// dst = all ones where !(dst < src), NaN included
+	void CompareNotLess(const unsigned char dst, const unsigned char src)
+	{
+		Byte(0xF2); Byte(0x0F); Byte(0xC2); Byte(static_cast<unsigned char>(0xC0 | (dst << 3) | src)); Byte(0x05);
+	}
+	void LoadBits(const unsigned char xmm, const unsigned long long bits)
+	{
+		Byte(0x48); Byte(0xB8);                                              // mov rax, imm64
+		for (int i = 0; i < 8; i++)
+			Byte(static_cast<unsigned char>(bits >> (8 * i)));
+		Byte(0x66); Byte(0x48); Byte(0x0F); Byte(0x6E); Byte(static_cast<unsigned char>(0xC0 | (xmm << 3))); // movq xmm, rax
+	}
+	// dst = mask ? a : b, clobbers tmp
+	void Select(const unsigned char dst, const unsigned char mask, const unsigned char a, const unsigned char b, const unsigned char tmp)
+	{
+		Move(dst, mask); Logic(0x54, dst, a);
+		Move(tmp, mask); Logic(0x55, tmp, b);
+		Logic(0x56, dst, tmp);
+	}
+	void Call(const JitHelper helper, const size_t scratchOffset)
+	{
+#ifdef FUNCTION_JIT_WIN64
+		Byte(0x48); Byte(0x8D); MemOperand(1, g_ScratchBase, scratchOffset); // lea rcx, [rbp + offset]
+#else
+		Byte(0x48); Byte(0x8D); MemOperand(7, g_ScratchBase, scratchOffset); // lea rdi, [rbp + offset]
+#endif
+		Byte(0x48); Byte(0xB8);                                              // mov rax, imm64
+		unsigned long long address;
+		std::memcpy(&address, &helper, sizeof(address));
+		for (int i = 0; i < 8; i++)
+			Byte(static_cast<unsigned char>(address >> (8 * i)));
+		Byte(0xFF); Byte(0xD0);                                              // call rax
+	}
+};
+
+static const unsigned char g_ArithCodes[] = { 0x58, 0x5C, 0x59, 0x5E };
+
+static std::vector<unsigned char> EmitProgram(const std::vector<Instruction>& program, const bool isComplex, const size_t stackDepth, const size_t tempCount)
+{
+	const size_t width = isComplex ? 2 : 1;
+	const size_t slotSize = width * sizeof(double);
+	const size_t tempBase = stackDepth * slotSize;
+	const size_t constantBase = (stackDepth + tempCount) * slotSize;
+
+	X64Emitter e;
+	e.Prologue();
+	size_t top = 0;
+	auto copy = [&](const unsigned char srcBase, const size_t src, const unsigned char dstBase, const size_t dst)
+	{
+		for (size_t k = 0; k < width; k++)
+		{
+			e.Load(0, srcBase, src + k * sizeof(double));
+			e.Store(dstBase, dst + k * sizeof(double), 0);
+		}
+	};
+	for (const Instruction& ins : program)
+	{
+		const size_t a = (top - 1) * slotSize;
+		const size_t b = top * slotSize;
+		switch (ins.op)
+		{
+		case OpCode::PushConstant: copy(g_ScratchBase, constantBase + ins.index * slotSize, g_ScratchBase, top++ * slotSize); break;
+		case OpCode::PushVariable: copy(g_VariableBase, ins.index * slotSize, g_ScratchBase, top++ * slotSize); break;
+		case OpCode::Dup: copy(g_ScratchBase, a, g_ScratchBase, b); top++; break;
+		case OpCode::Store: copy(g_ScratchBase, a, g_ScratchBase, tempBase + ins.index * slotSize); break;
+		case OpCode::Load: copy(g_ScratchBase, tempBase + ins.index * slotSize, g_ScratchBase, top++ * slotSize); break;
+		case OpCode::Add:
+		case OpCode::Sub:
+		{
+			top--;
+			const unsigned char code = g_ArithCodes[static_cast<size_t>(ins.op) - static_cast<size_t>(OpCode::Add)];
+			for (size_t k = 0; k < width; k++)
+			{
+				e.Load(0, g_ScratchBase, a - slotSize + k * sizeof(double));
+				e.ArithMem(code, 0, g_ScratchBase, b - slotSize + k * sizeof(double));
+				e.Store(g_ScratchBase, a - slotSize + k * sizeof(double), 0);
+			}
+			break;
+		}
+		case OpCode::Mul:
+		case OpCode::Div:
+		{
+			top--;
+			const size_t lhs = a - slotSize, rhs = b - slotSize;
+			const unsigned char code = g_ArithCodes[static_cast<size_t>(ins.op) - static_cast<size_t>(OpCode::Add)];
+			if (!isComplex)
+			{
+				e.Load(0, g_ScratchBase, lhs);
+				e.ArithMem(code, 0, g_ScratchBase, rhs);
+				e.Store(g_ScratchBase, lhs, 0);
+				break;
+			}
+			e.Load(0, g_ScratchBase, lhs);
+			e.Load(1, g_ScratchBase, lhs + sizeof(double));
+			e.Load(2, g_ScratchBase, rhs);
+			e.Load(3, g_ScratchBase, rhs + sizeof(double));
+			if (OpCode::Mul == ins.op)
+			{
+				e.Move(4, 0); e.Arith(0x59, 4, 2);  // ar * br
+				e.Move(5, 1); e.Arith(0x59, 5, 3);  // ai * bi
+				e.Arith(0x5C, 4, 5);
+				e.Arith(0x59, 0, 3);                // ar * bi
+				e.Arith(0x59, 1, 2);                // ai * br
+				e.Arith(0x58, 0, 1);
+				e.Store(g_ScratchBase, lhs, 4);
+				e.Store(g_ScratchBase, lhs + sizeof(double), 0);
+			}
+			else
+			{
+				// mth::ComplexDivide: p, q are br, bi ordered by magnitude, x, y are ar, ai in the same order
+				e.LoadBits(4, 0x7FFFFFFFFFFFFFFFull);
+				e.Move(5, 2); e.Logic(0x54, 5, 4);
+				e.Move(6, 3); e.Logic(0x54, 6, 4);
+				e.CompareNotLess(5, 6);             // xmm5: |br| >= |bi|
+				e.Select(6, 5, 2, 3, 7);            // p
+				e.Select(7, 5, 3, 2, 4);            // q
+				e.Move(4, 7);
+				e.Arith(0x5E, 7, 6);                // r = q / p
+				e.Arith(0x59, 4, 7);
+				e.Arith(0x58, 4, 6);                // d = p + q * r
+				e.Select(2, 5, 0, 1, 3);            // x
+				e.Select(3, 5, 1, 0, 6);            // y
+				e.Move(0, 3); e.Arith(0x59, 0, 7);
+				e.Arith(0x58, 0, 2);
+				e.Arith(0x5E, 0, 4);                // (x + y * r) / d
+				e.Move(1, 2); e.Arith(0x59, 1, 7);
+				e.Arith(0x5C, 3, 1);
+				e.Arith(0x5E, 3, 4);                // t = (y - x * r) / d
+				e.LoadBits(6, 0x8000000000000000ull);
+				e.Move(1, 5); e.Logic(0x55, 1, 6);
+				e.Logic(0x57, 3, 1);                // -t unless |br| >= |bi|
+				e.Store(g_ScratchBase, lhs, 0);
+				e.Store(g_ScratchBase, lhs + sizeof(double), 3);
+			}
+			break;
+		}
+		case OpCode::Pow:
+			top--;
+			e.Call(GetHelper(ins.op, isComplex), a - slotSize);
+			break;
+		default:
+			e.Call(GetHelper(ins.op, isComplex), a);
+			break;
+		}
+	}
+	e.Epilogue();
+	return std::move(e.Code());
+}
+
+#endif
+
+FunctionJit::FunctionJit(const std::vector<Instruction>& program, const bool isComplex, const size_t stackDepth, const size_t tempCount) :
+	m_code(nullptr),
+	m_codeSize(0),
+	m_kernel(nullptr)
+{
+#ifdef FUNCTION_JIT_X64
+	const std::vector<unsigned char> code = EmitProgram(program, isComplex, stackDepth, tempCount);
+	m_codeSize = code.size();
+#ifdef FUNCTION_JIT_WIN64
+	m_code = VirtualAlloc(nullptr, m_codeSize, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+	if (!m_code)
+		throw std::bad_alloc();
+	std::memcpy(m_code, code.data(), m_codeSize);
+	DWORD oldProtect;
+	VirtualProtect(m_code, m_codeSize, PAGE_EXECUTE_READ, &oldProtect);
+#else
+	m_code = mmap(nullptr, m_codeSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (MAP_FAILED == m_code)
+	{
+		m_code = nullptr;
+		throw std::bad_alloc();
+	}
+	std::memcpy(m_code, code.data(), m_codeSize);
+	if (mprotect(m_code, m_codeSize, PROT_READ | PROT_EXEC))
+	{
+		munmap(m_code, m_codeSize);
+		m_code = nullptr;
+		throw std::bad_alloc();
+	}
+#endif
+	m_kernel = reinterpret_cast<Kernel>(m_code);
+#else
+	throw std::runtime_error("JIT is not supported on this platform");
+#endif
+}
+
+FunctionJit::~FunctionJit()
+{
+#ifdef FUNCTION_JIT_X64
+	if (m_code)
+	{
+#ifdef FUNCTION_JIT_WIN64
+		VirtualFree(m_code, 0, MEM_RELEASE);
+#else
+		munmap(m_code, m_codeSize);
+#endif
+	}
+#endif
+}
+
+bool FunctionJit::Supported()
+{
+#ifdef FUNCTION_JIT_X64
+	return true;
+#else
+	return false;
+#endif
+}
+
+std::shared_ptr<const FunctionJit> FunctionJit::Compile(const std::vector<Instruction>& program, const bool isComplex, const size_t stackDepth, const size_t tempCount)
+{
+	static std::mutex s_cacheLock;
+	static std::map<std::vector<unsigned>, std::weak_ptr<const FunctionJit>> s_cache;
+
+	std::vector<unsigned> key = { isComplex ? 1u : 0u, static_cast<unsigned>(stackDepth), static_cast<unsigned>(tempCount) };
+	for (const Instruction& ins : program)
+	{
+		key.push_back(static_cast<unsigned>(ins.op));
+		key.push_back(ins.index);
+	}
+
+	std::lock_guard<std::mutex> lock(s_cacheLock);
+	for (auto it = s_cache.begin(); it != s_cache.end();)
+		it = it->second.expired() ? s_cache.erase(it) : std::next(it);
+	std::weak_ptr<const FunctionJit>& entry = s_cache[key];
+	std::shared_ptr<const FunctionJit> jit = entry.lock();
+	if (!jit)
+	{
+		jit = std::make_shared<const FunctionJit>(program, isComplex, stackDepth, tempCount);
+		entry = jit;
+	}
+	return jit;
+}
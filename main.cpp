@@ -11,8 +11,8 @@ int main()
 		std::cout << *parser.PseudoCode() << std::endl;
 
 		FunctionEvaluator<std::complex<double>> eval(parser);
-		for (auto& v : eval.Variables())
-			v.second = std::complex<double>(0.5, 0.0);
+		for (size_t i = 0; i < eval.VariableCount(); i++)
+			eval.Variables()[i] = std::complex<double>(0.5, 0.0);
 		std::cout << eval() << std::endl;
 	}
 	catch (const std::exception& ex)
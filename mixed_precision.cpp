@@ -0,0 +1,61 @@
+#include "mixed_precision.h"
+#include <cfloat>
+
+template <typename NumberType>
+static bool RenderTier(GridRenderer<NumberType>& renderer, const GridRegion<mth::DoubleDouble>& region,
+	const MixedPrecisionRenderer::Options& options, size_t* iterations)
+{
+	using Scalar = typename mth::NumberTraits<NumberType>::Scalar;
+	const auto convert = [](const mth::DoubleDouble& value)
+	{
+		if constexpr (std::is_same<Scalar, mth::DoubleDouble>::value)
+			return value;
+		else
+			return static_cast<Scalar>(value);
+	};
+	const GridRegion<Scalar> converted = { convert(region.minRe), convert(region.minIm), convert(region.maxRe), convert(region.maxIm), region.width, region.height };
+	typename GridRenderer<NumberType>::Options tierOptions;
+	tierOptions.tileSize = options.tileSize;
+	tierOptions.maxIter = options.maxIter;
+	tierOptions.bailout = static_cast<Scalar>(options.bailout);
+	tierOptions.interior.periodicity = options.periodicity;
+	tierOptions.interior.bulbs = options.bulbs;
+	tierOptions.interior.derivative = options.derivative;
+	tierOptions.progress = options.progress;
+	tierOptions.cancel = options.cancel;
+	return renderer.Render(converted, tierOptions, iterations);
+}
+
+MixedPrecisionRenderer::MixedPrecisionRenderer(const FunctionParser& parser, WorkStealingPool& pool, const CompiledFunction<std::complex<double>>::Backend backend) :
+	m_supported(parser.SupportedPrecision())
+{
+	m_single = std::make_unique<GridRenderer<std::complex<float>>>(std::make_shared<const CompiledFunction<std::complex<float>>>(parser), pool);
+	m_double = std::make_unique<GridRenderer<std::complex<double>>>(std::make_shared<const CompiledFunction<std::complex<double>>>(parser, backend), pool);
+	if (Precision::Extended == m_supported)
+		m_extended = std::make_unique<GridRenderer<mth::DoubleDoubleComplex>>(std::make_shared<const CompiledFunction<mth::DoubleDoubleComplex>>(parser), pool);
+}
+
+MixedPrecisionRenderer::Precision MixedPrecisionRenderer::RequiredPrecision(const GridRegion<mth::DoubleDouble>& region)
+{
+	const double spacing = std::min(static_cast<double>(abs(region.maxRe - region.minRe)) / static_cast<double>(std::max<size_t>(region.width, 1)),
+		static_cast<double>(abs(region.maxIm - region.minIm)) / static_cast<double>(std::max<size_t>(region.height, 1)));
+	const double magnitude = std::max({ std::abs(region.minRe.hi), std::abs(region.maxRe.hi), std::abs(region.minIm.hi), std::abs(region.maxIm.hi), DBL_MIN });
+	if (spacing > magnitude * FLT_EPSILON * PrecisionMargin)
+		return Precision::Single;
+	if (spacing > magnitude * DBL_EPSILON * PrecisionMargin)
+		return Precision::Double;
+	return Precision::Extended;
+}
+
+bool MixedPrecisionRenderer::Render(const GridRegion<mth::DoubleDouble>& region, const Options& options, size_t* iterations, Precision* used)
+{
+	const Precision precision = std::min(std::max(RequiredPrecision(region), options.minimum), std::min(options.maximum, m_supported));
+	if (used)
+		*used = precision;
+	switch (precision)
+	{
+	case Precision::Single: return RenderTier(*m_single, region, options, iterations);
+	case Precision::Double: return RenderTier(*m_double, region, options, iterations);
+	default: return RenderTier(*m_extended, region, options, iterations);
+	}
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+#include "double_double.h"
+#include "grid.h"
+
+// Escape-time renderer that picks the cheapest number type able to resolve the pixel spacing of a region:
+// complex<float> (twice the lanes per SIMD register in the SoA batches), complex<double>, and double-double
+// once the zoom runs out of double mantissa. The Extended tier only exists if the function's
+// SupportedPrecision allows it.
+class MixedPrecisionRenderer
+{
+public:
+	using Precision = FunctionParser::Precision;
+
+	// pixel spacing has to stay this many ulps of the coordinates above the rounding error
+	static constexpr double PrecisionMargin = 1024.0;
+
+	struct Options
+	{
+		size_t tileSize = 64;
+		size_t maxIter = 256;
+		double bailout = 2;
+		Precision minimum = Precision::Single;
+		Precision maximum = Precision::Extended;
+		// see EvalContext::InteriorChecks, with its default tolerances in every tier
+		bool periodicity = false;
+		bool bulbs = false;
+		bool derivative = false;
+		// called from worker threads, one call at a time, with the finished fraction
+		std::function<void(double)> progress;
+		const std::atomic<bool>* cancel = nullptr;
+	};
+
+private:
+	Precision m_supported;
+	std::unique_ptr<GridRenderer<std::complex<float>>> m_single;
+	std::unique_ptr<GridRenderer<std::complex<double>>> m_double;
+	std::unique_ptr<GridRenderer<mth::DoubleDoubleComplex>> m_extended;
+
+public:
+	// backend applies to the double tier, the others run as Bytecode
+	MixedPrecisionRenderer(const FunctionParser& parser, WorkStealingPool& pool,
+		const CompiledFunction<std::complex<double>>::Backend backend = CompiledFunction<std::complex<double>>::Backend::Bytecode);
+
+	inline Precision SupportedPrecision() const { return m_supported; }
+
+	// Lowest precision whose pixel spacing is still PrecisionMargin ulps above the coordinates' magnitude
+	static Precision RequiredPrecision(const GridRegion<mth::DoubleDouble>& region);
+
+	// RequiredPrecision clamped to the options and to SupportedPrecision, used receives the chosen tier.
+	// Returns false if cancelled.
+	bool Render(const GridRegion<mth::DoubleDouble>& region, const Options& options, size_t* iterations, Precision* used = nullptr);
+};
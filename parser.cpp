@@ -1,47 +1,105 @@
 #include "parser.h"
+#include <cctype>
+#include <cstddef>
+#include <cstdio>
 #include <cstring>
-#include <sstream>
 #include <vector>
+#include <unordered_map>
 
-static const char* const g_FunctionNames[] = {
-	"sin", "cos", "tan", "sinh", "cosh", "tanh", "exp", "log", "abs", "pos", "ang", "re", "im"
+static const char* const s_ErrorNameTable[] = {
+	"No input",
+	"Unexpected symbol",
+	"Unknown symbol",
+	"Open braces",
+	"Operator expected",
+	"Empty function",
+	"Dangling operator",
+	"Invalid variable index",
+	"Invalid compiled image",
+	"Unsupported precision",
+	"Function is not differentiable",
+	"No usable compute device",
+	"Index out of range",
+	"Unknown error"
 };
 
 FuncParseExcept::FuncParseExcept(const ErrorType error, const size_t where) :
 	m_foundError(error),
-	m_errorOffset(where)
-{
-	static const char* const s_ErrorNameTable[] = {
-		"No input",
-		"Unexpected symbol",
-		"Unknown symbol",
-		"Open braces",
-		"Operator expected",
-		"Empty function",
-		"Dangling operator",
-		"Invalid variable index",
-		"Unknown error"
-	};
+	m_errorOffset(where),
+	m_readableError()
+{
+}
+
+const char* FuncParseExcept::what() const noexcept
+{
+	if (!m_readableError[0])
+		Format(m_foundError, m_errorOffset, m_readableError, sizeof(m_readableError));
+	return m_readableError;
+}
+
+size_t FuncParseExcept::Format(const ErrorType error, const size_t where, char* const buffer, const size_t size) noexcept
+{
+	const char* const name = s_ErrorNameTable[error <= UnknownError ? error : UnknownError];
+	int length;
 	switch (error)
 	{
 	case NoInput:
 	case EmptyFunction:
+	case DeviceUnavailable:
+	case IndexOutOfRange:
 	case UnknownError:
-		m_readableError = s_ErrorNameTable[error];
+		length = std::snprintf(buffer, size, "%s", name);
 		break;
 	default:
-	{
-		std::stringstream ss;
-		ss << s_ErrorNameTable[error] << " at position " << (where + 1);
-		m_readableError = ss.str();
+		length = std::snprintf(buffer, size, "%s at position %zu", name, where + 1);
 		break;
 	}
+	return length > 0 ? static_cast<size_t>(length) : 0;
+}
+
+NodeArena::NodeArena(const size_t blockSize) :
+	m_blockSize(blockSize),
+	m_current(0),
+	m_offset(0) {}
+
+NodeArena::~NodeArena()
+{
+	Reset();
+}
+
+void* NodeArena::Allocate(const size_t size, const size_t alignment)
+{
+	for (;;)
+	{
+		if (m_current < m_blocks.size())
+		{
+			const size_t aligned = (m_offset + alignment - 1) & ~(alignment - 1);
+			if (aligned + size <= m_blockSizes[m_current])
+			{
+				m_offset = aligned + size;
+				return m_blocks[m_current].get() + aligned;
+			}
+			if (++m_current < m_blocks.size())
+			{
+				m_offset = 0;
+				continue;
+			}
+		}
+		const size_t blockSize = std::max(m_blockSize, size + alignment);
+		m_blocks.emplace_back(new unsigned char[blockSize]);
+		m_blockSizes.push_back(blockSize);
+		m_current = m_blocks.size() - 1;
+		m_offset = 0;
 	}
 }
 
-const char* FuncParseExcept::what() const noexcept
+void NodeArena::Reset()
 {
-	return m_readableError.c_str();
+	for (auto it = m_destructors.rbegin(); it != m_destructors.rend(); ++it)
+		it->destroy(it->object);
+	m_destructors.clear();
+	m_current = 0;
+	m_offset = 0;
 }
 
 FunctionParser::FuncElem::FuncElem(const Type type) :
@@ -74,7 +132,7 @@ FunctionParser::Function::Function(const Name funcName) :
 
 void FunctionParser::Function::Print(std::ostream& os) const
 {
-	os << g_FunctionNames[static_cast<size_t>(name)] << '(';
+	os << Names[static_cast<size_t>(name)] << '(';
 	if (param)
 		os << (*param);
 	os << ')';
@@ -100,26 +158,6 @@ void FunctionParser::Operator::Print(std::ostream& os) const
 	os << ')';
 }
 
-static size_t CountBetweenBraces(const char* const func, const size_t offset, const size_t length)
-{
-	size_t braceCntr = 1;
-	for (size_t j = offset + 1; j < offset + length; j++)
-	{
-		if ('(' == func[j])
-		{
-			braceCntr++;
-		}
-		else if (')' == func[j])
-		{
-			if (0 == (--braceCntr))
-			{
-				return j - offset;
-			}
-		}
-	}
-	throw FuncParseExcept(FuncParseExcept::OpenBraces, offset);
-}
-
 static bool IsLetter(const char ch)
 {
 	return
@@ -144,47 +182,84 @@ static bool IsNumberPart(const char ch)
 		ch == '.' ||
 		ch == '-';
 }
-static size_t CountNameLength(const char* const name, const size_t length)
+static bool NameEquals(const char* const name, const size_t length, const char* const reference)
 {
-	for (size_t i = 0; i < length; i++)
-		if (!IsNamePart(name[i]))
-			return i;
-	return length;
+	return 0 == std::strncmp(name, reference, length) && '\0' == reference[length];
 }
-static double ScanNumber(const char* const func, size_t& offset)
+static size_t SkipSpace(const char* const func, size_t offset, const size_t length)
+{
+	while (offset < length && std::isspace(static_cast<unsigned char>(func[offset])))
+		offset++;
+	return offset;
+}
+// False without a digit, offset still moves past the sign and point
+static bool ScanNumber(const char* const func, size_t& offset, const size_t length, double& value)
 {
-	double fractionalDiv = 1.0;
 	bool digitPresent = false;
 	double num = 0.0;
+	double fractionalDiv = 1.0;
 	const size_t firstIdx = offset;
 	if (func[firstIdx] == '-')
 		offset++;
-	while (IsDigit(func[offset]))
+	for (; offset < length && IsDigit(func[offset]); offset++)
 	{
-		num = 10.0 * num + static_cast<double>(func[offset++] - '0');
+		num = 10.0 * num + static_cast<double>(func[offset] - '0');
 		digitPresent = true;
 	}
-	if (func[offset] == '.')
+	if (offset < length && func[offset] == '.')
 	{
-		while (IsDigit(func[++offset]))
+		for (offset++; offset < length && IsDigit(func[offset]); offset++)
 		{
-			num += static_cast<double>(func[offset] - '0') / (fractionalDiv /= 10.0);
+			num = 10.0 * num + static_cast<double>(func[offset] - '0');
+			fractionalDiv *= 10.0;
 			digitPresent = true;
 		}
 	}
 	if (!digitPresent)
-		throw FuncParseExcept(FuncParseExcept::UnexpectedSymbol, firstIdx);
-	return func[firstIdx] == '-' ? -num : num;
+		return false;
+	num /= fractionalDiv;
+	value = func[firstIdx] == '-' ? -num : num;
+	return true;
 }
 
-FunctionParser::Function::Name FunctionParser::GetFunctionNameApplyPrecision(const std::string& name, const size_t offset)
+static bool IsSmallIntExponent(const FunctionParser::FuncElem* funcElem)
 {
-	for (size_t i = 0; i < _countof(g_FunctionNames); i++)
+	if (FunctionParser::FuncElem::Type::Constant != funcElem->type)
+		return false;
+	const std::complex<double> value = static_cast<const FunctionParser::Constant*>(funcElem)->value;
+	return value.imag() == 0.0 && value.real() != 0.0 && value.real() == std::floor(value.real()) && std::abs(value.real()) <= FunctionParser::MaxIntPower;
+}
+
+void FunctionParser::Report(const FuncParseExcept::ErrorType error, const size_t offset)
+{
+	if (!m_diagnosticCount)
+		m_firstDiagnostic = { error, offset };
+	if (m_diagnosticCount < m_diagnosticCapacity)
+		m_diagnostics[m_diagnosticCount] = { error, offset };
+	m_diagnosticCount++;
+}
+
+FunctionParser::FuncElem* FunctionParser::Placeholder()
+{
+	return m_arena.New<Constant>(std::complex<double>(0.0));
+}
+
+void FunctionParser::MarkVariableUsed(const int index)
+{
+	const size_t slot = VariableSlot(index);
+	if (slot >= m_usedVariables.size())
+		m_usedVariables.resize(slot + 1, false);
+	m_usedVariables[slot] = true;
+}
+
+bool FunctionParser::GetFunctionNameApplyPrecision(const char* const name, const size_t nameLength, Function::Name& found)
+{
+	for (size_t i = 0; i < Function::NameCount; i++)
 	{
-		if (g_FunctionNames[i] == name)
+		if (NameEquals(name, nameLength, Function::Names[i]))
 		{
-			Function::Name n = static_cast<Function::Name>(i);
-			if (m_supportedPrecision != Precision::Single)
+			const Function::Name n = static_cast<Function::Name>(i);
+			if (m_supportedPrecision == Precision::Extended)
 			{
 				switch (n)
 				{
@@ -193,141 +268,326 @@ FunctionParser::Function::Name FunctionParser::GetFunctionNameApplyPrecision(con
 				case Function::Name::im:
 					break;
 				default:
-					m_supportedPrecision = Precision::Single;
+					m_supportedPrecision = Precision::Double;
 					break;
 				}
 			}
-			return n;
+			found = n;
+			return true;
 		}
 	}
-	throw FuncParseExcept(FuncParseExcept::UnknownSymbol, offset);
+	return false;
 }
 
-std::unique_ptr<FunctionParser::FuncElem> FunctionParser::ScanEvaluated(const char* const func, size_t& offset, const size_t length)
+FunctionParser::FuncElem* FunctionParser::ParseName(const char* const func, size_t& offset, const size_t length)
 {
-	if ('(' == func[offset])
+	const size_t start = offset;
+	while (offset < length && IsNamePart(func[offset]))
+		offset++;
+	const char* const name = func + start;
+	const size_t nameLength = offset - start;
+
+	const size_t next = SkipSpace(func, offset, length);
+	if (next < length && '(' == func[next])
 	{
-		const size_t bracedLength = CountBetweenBraces(func, ++offset, length);
-		std::unique_ptr<FuncElem> funcElem = ParsePart(func, offset, bracedLength);
-		offset += bracedLength + 1;
-		return funcElem;
+		Function::Name functionName;
+		if (!GetFunctionNameApplyPrecision(name, nameLength, functionName))
+		{
+			// the argument is still checked
+			Report(FuncParseExcept::UnknownSymbol, start);
+			offset = next;
+			return ParseGroup(func, offset, length);
+		}
+		Function* function = m_arena.New<Function>(functionName);
+		if (Function::NeedsComplex(function->name))
+			m_realOnly = false;
+		if (!Function::Holomorphic(function->name))
+			m_differentiable = false;
+		offset = next;
+		function->param = ParseGroup(func, offset, length);
+		return function;
 	}
-	if (IsLetter(func[offset]))
+	if (NameEquals(name, nameLength, "i"))
+	{
+		m_realOnly = false;
+		return m_arena.New<Constant>(std::complex<double>(0.0, 1.0));
+	}
+	if (NameEquals(name, nameLength, "c"))
 	{
-		const size_t nameLength = CountNameLength(func + offset, length - offset);
-		std::unique_ptr<FuncElem> funcElem;
-		const std::string name(func + offset, nameLength);
-		if (func[offset += nameLength] == '(')
+		MarkVariableUsed(-1);
+		return m_arena.New<Variable>(-1);
+	}
+	if ('z' == name[0])
+	{
+		bool digits = !(nameLength > 1 && name[1] == '0') && nameLength <= 10;
+		int index = 0;
+		for (size_t i = 1; digits && i < nameLength; i++)
 		{
-			funcElem = std::make_unique<Function>(GetFunctionNameApplyPrecision(name, offset));
-			static_cast<Function*>(funcElem.get())->param = ScanEvaluated(func, offset, length);
+			digits = IsDigit(name[i]);
+			index = index * 10 + (name[i] - '0');
 		}
-		else
+		if (!digits || index > MaxVariableIndex)
 		{
-			if (name == "i")
-				funcElem = std::make_unique<Constant>(std::complex<double>(0.0, 1.0));
-			else if (name == "c")
-			{
-				funcElem = std::make_unique<Variable>(-1);
-				m_usedVariables.insert(-1);
-			}
-			else if (name[0] == 'z')
-			{
-				if ((name.length() > 1 && name[1]== '0') || name.length() > 10)
-					throw FuncParseExcept(FuncParseExcept::UnexpectedSymbol, offset - name.length());
-				int index = 0;
-				for (size_t i = 1; i < name.length(); i++)
-				{
-					if (!IsDigit(name[i]))
-						throw FuncParseExcept(FuncParseExcept::UnexpectedSymbol, offset - name.length());
-					index = index * 10 + (name[i] - '0');
-				}
+			Report(digits ? FuncParseExcept::InvalidVariableIndex : FuncParseExcept::UnexpectedSymbol, start);
+			return Placeholder();
+		}
 
-				funcElem = std::make_unique<Variable>(index);
-				m_usedVariables.insert(index);
-			}
-			else
-				throw FuncParseExcept(FuncParseExcept::UnexpectedSymbol, offset + 1 - name.length());
+		MarkVariableUsed(index);
+		return m_arena.New<Variable>(index);
+	}
+	Report(FuncParseExcept::UnexpectedSymbol, start);
+	return Placeholder();
+}
+
+FunctionParser::FuncElem* FunctionParser::ParseParameter(const char* const func, size_t& offset, const size_t length)
+{
+	const size_t start = offset++;
+	while (offset < length && IsNamePart(func[offset]))
+		offset++;
+	if (offset == start + 1)
+	{
+		Report(FuncParseExcept::UnexpectedSymbol, start);
+		return Placeholder();
+	}
+	const std::string_view name(func + start + 1, offset - start - 1);
+
+	const size_t k = std::find(m_parameterNames.begin(), m_parameterNames.end(), name) - m_parameterNames.begin();
+	if (k == m_parameterNames.size())
+	{
+		// parameter k is at least variable k
+		if (k > static_cast<size_t>(MaxVariableIndex))
+		{
+			Report(FuncParseExcept::InvalidVariableIndex, start);
+			return Placeholder();
 		}
-		return funcElem;
+		m_parameterNames.push_back(name);
+	}
+	Variable* variable = m_arena.New<Variable>(static_cast<int>(k));
+	m_parameterUses.emplace_back(variable, start);
+	return variable;
+}
+
+FunctionParser::FuncElem* FunctionParser::ParseGroup(const char* const func, size_t& offset, const size_t length)
+{
+	const size_t open = offset++;
+	FuncElem* inner = ParseExpression(func, offset, length, 0);
+	// two operands in a row, the second and its operators are only checked
+	while (offset < length && ')' != func[offset])
+	{
+		Report(FuncParseExcept::OperatorExpected, offset);
+		ParseExpression(func, offset, length, 0);
+	}
+	if (offset >= length)
+		Report(FuncParseExcept::OpenBraces, open);
+	else
+		offset++;
+	return inner;
+}
+
+FunctionParser::FuncElem* FunctionParser::ParsePrimary(const char* const func, size_t& offset, const size_t length)
+{
+	offset = SkipSpace(func, offset, length);
+	if (offset >= length || ')' == func[offset])
+	{
+		Report(FuncParseExcept::EmptyFunction, offset);
+		return Placeholder();
 	}
+	if ('(' == func[offset])
+		return ParseGroup(func, offset, length);
+	if (IsLetter(func[offset]))
+		return ParseName(func, offset, length);
+	if ('$' == func[offset])
+		return ParseParameter(func, offset, length);
 	if (IsNumberPart(func[offset]))
 	{
-		return std::make_unique<Constant>(ScanNumber(func, offset));
+		const size_t start = offset;
+		double value;
+		if (ScanNumber(func, offset, length, value))
+			return m_arena.New<Constant>(value);
+		Report(FuncParseExcept::UnexpectedSymbol, start);
+		return Placeholder();
 	}
-	throw FuncParseExcept(FuncParseExcept::UnknownSymbol, offset);
+	Report(FuncParseExcept::UnknownSymbol, offset++);
+	return Placeholder();
 }
 
-std::unique_ptr<FunctionParser::FuncElem> FunctionParser::ScanOperator(const char* const func, size_t& offset) const
+// Precedence climbing: every operator binding at least as tightly as minPrecedence is folded into lhs,
+// so each character is looked at once. Leaves offset at the first non-space character after the expression.
+FunctionParser::FuncElem* FunctionParser::ParseExpression(const char* const func, size_t& offset, const size_t length, const int minPrecedence)
 {
-	switch (func[offset++])
+	FuncElem* lhs = ParsePrimary(func, offset, length);
+	for (;;)
 	{
-	case '+': return std::make_unique<FunctionParser::Operator>(FunctionParser::Operator::Name::add, 0);
-	case '-': return std::make_unique<FunctionParser::Operator>(FunctionParser::Operator::Name::sub, 0);
-	case '*': return std::make_unique<FunctionParser::Operator>(FunctionParser::Operator::Name::mul, 1);
-	case '/': return std::make_unique<FunctionParser::Operator>(FunctionParser::Operator::Name::div, 1);
-	case '^': return std::make_unique<FunctionParser::Operator>(FunctionParser::Operator::Name::pow, 2);
-	default: throw FuncParseExcept(FuncParseExcept::OperatorExpected, offset - 1);
+		offset = SkipSpace(func, offset, length);
+		Operator::Name name;
+		int precedence;
+		if (offset >= length || !Operator::FromSymbol(func[offset], name, precedence) || precedence < minPrecedence)
+			return lhs;
+
+		const size_t opOffset = offset++;
+		const size_t next = SkipSpace(func, offset, length);
+		if (next >= length || ')' == func[next])
+		{
+			Report(FuncParseExcept::DanglingOperator, opOffset);
+			offset = next;
+			return lhs;
+		}
+		Operator* op = m_arena.New<Operator>(name, precedence);
+		op->params[0] = lhs;
+		op->params[1] = ParseExpression(func, offset, length, Operator::RightAssociative(name) ? precedence : precedence + 1);
+		if (Operator::Name::pow == name && !IsSmallIntExponent(op->params[1]))
+			m_supportedPrecision = std::min(m_supportedPrecision, Precision::Double);
+		lhs = op;
 	}
 }
 
-std::unique_ptr<FunctionParser::FuncElem> FunctionParser::ParsePart(const char* const func, const size_t offset, const size_t length)
+static const std::complex<double>* ConstantValue(const FunctionParser::FuncElem* funcElem)
 {
-	if (!func || !length)
-		throw FuncParseExcept(FuncParseExcept::NoInput, 0);
+	if (FunctionParser::FuncElem::Type::Constant != funcElem->type)
+		return nullptr;
+	return &static_cast<const FunctionParser::Constant*>(funcElem)->value;
+}
+static bool IsConstantValue(const FunctionParser::FuncElem* funcElem, const double value)
+{
+	const std::complex<double>* c = ConstantValue(funcElem);
+	return c && *c == std::complex<double>(value, 0.0);
+}
+static std::complex<double> FoldFunction(const FunctionParser::Function::Name name, const std::complex<double> p)
+{
+	switch (name)
+	{
+	case FunctionParser::Function::Name::sin: return std::sin(p);
+	case FunctionParser::Function::Name::cos: return std::cos(p);
+	case FunctionParser::Function::Name::tan: return std::tan(p);
+	case FunctionParser::Function::Name::sinh: return std::sinh(p);
+	case FunctionParser::Function::Name::cosh: return std::cosh(p);
+	case FunctionParser::Function::Name::tanh: return std::tanh(p);
+	case FunctionParser::Function::Name::exp: return std::exp(p);
+	case FunctionParser::Function::Name::log: return std::log(p);
+	case FunctionParser::Function::Name::abs: return std::abs(p);
+	case FunctionParser::Function::Name::pos: return mth::pos(p);
+	case FunctionParser::Function::Name::ang: return mth::ang(p);
+	case FunctionParser::Function::Name::re: return mth::re(p);
+	case FunctionParser::Function::Name::im: return mth::im(p);
+	default: throw FuncParseExcept(FuncParseExcept::UnknownSymbol, 0);
+	}
+}
+static std::complex<double> FoldOperator(const FunctionParser::Operator::Name name, const std::complex<double> lhs, const std::complex<double> rhs)
+{
+	switch (name)
+	{
+	case FunctionParser::Operator::Name::add: return lhs + rhs;
+	case FunctionParser::Operator::Name::sub: return lhs - rhs;
+	case FunctionParser::Operator::Name::mul: return lhs * rhs;
+	case FunctionParser::Operator::Name::div: return lhs / rhs;
+	case FunctionParser::Operator::Name::pow: return std::pow(lhs, rhs);
+	default: throw FuncParseExcept(FuncParseExcept::UnknownSymbol, 0);
+	}
+}
 
-	std::vector<std::unique_ptr<FuncElem>> tokenized;
-	bool scanEvaluated = true;
+// zero with the given sign in both parts: x + (-0) and x - (+0) give x bit for bit, -0 included
+static bool IsSignedZero(const FunctionParser::FuncElem* funcElem, const bool negative)
+{
+	const std::complex<double>* c = ConstantValue(funcElem);
+	return c && *c == 0.0 && std::signbit(c->real()) == negative && std::signbit(c->imag()) == negative;
+}
 
-	for (size_t i = offset; i < offset + length; scanEvaluated = !scanEvaluated)
-		tokenized.emplace_back(scanEvaluated ? ScanEvaluated(func, i, length + offset - i) : ScanOperator(func, i));
-	if (scanEvaluated)
-		throw FuncParseExcept(FuncParseExcept::DanglingOperator, offset + length - 1);
-	if (tokenized.empty())
-		throw FuncParseExcept(FuncParseExcept::NoInput, 0);
+FunctionParser::FuncElem* FunctionParser::Optimize(FuncElem* funcElem)
+{
+	if (FuncElem::Type::Function == funcElem->type)
+	{
+		Function* func = static_cast<Function*>(funcElem);
+		func->param = Optimize(func->param);
+		if (const std::complex<double>* value = ConstantValue(func->param))
+			return m_arena.New<Constant>(FoldFunction(func->name, *value));
+		return funcElem;
+	}
+	if (FuncElem::Type::Operator != funcElem->type)
+		return funcElem;
+
+	Operator* op = static_cast<Operator*>(funcElem);
+	op->params[0] = Optimize(op->params[0]);
+	op->params[1] = Optimize(op->params[1]);
+	const std::complex<double>* lhs = ConstantValue(op->params[0]);
+	const std::complex<double>* rhs = ConstantValue(op->params[1]);
+	if (lhs && rhs)
+		return m_arena.New<Constant>(FoldOperator(op->name, *lhs, *rhs));
+
+	// even for exact reciprocals the complex product can flip the sign of a zero part
+	if (Operator::Name::div == op->name && rhs && *rhs != 0.0 && m_reassociate)
+	{
+		op->name = Operator::Name::mul;
+		static_cast<Constant*>(op->params[1])->value = 1.0 / *rhs;
+	}
+	if ((Operator::Name::add == op->name || Operator::Name::mul == op->name) && lhs)
+	{
+		std::swap(op->params[0], op->params[1]);
+		std::swap(lhs, rhs);
+	}
 
-	size_t tokenCount = tokenized.size();
-	for (int precedence = 2; precedence >= 0; precedence--)
+	switch (op->name)
 	{
-		size_t storeIdx = 0, readIdx = 0;
-		while (readIdx < tokenCount)
+	case Operator::Name::add:
+	case Operator::Name::sub:
+		if (m_reassociate ? IsConstantValue(op->params[1], 0.0) : IsSignedZero(op->params[1], Operator::Name::add == op->name))
+			return op->params[0];
+		break;
+	case Operator::Name::mul:
+	case Operator::Name::div:
+		// the complex product with 1 + 0i turns -0 parts into +0
+		if (m_reassociate && IsConstantValue(op->params[1], 1.0))
+			return op->params[0];
+		break;
+	case Operator::Name::pow:
+		if (IsConstantValue(op->params[1], 1.0))
+			return op->params[0];
+		if (IsConstantValue(op->params[1], 0.0))
+			return m_arena.New<Constant>(1.0);
+		if (IsConstantValue(op->params[1], 2.0) && FuncElem::Type::Variable == op->params[0]->type)
 		{
-			if ((FuncElem::Type::Operator == tokenized[readIdx]->type) &&
-				(static_cast<Operator*>(tokenized[readIdx].get())->precedence == precedence))
-			{
-				if (!(readIdx + 1 < tokenCount && storeIdx > 0))
-					throw FuncParseExcept(FuncParseExcept::EmptyFunction, 0);
-				Operator* op = static_cast<Operator*>(tokenized[readIdx].get());
-				op->params[0] = std::move(tokenized[storeIdx - 1]);
-				op->params[1] = std::move(tokenized[readIdx + 1]);
-				tokenized[storeIdx - 1] = std::move(tokenized[readIdx]);
-				readIdx += 2;
-			}
-			else
+			op->name = Operator::Name::mul;
+			op->precedence = 1;
+			op->params[1] = m_arena.New<Variable>(static_cast<const Variable*>(op->params[0])->index);
+		}
+		break;
+	default:
+		break;
+	}
+
+	// (x + c1) + c2 to x + (c1 + c2) rounds differently
+	if (m_reassociate && (Operator::Name::add == op->name || Operator::Name::mul == op->name) && rhs &&
+		FuncElem::Type::Operator == op->params[0]->type)
+	{
+		Operator* inner = static_cast<Operator*>(op->params[0]);
+		if (inner->name == op->name)
+		{
+			if (const std::complex<double>* innerRhs = ConstantValue(inner->params[1]))
 			{
-				if (storeIdx != readIdx)
-					tokenized[storeIdx] = std::move(tokenized[readIdx]);
-				readIdx++;
-				storeIdx++;
+				static_cast<Constant*>(inner->params[1])->value = FoldOperator(op->name, *innerRhs, *rhs);
+				return Optimize(op->params[0]);
 			}
 		}
-
-		tokenCount = storeIdx;
 	}
-
-	if (1 != tokenCount)
-		throw FuncParseExcept(FuncParseExcept::UnknownError, 0);
-
-	return std::move(tokenized[0]);
+	return funcElem;
 }
 
-FunctionParser::FunctionParser() : m_supportedPrecision(Precision::Extended) {}
+FunctionParser::FunctionParser() : m_supportedPrecision(Precision::Extended), m_optimize(true), m_reassociate(false), m_copySource(true), m_realOnly(true), m_differentiable(true), m_parsedFunc(nullptr), m_parameterBase(0),
+	m_diagnostics(nullptr), m_diagnosticCapacity(0), m_diagnosticCount(0), m_firstDiagnostic()
+{
+	m_usedVariables.reserve(VariableSlot(MaxVariableIndex) + 1);
+	m_parameterNames.reserve(static_cast<size_t>(MaxVariableIndex) + 1);
+}
 
 FunctionParser::FunctionParser(const char* const function) : FunctionParser()
 {
 	Parse(function);
 }
 
+FunctionParser::FunctionParser(const std::string_view function) : FunctionParser()
+{
+	Parse(function);
+}
+
 FunctionParser::~FunctionParser()
 {
 	Clear();
@@ -335,26 +595,251 @@ FunctionParser::~FunctionParser()
 
 void FunctionParser::Parse(const char* const function)
 {
-	std::string input;
+	Parse(function ? std::string_view(function) : std::string_view());
+}
+
+void FunctionParser::Parse(const std::string_view function)
+{
+	if (ParseSource(function))
+		throw FuncParseExcept(m_firstDiagnostic.error, m_firstDiagnostic.offset);
+}
+
+size_t FunctionParser::TryParse(const std::string_view function, Diagnostic* const diagnostics, const size_t capacity)
+{
+	m_diagnostics = diagnostics;
+	m_diagnosticCapacity = diagnostics ? capacity : 0;
+	const size_t count = ParseSource(function);
+	m_diagnostics = nullptr;
+	m_diagnosticCapacity = 0;
+	return count;
+}
+
+// Reports to the current diagnostics and keeps going after a problem, m_parsedFunc is only set without one
+size_t FunctionParser::ParseSource(const std::string_view function)
+{
 	Clear();
-	for (size_t i = 0; function[i]; i++)
-		if (!std::isspace(function[i]))
-			input += function[i];
-	std::unique_ptr<FuncElem> output = ParsePart(input.c_str(), 0, input.length());
-	m_inputFunc = std::move(input);
-	m_parsedFunc = std::move(output);
+	m_diagnosticCount = 0;
+	const char* const func = function.data();
+	const size_t length = function.size();
+	size_t offset = SkipSpace(func, 0, length);
+	if (offset >= length)
+	{
+		Report(FuncParseExcept::NoInput, 0);
+		return m_diagnosticCount;
+	}
+	FuncElem* output = ParseExpression(func, offset, length, 0);
+	while (offset < length)
+	{
+		Report(FuncParseExcept::OperatorExpected, offset);
+		// a stray closing brace
+		if (')' == func[offset])
+			offset = SkipSpace(func, offset + 1, length);
+		else
+			ParseExpression(func, offset, length, 0);
+	}
+	m_parameterBase = SlotVariable(std::max(m_usedVariables.size(), VariableSlot(0) + 1));
+	for (const std::pair<Variable*, size_t>& use : m_parameterUses)
+	{
+		use.first->index += m_parameterBase;
+		if (use.first->index > MaxVariableIndex)
+			Report(FuncParseExcept::InvalidVariableIndex, use.second);
+		else
+			MarkVariableUsed(use.first->index);
+	}
+	m_parameterUses.clear();
+	if (m_diagnosticCount)
+	{
+		m_parameterNames.clear();
+		return m_diagnosticCount;
+	}
+	m_parameters.assign(m_parameterNames.begin(), m_parameterNames.end());
+	m_parameterNames.clear();
+	if (m_optimize)
+		output = Optimize(output);
+	if (m_copySource)
+		m_inputFunc.assign(func, length);
+	m_parsedFunc = output;
+	return 0;
 }
 
 void FunctionParser::Clear()
 {
 	m_inputFunc.clear();
-	m_parsedFunc.reset();
+	m_parsedFunc = nullptr;
+	m_arena.Reset();
 	m_usedVariables.clear();
+	m_parameters.clear();
+	m_parameterNames.clear();
+	m_parameterBase = 0;
+	m_parameterUses.clear();
 	m_supportedPrecision = Precision::Extended;
+	m_realOnly = true;
+	m_differentiable = true;
+}
+
+size_t FunctionParser::ParameterSlot(const std::string_view name) const
+{
+	const size_t k = std::find(m_parameters.begin(), m_parameters.end(), name) - m_parameters.begin();
+	return k < m_parameters.size() ? VariableSlot(m_parameterBase + static_cast<int>(k)) : NoParameter;
 }
 
 std::ostream& operator<<(std::ostream& os, const FunctionParser::FuncElem& funcElem)
 {
 	funcElem.Print(os);
 	return os;
-}
\ No newline at end of file
+}
+
+struct DagKey
+{
+	int type;
+	int code;
+	size_t params[2];
+	unsigned long long value[2];
+
+	bool operator==(const DagKey& other) const
+	{
+		return type == other.type && code == other.code &&
+			params[0] == other.params[0] && params[1] == other.params[1] &&
+			value[0] == other.value[0] && value[1] == other.value[1];
+	}
+};
+
+struct DagKeyHash
+{
+	size_t operator()(const DagKey& key) const
+	{
+		size_t h = std::hash<int>()(key.type * 64 + key.code);
+		for (const size_t p : key.params)
+			h = h * 31 + std::hash<size_t>()(p);
+		for (const unsigned long long v : key.value)
+			h = h * 31 + std::hash<unsigned long long>()(v);
+		return h;
+	}
+};
+
+static size_t InsertDagNode(const FunctionParser::FuncElem* funcElem, std::vector<FunctionDag::Node>& nodes, std::unordered_map<DagKey, size_t, DagKeyHash>& lookup)
+{
+	FunctionDag::Node node = {};
+	node.type = funcElem->type;
+	node.params[0] = node.params[1] = FunctionDag::NoParam;
+	DagKey key = {};
+	key.type = static_cast<int>(funcElem->type);
+	switch (funcElem->type)
+	{
+	case FunctionParser::FuncElem::Type::Variable:
+		node.index = static_cast<const FunctionParser::Variable*>(funcElem)->index;
+		key.code = node.index;
+		break;
+	case FunctionParser::FuncElem::Type::Constant:
+	{
+		node.value = static_cast<const FunctionParser::Constant*>(funcElem)->value;
+		const double parts[2] = { node.value.real(), node.value.imag() };
+		std::memcpy(key.value, parts, sizeof(parts));
+		break;
+	}
+	case FunctionParser::FuncElem::Type::Function:
+	{
+		const FunctionParser::Function* func = static_cast<const FunctionParser::Function*>(funcElem);
+		node.function = func->name;
+		node.params[0] = InsertDagNode(func->param, nodes, lookup);
+		key.code = static_cast<int>(func->name);
+		break;
+	}
+	case FunctionParser::FuncElem::Type::Operator:
+	{
+		const FunctionParser::Operator* op = static_cast<const FunctionParser::Operator*>(funcElem);
+		node.op = op->name;
+		node.params[0] = InsertDagNode(op->params[0], nodes, lookup);
+		node.params[1] = InsertDagNode(op->params[1], nodes, lookup);
+		if ((FunctionParser::Operator::Name::add == op->name || FunctionParser::Operator::Name::mul == op->name) &&
+			node.params[0] > node.params[1])
+			std::swap(node.params[0], node.params[1]);
+		key.code = static_cast<int>(op->name);
+		break;
+	}
+	default:
+		throw FuncParseExcept(FuncParseExcept::UnknownError, 0);
+	}
+	key.params[0] = node.params[0];
+	key.params[1] = node.params[1];
+
+	const auto found = lookup.find(key);
+	if (found != lookup.end())
+		return found->second;
+	for (const size_t p : node.params)
+		if (FunctionDag::NoParam != p)
+			nodes[p].uses++;
+	nodes.push_back(node);
+	lookup.emplace(key, nodes.size() - 1);
+	return nodes.size() - 1;
+}
+
+FunctionDag::FunctionDag(const FunctionParser::FuncElem* root)
+{
+	if (!root)
+		throw FuncParseExcept(FuncParseExcept::NoInput, 0);
+	std::unordered_map<DagKey, size_t, DagKeyHash> lookup;
+	m_roots.push_back(InsertDagNode(root, m_nodes, lookup));
+	m_nodes[m_roots.back()].uses++;
+}
+
+FunctionDag::FunctionDag(const std::vector<const FunctionParser::FuncElem*>& roots)
+{
+	if (roots.empty())
+		throw FuncParseExcept(FuncParseExcept::NoInput, 0);
+	std::unordered_map<DagKey, size_t, DagKeyHash> lookup;
+	for (const FunctionParser::FuncElem* root : roots)
+	{
+		if (!root)
+			throw FuncParseExcept(FuncParseExcept::NoInput, 0);
+		m_roots.push_back(InsertDagNode(root, m_nodes, lookup));
+		m_nodes[m_roots.back()].uses++;
+	}
+}
+
+const FunctionImage::Header& FunctionImage::Validate(const void* const image, const size_t size)
+{
+	using OpCode = FunctionBytecode::OpCode;
+	if (!image || size < sizeof(Header) || reinterpret_cast<size_t>(image) % alignof(double))
+		throw FuncParseExcept(FuncParseExcept::InvalidImage, 0);
+	const Header& header = *static_cast<const Header*>(image);
+	if (Magic != header.magic || Version != header.version || sizeof(FunctionBytecode::Instruction) != header.instructionSize)
+		throw FuncParseExcept(FuncParseExcept::InvalidImage, 0);
+	if (header.size > size || header.size != Size(header) || !header.instructionCount ||
+		header.stackDepth > header.instructionCount || header.tempCount > header.instructionCount ||
+		header.slotCount <= FunctionParser::VariableSlot(0) || header.slotCount > FunctionParser::VariableSlot(FunctionParser::MaxVariableIndex) + 1 ||
+		header.precision > static_cast<unsigned>(FunctionParser::Precision::Extended))
+		throw FuncParseExcept(FuncParseExcept::InvalidImage, offsetof(Header, precision));
+
+	const FunctionBytecode::Instruction* const code = reinterpret_cast<const FunctionBytecode::Instruction*>(static_cast<const unsigned char*>(image) + InstructionOffset());
+	size_t depth = 0;
+	for (size_t pc = 0; pc < header.instructionCount; pc++)
+	{
+		const FunctionBytecode::Instruction& ins = code[pc];
+		size_t pops = 0, pushes = 0;
+		bool inRange = true;
+		switch (ins.op)
+		{
+		case OpCode::PushConstant: pushes = 1; inRange = ins.index < header.constantCount; break;
+		case OpCode::PushVariable: pushes = 1; inRange = ins.index < header.slotCount; break;
+		case OpCode::Dup: pops = 1; pushes = 2; break;
+		case OpCode::Store: pops = 1; pushes = 1; inRange = ins.index < header.tempCount; break;
+		case OpCode::Load: pushes = 1; inRange = ins.index < header.tempCount; break;
+		default:
+			if (ins.op >= OpCode::Add && ins.op <= OpCode::Pow)
+				pops = 2;
+			else if (ins.op >= OpCode::Sin && ins.op <= OpCode::Im)
+				pops = 1;
+			else
+				inRange = false;
+			pushes = 1;
+			break;
+		}
+		if (!inRange || depth < pops || depth - pops + pushes > header.stackDepth)
+			throw FuncParseExcept(FuncParseExcept::InvalidImage, InstructionOffset() + pc * sizeof(FunctionBytecode::Instruction));
+		depth = depth - pops + pushes;
+	}
+	if (1 != depth)
+		throw FuncParseExcept(FuncParseExcept::InvalidImage, InstructionOffset());
+	return header;
+}
@@ -1,12 +1,30 @@
 #pragma once
 
 #include <string>
+#include <string_view>
 #include <memory>
 #include <stdexcept>
-#include <set>
-#include <map>
 #include <iostream>
 #include <complex>
+#include <vector>
+#include <algorithm>
+#include <type_traits>
+#include <new>
+#include <cstring>
+#include <iterator>
+#include <chrono>
+#include <cstdint>
+
+#if defined(FUNCTION_PROFILING) && (defined(__x86_64__) || defined(_M_X64))
+#define FUNCTION_PROFILING_TSC
+#if defined(_MSC_VER)
+#include <intrin.h>
+#else
+#include <x86intrin.h>
+#endif
+#endif
+
+#include "vector_math.h"
 
 namespace mth
 {
@@ -18,6 +36,53 @@ namespace mth
 	template <typename T> T re(T t) { return t; }
 	template <typename T> std::complex<T> im(std::complex<T> t) { return std::complex<T>(std::abs(t.imag()), 0); }
 	template <typename T> T im(T t) { return 0; }
+
+	// (ar + ai i) / (br + bi i) by Smith's method, the one libgcc uses for std::complex: dividing through by
+	// the larger part of the divisor keeps br * br + bi * bi from overflowing. Written with selects instead
+	// of branches so array loops over it still vectorize; the JIT emits the same sequence.
+	template <typename T> void ComplexDivide(T& ar, T& ai, const T& br, const T& bi)
+	{
+		using std::abs;
+		const bool realLarger = !(abs(br) < abs(bi));
+		const T p = realLarger ? br : bi, q = realLarger ? bi : br;
+		const T x = realLarger ? ar : ai, y = realLarger ? ai : ar;
+		const T r = q / p;
+		const T d = p + q * r;
+		const T t = (y - x * r) / d;
+		ar = (x + y * r) / d;
+		ai = realLarger ? t : -t;
+	}
+
+	template <typename T> struct NumberTraits
+	{
+		using Scalar = T;
+		static constexpr bool isComplex = false;
+		static Scalar Real(const T& t) { return t; }
+		static Scalar Imag(const T& /*t*/) { return Scalar(); }
+		static T Make(const Scalar re, const Scalar /*im*/) { return re; }
+		static T FromComplex(const std::complex<double>& c) { return static_cast<T>(c.real()); }
+		// false for types that only have the arithmetic, pos, re and im kernels (FunctionParser::Precision::Extended)
+		static constexpr bool transcendental = true;
+		// true for dual numbers (dual.h), which need a derivative rule for every function
+		static constexpr bool dual = false;
+		static T Pos(const T& t) { return pos(t); }
+		static T Re(const T& t) { return re(t); }
+		static T Im(const T& t) { return im(t); }
+	};
+	template <typename T> struct NumberTraits<std::complex<T>>
+	{
+		using Scalar = T;
+		static constexpr bool isComplex = true;
+		static Scalar Real(const std::complex<T>& t) { return t.real(); }
+		static Scalar Imag(const std::complex<T>& t) { return t.imag(); }
+		static std::complex<T> Make(const Scalar re, const Scalar im) { return std::complex<T>(re, im); }
+		static std::complex<T> FromComplex(const std::complex<double>& c) { return std::complex<T>(static_cast<T>(c.real()), static_cast<T>(c.imag())); }
+		static constexpr bool transcendental = true;
+		static constexpr bool dual = false;
+		static std::complex<T> Pos(const std::complex<T>& t) { return pos(t); }
+		static std::complex<T> Re(const std::complex<T>& t) { return re(t); }
+		static std::complex<T> Im(const std::complex<T>& t) { return im(t); }
+	};
 }
 
 class FuncParseExcept : std::exception
@@ -33,17 +98,69 @@ public:
 		EmptyFunction,
 		DanglingOperator,
 		InvalidVariableIndex,
+		InvalidImage,
+		UnsupportedPrecision,
+		NotDifferentiable,
+		DeviceUnavailable,
+		// Offset() is the index
+		IndexOutOfRange,
 		UnknownError
 	};
 
+	// longest message Format writes, including the terminating NUL
+	static constexpr size_t MaxMessageLength = 64;
+
 private:
 	ErrorType m_foundError;
 	size_t m_errorOffset;
-	std::string m_readableError;
+	// formatted by the first what()
+	mutable char m_readableError[MaxMessageLength];
 
 public:
 	FuncParseExcept(const ErrorType error, const size_t where);
 	virtual const char* what() const noexcept override;
+	inline ErrorType Error() const { return m_foundError; }
+	// position in the buffer handed to Parse
+	inline size_t Offset() const { return m_errorOffset; }
+
+	// Writes the readable message of error at where into buffer, truncated to size, and returns its length
+	// without the NUL. Does not allocate.
+	static size_t Format(const ErrorType error, const size_t where, char* const buffer, const size_t size) noexcept;
+};
+
+// Bump allocator for expression nodes. Objects are never freed one by one; Reset() drops all of them at
+// once and keeps the blocks for the next parse. Destructors only run for non-trivially destructible types.
+class NodeArena
+{
+	struct Destructor
+	{
+		void(*destroy)(void*);
+		void* object;
+	};
+
+	std::vector<std::unique_ptr<unsigned char[]>> m_blocks;
+	std::vector<size_t> m_blockSizes;
+	std::vector<Destructor> m_destructors;
+	size_t m_blockSize;
+	size_t m_current;
+	size_t m_offset;
+
+	void* Allocate(const size_t size, const size_t alignment);
+
+public:
+	NodeArena(const size_t blockSize = 4096);
+	NodeArena(const NodeArena&) = delete;
+	NodeArena& operator=(const NodeArena&) = delete;
+	~NodeArena();
+
+	template <typename T, typename... Args> T* New(Args&&... args)
+	{
+		T* object = new (Allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+		if constexpr (!std::is_trivially_destructible<T>::value)
+			m_destructors.push_back({ [](void* p) { static_cast<T*>(p)->~T(); }, object });
+		return object;
+	}
+	void Reset();
 };
 
 class FunctionParser
@@ -80,9 +197,16 @@ public:
 		{
 			sin, cos, tan, sinh, cosh, tanh, exp, log, abs, pos, ang, re, im
 		};
+		static constexpr const char* Names[] = {
+			"sin", "cos", "tan", "sinh", "cosh", "tanh", "exp", "log", "abs", "pos", "ang", "re", "im"
+		};
+		static constexpr size_t NameCount = sizeof(Names) / sizeof(Names[0]);
+		// functions whose value on a real argument differs from their real counterpart in mth
+		static constexpr bool NeedsComplex(const Name name) { return Name::pos == name || Name::ang == name || Name::re == name || Name::im == name; }
+		static constexpr bool Holomorphic(const Name name) { return Name::abs != name && !NeedsComplex(name); }
 
 		Name name;
-		std::unique_ptr<FuncElem> param;
+		FuncElem* param;
 		Function(const Name funcName);
 		virtual void Print(std::ostream& os) const override;
 	};
@@ -92,13 +216,37 @@ public:
 		{
 			add, sub, mul, div, pow
 		};
+		static constexpr bool FromSymbol(const char symbol, Name& name, int& precedence)
+		{
+			switch (symbol)
+			{
+			case '+': name = Name::add; precedence = 0; return true;
+			case '-': name = Name::sub; precedence = 0; return true;
+			case '*': name = Name::mul; precedence = 1; return true;
+			case '/': name = Name::div; precedence = 1; return true;
+			case '^': name = Name::pow; precedence = 2; return true;
+			default: return false;
+			}
+		}
+		static constexpr bool RightAssociative(const Name name) { return Name::pow == name; }
 		Name name;
-		std::unique_ptr<FuncElem> params[2];
+		FuncElem* params[2];
 		int precedence;
 		Operator(const Name funcName, const int precedence);
 		virtual void Print(std::ostream& os) const override;
 	};
 
+	// One problem found by TryParse
+	struct Diagnostic
+	{
+		FuncParseExcept::ErrorType error;
+		size_t offset;
+
+		inline size_t Format(char* const buffer, const size_t size) const noexcept { return FuncParseExcept::Format(error, offset, buffer, size); }
+	};
+
+	// Highest evaluation tier with kernels for every function in the input: Extended (double-double) only
+	// has arithmetic, integer powers, pos, re and im; the transcendental functions stop at Double.
 	enum class Precision
 	{
 		Single,
@@ -107,37 +255,324 @@ public:
 	};
 
 private:
-	std::set<int> m_usedVariables;
+	std::vector<bool> m_usedVariables;
 	Precision m_supportedPrecision;
+	bool m_optimize;
+	bool m_reassociate;
+	bool m_copySource;
+	bool m_realOnly;
+	bool m_differentiable;
 	std::string m_inputFunc;
-	std::unique_ptr<FuncElem> m_parsedFunc;
+	NodeArena m_arena;
+	FuncElem* m_parsedFunc;
+	std::vector<std::string> m_parameters;
+	// m_parameters while parsing, they point into the input and have room for every valid parameter
+	std::vector<std::string_view> m_parameterNames;
+	// parameter k is variable m_parameterBase + k; until Parse knows the base the nodes hold k
+	int m_parameterBase;
+	std::vector<std::pair<Variable*, size_t>> m_parameterUses;
+	// where ParseSource reports to: the first problem always, the others while capacity lasts
+	Diagnostic* m_diagnostics;
+	size_t m_diagnosticCapacity;
+	size_t m_diagnosticCount;
+	Diagnostic m_firstDiagnostic;
 
 private:
-	Function::Name GetFunctionNameApplyPrecision(const std::string& name, const size_t offset);
-	std::unique_ptr<FuncElem> ScanEvaluated(const char* const func, size_t& offset, const size_t length);
-	std::unique_ptr<FuncElem> ScanOperator(const char* const func, size_t& offset) const;
-	std::unique_ptr<FuncElem> ParsePart(const char* const func, const size_t offset, const size_t length);
+	void Report(const FuncParseExcept::ErrorType error, const size_t offset);
+	// stands in for a primary that failed to parse, so the rest of the input is still checked
+	FuncElem* Placeholder();
+	size_t ParseSource(const std::string_view function);
+	void MarkVariableUsed(const int index);
+	bool GetFunctionNameApplyPrecision(const char* const name, const size_t nameLength, Function::Name& found);
+	FuncElem* ParseName(const char* const func, size_t& offset, const size_t length);
+	FuncElem* ParseParameter(const char* const func, size_t& offset, const size_t length);
+	FuncElem* ParseGroup(const char* const func, size_t& offset, const size_t length);
+	FuncElem* ParsePrimary(const char* const func, size_t& offset, const size_t length);
+	FuncElem* ParseExpression(const char* const func, size_t& offset, const size_t length, const int minPrecedence);
+	FuncElem* Optimize(FuncElem* funcElem);
 
 public:
+	static constexpr int MaxVariableIndex = 255;
+	// integer exponents up to this size are expanded into multiplications
+	static constexpr int MaxIntPower = 64;
+	static constexpr size_t VariableSlot(const int index) { return static_cast<size_t>(index + 1); }
+	static constexpr int SlotVariable(const size_t slot) { return static_cast<int>(slot) - 1; }
+	static constexpr size_t NoParameter = static_cast<size_t>(-1);
+
 	FunctionParser();
 	FunctionParser(const char* const function);
+	FunctionParser(const std::string_view function);
 	~FunctionParser();
 
 	void Parse(const char* const function);
+	// Reads exactly function.size() characters, the buffer does not need to be NUL terminated
+	void Parse(const std::string_view function);
+	// Parse without throwing: returns the number of problems in function, 0 if it parsed, and writes the
+	// first capacity of them to diagnostics in the order found. After a problem parsing resumes at the
+	// next operand, so one pass reports the independent ones; later diagnostics can be consequences of
+	// earlier ones. The first equals what Parse would throw. A failed TryParse allocates nothing once the parser
+	// has seen an input with as many nodes and $name uses: the node arena and the parameter use list keep their
+	// room across calls, the variable and parameter name tables are sized for MaxVariableIndex at construction.
+	// Only a successful parse copies the source and parameter names. On failure the parser holds no function.
+	size_t TryParse(const std::string_view function, Diagnostic* const diagnostics = nullptr, const size_t capacity = 0);
 	void Clear();
 
-	inline FuncElem* PseudoCode() const { return m_parsedFunc.get(); }
-	inline const std::set<int>& UsedVariables() const { return m_usedVariables; }
+	inline FuncElem* PseudoCode() const { return m_parsedFunc; }
+	inline const std::vector<bool>& UsedVariables() const { return m_usedVariables; }
+	inline bool IsVariableUsed(const int index) const { return VariableSlot(index) < m_usedVariables.size() && m_usedVariables[VariableSlot(index)]; }
 	inline Precision SupportedPrecision() const { return m_supportedPrecision; }
+	inline void EnableOptimization(const bool enable) { m_optimize = enable; }
+	inline bool OptimizationEnabled() const { return m_optimize; }
+	// Off by default, the optimizer then only makes rewrites that leave results bit-identical to the tree as
+	// written, apart from small integer powers becoming multiplications as in the evaluators. When
+	// enabled it also merges constants across (x + c1) + c2 and (x * c1) * c2, turns x / c into x * (1 / c)
+	// and drops + 0, * 1 and / 1, which can change the last bits or the sign of a zero.
+	inline void EnableReassociation(const bool enable) { m_reassociate = enable; }
+	inline bool ReassociationEnabled() const { return m_reassociate; }
+	// When disabled Parse keeps no copy of the input, errors still carry offsets into the caller's buffer
+	inline void EnableSourceCopy(const bool enable) { m_copySource = enable; }
+	inline bool SourceCopyEnabled() const { return m_copySource; }
+	// False once i, pos, ang, re or im appeared in the input
+	inline bool IsRealOnly() const { return m_realOnly; }
+	// False once abs, pos, ang, re or im appeared in the input, these have no complex derivative
+	inline bool IsDifferentiable() const { return m_differentiable; }
+	inline const std::string& Source() const { return m_inputFunc; }
+	// Names of the $name parameters in order of first appearance. They are variables like z1 and take the
+	// slots after the highest z in the input, so literals still fold while parameters stay settable.
+	inline const std::vector<std::string>& Parameters() const { return m_parameters; }
+	inline size_t FirstParameterSlot() const { return VariableSlot(m_parameterBase); }
+	size_t ParameterSlot(const std::string_view name) const;
+};
+
+class FunctionDag
+{
+public:
+	struct Node
+	{
+		FunctionParser::FuncElem::Type type;
+		int index;
+		FunctionParser::Function::Name function;
+		FunctionParser::Operator::Name op;
+		std::complex<double> value;
+		size_t params[2];
+		size_t uses;
+	};
+
+	static constexpr size_t NoParam = static_cast<size_t>(-1);
+
+private:
+	std::vector<Node> m_nodes;
+	std::vector<size_t> m_roots;
+
+public:
+	FunctionDag(const FunctionParser::FuncElem* root);
+	// one DAG for several functions, their common subexpressions become shared nodes
+	FunctionDag(const std::vector<const FunctionParser::FuncElem*>& roots);
+
+	inline const Node& operator[](const size_t id) const { return m_nodes[id]; }
+	inline size_t Size() const { return m_nodes.size(); }
+	inline size_t Root() const { return m_roots.front(); }
+	inline const std::vector<size_t>& Roots() const { return m_roots; }
+	inline bool IsShared(const size_t id) const
+	{
+		return m_nodes[id].uses > 1 &&
+			(FunctionParser::FuncElem::Type::Function == m_nodes[id].type || FunctionParser::FuncElem::Type::Operator == m_nodes[id].type);
+	}
 };
 
+struct FunctionBytecode
+{
+	enum class OpCode : unsigned char
+	{
+		PushConstant,
+		PushVariable,
+		Dup,
+		Store,
+		Load,
+		Add, Sub, Mul, Div, Pow,
+		Sin, Cos, Tan, Sinh, Cosh, Tanh, Exp, Log, Abs, Pos, Ang, Re, Im
+	};
+
+	struct Instruction
+	{
+		OpCode op;
+		unsigned index;
+	};
+};
+
+// Versioned binary image of a bytecode program, laid out so it can be evaluated in place from mapped memory:
+// Header, Instruction[instructionCount], complex<double>[constantCount] as (re, im), used flag per slot.
+// Sections start 8-byte aligned, the image is in host byte order (a foreign one fails the magic check).
+struct FunctionImage
+{
+	static constexpr unsigned Magic = 0x43425046; // "FPBC"
+	static constexpr unsigned short Version = 1;
+
+	struct Header
+	{
+		unsigned magic;
+		unsigned short version;
+		unsigned short instructionSize;
+		unsigned precision;
+		unsigned slotCount;
+		unsigned stackDepth;
+		unsigned tempCount;
+		unsigned instructionCount;
+		unsigned constantCount;
+		unsigned long long size;
+	};
+
+	static constexpr size_t Align(const size_t offset) { return (offset + 7) & ~static_cast<size_t>(7); }
+	static constexpr size_t InstructionOffset() { return Align(sizeof(Header)); }
+	static constexpr size_t ConstantOffset(const Header& header) { return Align(InstructionOffset() + header.instructionCount * sizeof(FunctionBytecode::Instruction)); }
+	static constexpr size_t SlotMapOffset(const Header& header) { return ConstantOffset(header) + static_cast<size_t>(header.constantCount) * 2 * sizeof(double); }
+	static constexpr size_t Size(const Header& header) { return Align(SlotMapOffset(header) + header.slotCount); }
+
+	// Checks the header, bounds and every instruction operand so a corrupt image cannot read out of range.
+	// Throws FuncParseExcept::InvalidImage with the offending byte offset.
+	static const Header& Validate(const void* const image, const size_t size);
+};
+
+class FunctionJit
+{
+public:
+	// scratch holds the value stack, then temps, then constants
+	using Kernel = void(*)(const double* variables, double* scratch);
+
+private:
+	void* m_code;
+	size_t m_codeSize;
+	Kernel m_kernel;
+
+	FunctionJit(const FunctionJit&) = delete;
+	FunctionJit& operator=(const FunctionJit&) = delete;
+
+public:
+	FunctionJit(const std::vector<FunctionBytecode::Instruction>& program, const bool isComplex, const size_t stackDepth, const size_t tempCount);
+	~FunctionJit();
+
+	static bool Supported();
+	static std::shared_ptr<const FunctionJit> Compile(const std::vector<FunctionBytecode::Instruction>& program, const bool isComplex, const size_t stackDepth, const size_t tempCount);
+
+	inline Kernel Get() const { return m_kernel; }
+};
+
+// Executions and ticks per opcode plus a histogram of escape-time step counts, filled by the EvalContext the
+// profile is attached to. Collection only exists in builds with FUNCTION_PROFILING, otherwise the hooks
+// compile to nothing and a profile stays empty. Ticks are TSC cycles on x86-64, nanoseconds elsewhere.
+class FunctionProfile
+{
+public:
+	using OpCode = FunctionBytecode::OpCode;
+
+	struct Counter
+	{
+		std::uint64_t executions;
+		std::uint64_t ticks;
+	};
+
+	static constexpr size_t OpCodeCount = static_cast<size_t>(OpCode::Im) + 1;
+#if defined(FUNCTION_PROFILING)
+	static constexpr bool Enabled = true;
+#else
+	static constexpr bool Enabled = false;
+#endif
+
+	static inline std::uint64_t Ticks()
+	{
+#if defined(FUNCTION_PROFILING_TSC)
+		return __rdtsc();
+#else
+		return static_cast<std::uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count());
+#endif
+	}
+
+	// Counts one instruction over its lifetime, a no-op without FUNCTION_PROFILING
+	class Scope
+	{
+#if defined(FUNCTION_PROFILING)
+		FunctionProfile* const m_profile;
+		const OpCode m_op;
+		const std::uint64_t m_executions;
+		const std::uint64_t m_start;
+
+	public:
+		Scope(FunctionProfile* const profile, const OpCode op, const std::uint64_t executions) :
+			m_profile(profile), m_op(op), m_executions(executions), m_start(profile ? Ticks() : 0) {}
+		~Scope()
+		{
+			if (m_profile)
+				m_profile->Count(m_op, m_executions, Ticks() - m_start);
+		}
+#else
+	public:
+		Scope(FunctionProfile* const, const OpCode, const std::uint64_t) {}
+#endif
+	};
+
+private:
+	Counter m_counters[OpCodeCount];
+	std::uint64_t m_evaluations;
+	std::vector<std::uint64_t> m_iterations;
+
+public:
+	FunctionProfile();
+
+	inline void Count(const OpCode op, const std::uint64_t executions, const std::uint64_t ticks)
+	{
+		Counter& counter = m_counters[static_cast<size_t>(op)];
+		counter.executions += executions;
+		counter.ticks += ticks;
+	}
+	inline void CountEvaluations(const std::uint64_t count) { m_evaluations += count; }
+	void RecordIterations(const size_t steps);
+	void Reset();
+	// Adds another profile, e.g. to combine the per-thread profiles of a render
+	void Merge(const FunctionProfile& other);
+
+	inline const Counter& Op(const OpCode op) const { return m_counters[static_cast<size_t>(op)]; }
+	// pow with a small integer exponent is counted as the multiplications it compiles to
+	inline const Counter& Operator(const FunctionParser::Operator::Name name) const { return Op(static_cast<OpCode>(static_cast<size_t>(OpCode::Add) + static_cast<size_t>(name))); }
+	inline const Counter& Function(const FunctionParser::Function::Name name) const { return Op(static_cast<OpCode>(static_cast<size_t>(OpCode::Sin) + static_cast<size_t>(name))); }
+	Counter Total() const;
+	inline std::uint64_t Evaluations() const { return m_evaluations; }
+	// histogram[n] is the number of escape-time runs that took n steps, runs that hit maxIter end up at maxIter
+	inline const std::vector<std::uint64_t>& IterationHistogram() const { return m_iterations; }
+
+	// FuncElem::Print of every function and operator node, indented by depth, next to the counters of its
+	// name, followed by the per-opcode table and the iteration histogram
+	void Print(std::ostream& os, const FunctionParser::FuncElem* root) const;
+};
+
+template <typename NumberType>
+class EvalContext;
+
 template <typename NumberType>
-class FunctionEvaluator
+class CompiledFunction
 {
+	friend class EvalContext<NumberType>;
+
+public:
+	enum class Backend
+	{
+		Tree,
+		Bytecode,
+		Jit
+	};
+
+	static constexpr size_t BatchLanes = 64;
+	static_assert(BatchLanes <= mth::simd::Chunk, "batch blocks must fit the vector math kernels");
+
+private:
+	using OpCode = FunctionBytecode::OpCode;
+	using Instruction = FunctionBytecode::Instruction;
+	using Traits = mth::NumberTraits<NumberType>;
+	using Scalar = typename Traits::Scalar;
+
 	class Elem
 	{
 	public:
-		virtual NumberType Eval() const = 0;
+		virtual NumberType Eval(const NumberType* variables, NumberType* temps) const = 0;
 	};
 
 	class Constant : public Elem
@@ -146,7 +581,7 @@ class FunctionEvaluator
 
 	public:
 		Constant(const NumberType& value) : m_value(value) {}
-		virtual NumberType Eval() const override
+		virtual NumberType Eval(const NumberType* /*variables*/, NumberType* /*temps*/) const override
 		{
 			return m_value;
 		}
@@ -154,133 +589,1459 @@ class FunctionEvaluator
 
 	class Variable : public Elem
 	{
-		const NumberType& m_value;
+		size_t m_slot;
 
 	public:
-		Variable(const NumberType& value) : m_value(value) {}
+		Variable(const size_t slot) : m_slot(slot) {}
 
-		virtual NumberType Eval() const override
+		virtual NumberType Eval(const NumberType* variables, NumberType* /*temps*/) const override
 		{
-			return m_value;
+			return variables[m_slot];
+		}
+	};
+
+	class Load : public Elem
+	{
+		size_t m_temp;
+
+	public:
+		Load(const size_t temp) : m_temp(temp) {}
+
+		virtual NumberType Eval(const NumberType* /*variables*/, NumberType* temps) const override
+		{
+			return temps[m_temp];
 		}
 	};
 
 	class Function : public Elem
 	{
-		std::unique_ptr<Elem> m_param;
+		const Elem* m_param;
 		NumberType(*m_function)(NumberType);
 
 	public:
-		Function(std::unique_ptr<Elem> param, NumberType(*function)(NumberType)) :
-			m_param(std::move(param)),
+		Function(const Elem* param, NumberType(*function)(NumberType)) :
+			m_param(param),
 			m_function(function) {}
 
-		virtual NumberType Eval() const override
+		virtual NumberType Eval(const NumberType* variables, NumberType* temps) const override
+		{
+			return m_function(m_param->Eval(variables, temps));
+		}
+	};
+
+	class Store : public Elem
+	{
+		const Elem* m_param;
+		size_t m_temp;
+
+	public:
+		Store(const Elem* param, const size_t temp) :
+			m_param(param),
+			m_temp(temp) {}
+
+		virtual NumberType Eval(const NumberType* variables, NumberType* temps) const override
 		{
-			return m_function(m_param->Eval());
+			return temps[m_temp] = m_param->Eval(variables, temps);
+		}
+	};
+
+	class IntPower : public Elem
+	{
+		const Elem* m_param;
+		int m_exponent;
+
+	public:
+		IntPower(const Elem* param, const int exponent) :
+			m_param(param),
+			m_exponent(exponent) {}
+
+		virtual NumberType Eval(const NumberType* variables, NumberType* temps) const override
+		{
+			NumberType base = m_param->Eval(variables, temps);
+			NumberType result = base;
+			for (int n = std::abs(m_exponent) - 1; n > 0; n >>= 1)
+			{
+				if (n & 1)
+					result *= base;
+				base *= base;
+			}
+			return m_exponent < 0 ? NumberType(1) / result : result;
 		}
 	};
 
 	class Operator : public Elem
 	{
-		std::unique_ptr<Elem> m_params[2];
+		const Elem* m_params[2];
 		NumberType(*m_function)(NumberType, NumberType);
 
 	public:
-		Operator(std::unique_ptr<Elem> param1, std::unique_ptr<Elem> param2, NumberType(*function)(NumberType, NumberType)) :
-			m_params{ std::move(param1), std::move(param2) },
+		Operator(const Elem* param1, const Elem* param2, NumberType(*function)(NumberType, NumberType)) :
+			m_params{ param1, param2 },
 			m_function(function) {}
 
-		virtual NumberType Eval() const override
+		virtual NumberType Eval(const NumberType* variables, NumberType* temps) const override
 		{
-			return m_function(m_params[0]->Eval(), m_params[1]->Eval());
+			const NumberType lhs = m_params[0]->Eval(variables, temps);
+			return m_function(lhs, m_params[1]->Eval(variables, temps));
 		}
 	};
 
 private:
-	std::unique_ptr<Elem> m_funcTree;
-	std::map<int, NumberType> m_variables;
+	static constexpr size_t NoTemp = static_cast<size_t>(-1);
+
+	Backend m_backend;
+	bool m_specializePower;
+	size_t m_slotCount;
+	size_t m_stackDepth;
+	size_t m_tempCount;
+	NodeArena m_arena;
+	const Elem* m_funcTree;
+	std::vector<Instruction> m_program;
+	std::vector<NumberType> m_constants;
+	// what Execute runs: m_program/m_constants, or memory inside m_image
+	const Instruction* m_code;
+	size_t m_codeSize;
+	const NumberType* m_constantData;
+	size_t m_constantCount;
+	std::shared_ptr<const void> m_image;
+	FunctionParser::Precision m_precision;
+	std::vector<bool> m_usedSlots;
+	std::vector<std::string> m_parameters;
+	size_t m_firstParameterSlot;
+	// same function over Scalar, set for complex types when real inputs are known to give real results
+	std::shared_ptr<const CompiledFunction<Scalar>> m_realFunction;
+	std::shared_ptr<const FunctionJit> m_jit;
+	std::vector<double> m_jitScratch;
+	// what the program was compiled from and the DAG node of every constant (NoParam for synthetic ones), for PatchConstants
+	std::unique_ptr<const FunctionDag> m_dag;
+	std::vector<size_t> m_constantNodes;
+	// temp holding each function's value, empty when the program has only one
+	std::vector<size_t> m_outputs;
+	bool m_quadraticMap;
+
+	struct CompileState
+	{
+		const FunctionDag& dag;
+		std::vector<size_t> temps;
+		std::vector<bool> emitted;
+
+		CompileState(const FunctionDag& dag) : dag(dag), temps(dag.Size(), NoTemp), emitted(dag.Size(), false) {}
+	};
 
 private:
-	std::unique_ptr<Elem> ConvertOperator(const FunctionParser::Operator* op) const
+	const Elem* ConvertOperator(CompileState& state, const FunctionDag::Node& node)
 	{
 		NumberType(*functions[])(NumberType, NumberType) = {
 			[](NumberType lhs, NumberType rhs)->NumberType {return lhs + rhs; },
 			[](NumberType lhs, NumberType rhs)->NumberType {return lhs - rhs; },
 			[](NumberType lhs, NumberType rhs)->NumberType {return lhs * rhs; },
 			[](NumberType lhs, NumberType rhs)->NumberType {return lhs / rhs; },
-			[](NumberType lhs, NumberType rhs)->NumberType {return std::pow(lhs, rhs); }
+			&Binary<OpCode::Pow>
 		};
 
-		const size_t n = static_cast<size_t>(op->name);
-		if (n < _countof(functions))
-			return std::make_unique<Operator>(ConvertElem(op->params[0].get()), ConvertElem(op->params[1].get()), functions[n]);
+		const size_t n = static_cast<size_t>(node.op);
+		int exponent;
+		if (SmallIntExponent(state.dag, node, exponent))
+			return m_arena.template New<IntPower>(ConvertElem(state, node.params[0]), exponent);
+		if (n < std::size(functions))
+		{
+			const Elem* lhs = ConvertElem(state, node.params[0]);
+			return m_arena.template New<Operator>(lhs, ConvertElem(state, node.params[1]), functions[n]);
+		}
 
 		throw FuncParseExcept(FuncParseExcept::UnknownSymbol, 0);
 	}
-	std::unique_ptr<Elem> ConvertFunction(const FunctionParser::Function* func) const
+	const Elem* ConvertFunction(CompileState& state, const FunctionDag::Node& node)
 	{
 		NumberType(*functions[])(NumberType) = {
-			[](NumberType p)->NumberType { return std::sin(p); },
-			[](NumberType p)->NumberType { return std::cos(p); },
-			[](NumberType p)->NumberType { return std::tan(p); },
-			[](NumberType p)->NumberType { return std::sinh(p); },
-			[](NumberType p)->NumberType { return std::cosh(p); },
-			[](NumberType p)->NumberType { return std::tanh(p); },
-			[](NumberType p)->NumberType { return std::exp(p); },
-			[](NumberType p)->NumberType { return std::log(p); },
-			[](NumberType p)->NumberType { return std::abs(p); },
-			[](NumberType p)->NumberType { return mth::pos(p); },
-			[](NumberType p)->NumberType { return mth::ang(p); },
-			[](NumberType p)->NumberType { return mth::re(p); },
-			[](NumberType p)->NumberType { return mth::im(p); }
+			&Unary<OpCode::Sin>, &Unary<OpCode::Cos>, &Unary<OpCode::Tan>,
+			&Unary<OpCode::Sinh>, &Unary<OpCode::Cosh>, &Unary<OpCode::Tanh>,
+			&Unary<OpCode::Exp>, &Unary<OpCode::Log>, &Unary<OpCode::Abs>,
+			&Unary<OpCode::Pos>, &Unary<OpCode::Ang>, &Unary<OpCode::Re>, &Unary<OpCode::Im>
 		};
 
-		size_t n = static_cast<size_t>(func->name);
-		if (n < _countof(functions))
-			return std::make_unique<Function>(ConvertElem(func->param.get()), functions[n]);
+		size_t n = static_cast<size_t>(node.function);
+		if (n < std::size(functions))
+			return m_arena.template New<Function>(ConvertElem(state, node.params[0]), functions[n]);
 
 		throw FuncParseExcept(FuncParseExcept::UnknownSymbol, 0);
 	}
-	std::unique_ptr<Elem> ConvertConstant(const FunctionParser::Constant* funcElem) const
+	const Elem* ConvertConstant(const FunctionDag::Node& node)
 	{
-		return std::make_unique<Constant>(funcElem->value);
+		return m_arena.template New<Constant>(Traits::FromComplex(node.value));
 	}
-	std::unique_ptr<Variable> ConvertVariable(const FunctionParser::Variable* funcElem) const
+	const Elem* ConvertVariable(const FunctionDag::Node& node)
 	{
-		const auto v = m_variables.find(funcElem->index);
-		if (v == m_variables.end())
+		const size_t slot = FunctionParser::VariableSlot(node.index);
+		if (slot >= m_slotCount)
 			throw FuncParseExcept(FuncParseExcept::InvalidVariableIndex, 0);
 
-		return std::make_unique<Variable>(v->second);
+		return m_arena.template New<Variable>(slot);
 	}
 
-	std::unique_ptr<Elem> ConvertElem(const FunctionParser::FuncElem* funcElem) const
+	const Elem* ConvertElem(CompileState& state, const size_t id)
 	{
-		switch (funcElem->type)
+		if (state.emitted[id])
+			return m_arena.template New<Load>(state.temps[id]);
+
+		const FunctionDag::Node& node = state.dag[id];
+		const Elem* elem;
+		switch (node.type)
 		{
 		case FunctionParser::FuncElem::Type::Operator:
-			return ConvertOperator(static_cast<const FunctionParser::Operator*>(funcElem));
+			elem = ConvertOperator(state, node);
+			break;
 		case FunctionParser::FuncElem::Type::Function:
-			return ConvertFunction(static_cast<const FunctionParser::Function*>(funcElem));
+			elem = ConvertFunction(state, node);
+			break;
+		case FunctionParser::FuncElem::Type::Constant:
+			return ConvertConstant(node);
+		case FunctionParser::FuncElem::Type::Variable:
+			return ConvertVariable(node);
+		default:
+			throw FuncParseExcept(FuncParseExcept::UnknownError, 0);
+		}
+		if (NoTemp == state.temps[id])
+			return elem;
+		state.emitted[id] = true;
+		return m_arena.template New<Store>(elem, state.temps[id]);
+	}
+
+	bool SmallIntExponent(const FunctionDag& dag, const FunctionDag::Node& node, int& exponent) const
+	{
+		if (!m_specializePower || FunctionParser::Operator::Name::pow != node.op ||
+			FunctionParser::FuncElem::Type::Constant != dag[node.params[1]].type)
+			return false;
+		const std::complex<double> value = dag[node.params[1]].value;
+		if (value.imag() != 0.0 || value.real() != std::floor(value.real()) || std::abs(value.real()) > FunctionParser::MaxIntPower || value.real() == 0.0)
+			return false;
+		exponent = static_cast<int>(value.real());
+		return true;
+	}
+
+	// z*z+c or z^2+c in any operand order
+	static bool QuadraticMap(const FunctionDag& dag)
+	{
+		using Type = FunctionParser::FuncElem::Type;
+		using Name = FunctionParser::Operator::Name;
+		const auto isVariable = [&](const size_t id, const int index) { return Type::Variable == dag[id].type && index == dag[id].index; };
+		const auto isSquare = [&](const size_t id)
+		{
+			const FunctionDag::Node& node = dag[id];
+			if (Type::Operator != node.type || !isVariable(node.params[0], 0))
+				return false;
+			if (Name::mul == node.op)
+				return isVariable(node.params[1], 0);
+			return Name::pow == node.op && Type::Constant == dag[node.params[1]].type && std::complex<double>(2) == dag[node.params[1]].value;
+		};
+		const FunctionDag::Node& root = dag[dag.Root()];
+		if (1 != dag.Roots().size() || Type::Operator != root.type || Name::add != root.op)
+			return false;
+		return (isSquare(root.params[0]) && isVariable(root.params[1], -1)) || (isSquare(root.params[1]) && isVariable(root.params[0], -1));
+	}
+
+	// log and non-integer powers leave the real line for negative arguments; the NeedsComplex functions are
+	// ruled out by FunctionParser::IsRealOnly
+	static bool RealClosed(const FunctionDag& dag)
+	{
+		for (size_t id = 0; id < dag.Size(); id++)
+		{
+			const FunctionDag::Node& node = dag[id];
+			if (FunctionParser::FuncElem::Type::Function == node.type && FunctionParser::Function::Name::log == node.function)
+				return false;
+			if (FunctionParser::FuncElem::Type::Operator == node.type && FunctionParser::Operator::Name::pow == node.op)
+			{
+				const FunctionDag::Node& exponent = dag[node.params[1]];
+				if (FunctionParser::FuncElem::Type::Constant != exponent.type || exponent.value.imag() != 0.0 ||
+					exponent.value.real() != std::floor(exponent.value.real()))
+					return false;
+			}
+		}
+		return true;
+	}
+	static bool RealClosed(const Instruction* code, const size_t codeSize, const double* constants, const size_t constantCount)
+	{
+		for (size_t i = 0; i < constantCount; i++)
+			if (constants[2 * i + 1] != 0.0)
+				return false;
+		for (size_t pc = 0; pc < codeSize; pc++)
+		{
+			switch (code[pc].op)
+			{
+			case OpCode::Pow:
+			{
+				// as in the DAG check, integer constant exponents stay real; constants are never kept in temps,
+				// so a constant exponent is the push right before
+				if (!pc || OpCode::PushConstant != code[pc - 1].op || code[pc - 1].index >= constantCount)
+					return false;
+				const double exponent = constants[2 * code[pc - 1].index];
+				if (exponent != std::floor(exponent))
+					return false;
+				break;
+			}
+			case OpCode::Log: case OpCode::Pos: case OpCode::Ang: case OpCode::Re: case OpCode::Im:
+				return false;
+			default:
+				break;
+			}
+		}
+		return true;
+	}
+
+	size_t CompilePower(const unsigned exponent)
+	{
+		if (exponent == 1)
+			return 0;
+		if (exponent % 2 == 0)
+		{
+			const size_t depth = CompilePower(exponent / 2);
+			m_program.push_back({ OpCode::Dup, 0 });
+			m_program.push_back({ OpCode::Mul, 0 });
+			return std::max<size_t>(depth, 1);
+		}
+		m_program.push_back({ OpCode::Dup, 0 });
+		const size_t depth = CompilePower(exponent - 1);
+		m_program.push_back({ OpCode::Mul, 0 });
+		return depth + 1;
+	}
+
+	size_t CompileOperator(CompileState& state, const FunctionDag::Node& node)
+	{
+		const size_t n = static_cast<size_t>(node.op);
+		if (n > static_cast<size_t>(FunctionParser::Operator::Name::pow))
+			throw FuncParseExcept(FuncParseExcept::UnknownSymbol, 0);
+		int exponent;
+		if (SmallIntExponent(state.dag, node, exponent))
+		{
+			size_t offset = 0;
+			if (exponent < 0)
+			{
+				m_program.push_back({ OpCode::PushConstant, static_cast<unsigned>(m_constants.size()) });
+				m_constants.push_back(NumberType(1));
+				m_constantNodes.push_back(FunctionDag::NoParam);
+				offset = 1;
+			}
+			const size_t baseDepth = CompileElem(state, node.params[0]);
+			const size_t depth = std::max(baseDepth, CompilePower(static_cast<unsigned>(std::abs(exponent))) + 1) + offset;
+			if (exponent < 0)
+				m_program.push_back({ OpCode::Div, 0 });
+			return depth;
+		}
+		const size_t lhsDepth = CompileElem(state, node.params[0]);
+		const size_t rhsDepth = CompileElem(state, node.params[1]);
+		m_program.push_back({ static_cast<OpCode>(static_cast<size_t>(OpCode::Add) + n), 0 });
+		return std::max(lhsDepth, rhsDepth + 1);
+	}
+
+	size_t CompileElem(CompileState& state, const size_t id)
+	{
+		if (state.emitted[id])
+		{
+			m_program.push_back({ OpCode::Load, static_cast<unsigned>(state.temps[id]) });
+			return 1;
+		}
+
+		const FunctionDag::Node& node = state.dag[id];
+		size_t depth;
+		switch (node.type)
+		{
+		case FunctionParser::FuncElem::Type::Operator:
+			depth = CompileOperator(state, node);
+			break;
+		case FunctionParser::FuncElem::Type::Function:
+		{
+			const size_t n = static_cast<size_t>(node.function);
+			if (n > static_cast<size_t>(FunctionParser::Function::Name::im))
+				throw FuncParseExcept(FuncParseExcept::UnknownSymbol, 0);
+			depth = CompileElem(state, node.params[0]);
+			m_program.push_back({ static_cast<OpCode>(static_cast<size_t>(OpCode::Sin) + n), 0 });
+			break;
+		}
 		case FunctionParser::FuncElem::Type::Constant:
-			return ConvertConstant(static_cast<const FunctionParser::Constant*>(funcElem));
+			m_program.push_back({ OpCode::PushConstant, static_cast<unsigned>(m_constants.size()) });
+			m_constants.push_back(Traits::FromComplex(node.value));
+			m_constantNodes.push_back(id);
+			return 1;
 		case FunctionParser::FuncElem::Type::Variable:
-			return ConvertVariable(static_cast<const FunctionParser::Variable*>(funcElem));
+		{
+			const size_t slot = FunctionParser::VariableSlot(node.index);
+			if (slot >= m_slotCount)
+				throw FuncParseExcept(FuncParseExcept::InvalidVariableIndex, 0);
+			m_program.push_back({ OpCode::PushVariable, static_cast<unsigned>(slot) });
+			return 1;
+		}
 		default:
 			throw FuncParseExcept(FuncParseExcept::UnknownError, 0);
 		}
+		if (NoTemp != state.temps[id])
+		{
+			m_program.push_back({ OpCode::Store, static_cast<unsigned>(state.temps[id]) });
+			state.emitted[id] = true;
+		}
+		return depth;
+	}
+
+	// Every root is stored in a temp and stays on the stack below the next one; loading the first root again
+	// at the end leaves it both on top (Execute) and at the bottom (FunctionJit) of the stack.
+	void CompileOutputs(CompileState& state)
+	{
+		for (const size_t root : state.dag.Roots())
+		{
+			const size_t depth = CompileElem(state, root);
+			m_stackDepth = std::max(m_stackDepth, m_outputs.size() + depth);
+			size_t temp = state.temps[root];
+			if (NoTemp == temp)
+			{
+				temp = m_tempCount++;
+				m_program.push_back({ OpCode::Store, static_cast<unsigned>(temp) });
+			}
+			m_outputs.push_back(temp);
+		}
+		m_program.push_back({ OpCode::Load, static_cast<unsigned>(m_outputs.front()) });
+		m_stackDepth = std::max(m_stackDepth, m_outputs.size() + 1);
+	}
+
+	void CompileJit()
+	{
+		if constexpr (std::is_same<NumberType, double>::value || std::is_same<NumberType, std::complex<double>>::value)
+		{
+			if (FunctionJit::Supported())
+			{
+				const size_t width = Traits::isComplex ? 2 : 1;
+				m_jit = FunctionJit::Compile(std::vector<Instruction>(m_code, m_code + m_codeSize), Traits::isComplex, m_stackDepth, m_tempCount);
+				m_jitScratch.resize((m_stackDepth + m_tempCount + ConstantCount()) * width);
+				double* constants = m_jitScratch.data() + (m_stackDepth + m_tempCount) * width;
+				for (size_t i = 0; i < ConstantCount(); i++)
+				{
+					*constants++ = Traits::Real(m_constantData[i]);
+					if (Traits::isComplex)
+						*constants++ = Traits::Imag(m_constantData[i]);
+				}
+				return;
+			}
+		}
+		m_backend = Backend::Bytecode;
+	}
+
+	NumberType Execute(const NumberType* variables, NumberType* stack, NumberType* temps, FunctionProfile* const profile = nullptr) const
+	{
+		NumberType* sp = stack;
+		for (const Instruction* pc = m_code; pc != m_code + m_codeSize; pc++)
+		{
+			const Instruction& ins = *pc;
+			[[maybe_unused]] const FunctionProfile::Scope scope(profile, ins.op, 1);
+			switch (ins.op)
+			{
+			case OpCode::PushConstant: *sp++ = m_constantData[ins.index]; break;
+			case OpCode::PushVariable: *sp++ = variables[ins.index]; break;
+			case OpCode::Dup: *sp = sp[-1]; sp++; break;
+			case OpCode::Store: temps[ins.index] = sp[-1]; break;
+			case OpCode::Load: *sp++ = temps[ins.index]; break;
+			case OpCode::Add: --sp; sp[-1] = sp[-1] + sp[0]; break;
+			case OpCode::Sub: --sp; sp[-1] = sp[-1] - sp[0]; break;
+			case OpCode::Mul: --sp; sp[-1] = sp[-1] * sp[0]; break;
+			case OpCode::Div: --sp; sp[-1] = sp[-1] / sp[0]; break;
+			case OpCode::Pow: --sp; sp[-1] = Binary<OpCode::Pow>(sp[-1], sp[0]); break;
+			case OpCode::Sin: sp[-1] = Unary<OpCode::Sin>(sp[-1]); break;
+			case OpCode::Cos: sp[-1] = Unary<OpCode::Cos>(sp[-1]); break;
+			case OpCode::Tan: sp[-1] = Unary<OpCode::Tan>(sp[-1]); break;
+			case OpCode::Sinh: sp[-1] = Unary<OpCode::Sinh>(sp[-1]); break;
+			case OpCode::Cosh: sp[-1] = Unary<OpCode::Cosh>(sp[-1]); break;
+			case OpCode::Tanh: sp[-1] = Unary<OpCode::Tanh>(sp[-1]); break;
+			case OpCode::Exp: sp[-1] = Unary<OpCode::Exp>(sp[-1]); break;
+			case OpCode::Log: sp[-1] = Unary<OpCode::Log>(sp[-1]); break;
+			case OpCode::Abs: sp[-1] = Unary<OpCode::Abs>(sp[-1]); break;
+			case OpCode::Pos: sp[-1] = Unary<OpCode::Pos>(sp[-1]); break;
+			case OpCode::Ang: sp[-1] = Unary<OpCode::Ang>(sp[-1]); break;
+			case OpCode::Re: sp[-1] = Unary<OpCode::Re>(sp[-1]); break;
+			case OpCode::Im: sp[-1] = Unary<OpCode::Im>(sp[-1]); break;
+			}
+		}
+		return sp[-1];
+	}
+
+	void ExecuteBlock(const NumberType* const* inputs, NumberType* output, const size_t first, const size_t lanes, Scalar* batchStack, Scalar* batchTemps,
+		FunctionProfile* const profile = nullptr) const
+	{
+		Scalar* const re = batchStack;
+		Scalar* const im = re + BatchStackSize() / 2;
+		size_t top = 0;
+		for (const Instruction* pc = m_code; pc != m_code + m_codeSize; pc++)
+		{
+			const Instruction& ins = *pc;
+			[[maybe_unused]] const FunctionProfile::Scope scope(profile, ins.op, lanes);
+			if (ins.op == OpCode::PushConstant)
+			{
+				const Scalar cr = Traits::Real(m_constantData[ins.index]), ci = Traits::Imag(m_constantData[ins.index]);
+				Scalar* const r = re + top * BatchLanes;
+				Scalar* const i = im + top * BatchLanes;
+				for (size_t j = 0; j < lanes; j++)
+					r[j] = cr;
+				if constexpr (Traits::isComplex)
+					for (size_t j = 0; j < lanes; j++)
+						i[j] = ci;
+				top++;
+				continue;
+			}
+			if (ins.op == OpCode::PushVariable)
+			{
+				const NumberType* const in = inputs[ins.index] + first;
+				Scalar* const r = re + top * BatchLanes;
+				Scalar* const i = im + top * BatchLanes;
+				for (size_t j = 0; j < lanes; j++)
+				{
+					r[j] = Traits::Real(in[j]);
+					if constexpr (Traits::isComplex)
+						i[j] = Traits::Imag(in[j]);
+				}
+				top++;
+				continue;
+			}
+			if (ins.op == OpCode::Store || ins.op == OpCode::Load)
+			{
+				Scalar* const tr = batchTemps + ins.index * BatchLanes;
+				Scalar* const ti = tr + BatchTempSize() / 2;
+				if (ins.op == OpCode::Store)
+				{
+					std::copy(re + (top - 1) * BatchLanes, re + (top - 1) * BatchLanes + lanes, tr);
+					if constexpr (Traits::isComplex)
+						std::copy(im + (top - 1) * BatchLanes, im + (top - 1) * BatchLanes + lanes, ti);
+				}
+				else
+				{
+					std::copy(tr, tr + lanes, re + top * BatchLanes);
+					if constexpr (Traits::isComplex)
+						std::copy(ti, ti + lanes, im + top * BatchLanes);
+					top++;
+				}
+				continue;
+			}
+			if (ins.op == OpCode::Dup)
+			{
+				std::copy(re + (top - 1) * BatchLanes, re + (top - 1) * BatchLanes + lanes, re + top * BatchLanes);
+				if constexpr (Traits::isComplex)
+					std::copy(im + (top - 1) * BatchLanes, im + (top - 1) * BatchLanes + lanes, im + top * BatchLanes);
+				top++;
+				continue;
+			}
+			if (ins.op >= OpCode::Add && ins.op <= OpCode::Pow)
+				top--;
+			Scalar* const ar = re + (top - 1) * BatchLanes;
+			Scalar* const ai = im + (top - 1) * BatchLanes;
+			const Scalar* const br = re + top * BatchLanes;
+			const Scalar* const bi = im + top * BatchLanes;
+			switch (ins.op)
+			{
+			case OpCode::Add:
+				for (size_t j = 0; j < lanes; j++)
+					ar[j] += br[j];
+				if constexpr (Traits::isComplex)
+					for (size_t j = 0; j < lanes; j++)
+						ai[j] += bi[j];
+				break;
+			case OpCode::Sub:
+				for (size_t j = 0; j < lanes; j++)
+					ar[j] -= br[j];
+				if constexpr (Traits::isComplex)
+					for (size_t j = 0; j < lanes; j++)
+						ai[j] -= bi[j];
+				break;
+			case OpCode::Mul:
+				if constexpr (Traits::isComplex)
+				{
+					for (size_t j = 0; j < lanes; j++)
+					{
+						const Scalar r = ar[j] * br[j] - ai[j] * bi[j];
+						ai[j] = ar[j] * bi[j] + ai[j] * br[j];
+						ar[j] = r;
+					}
+				}
+				else
+				{
+					for (size_t j = 0; j < lanes; j++)
+						ar[j] *= br[j];
+				}
+				break;
+			case OpCode::Div:
+				if constexpr (Traits::isComplex)
+				{
+					for (size_t j = 0; j < lanes; j++)
+						mth::ComplexDivide(ar[j], ai[j], br[j], bi[j]);
+				}
+				else
+				{
+					for (size_t j = 0; j < lanes; j++)
+						ar[j] /= br[j];
+				}
+				break;
+			default:
+				if constexpr (std::is_same_v<Scalar, double> || std::is_same_v<Scalar, float>)
+				{
+					static_assert(static_cast<int>(OpCode::Log) - static_cast<int>(OpCode::Sin) == static_cast<int>(mth::simd::Function::Log));
+					if (ins.op >= OpCode::Sin && ins.op <= OpCode::Log)
+					{
+						const auto function = static_cast<mth::simd::Function>(static_cast<int>(ins.op) - static_cast<int>(OpCode::Sin));
+						if constexpr (Traits::isComplex)
+							mth::simd::ApplyComplex(function, ar, ai, lanes);
+						else
+							mth::simd::ApplyReal(function, ar, lanes);
+						break;
+					}
+				}
+				for (size_t j = 0; j < lanes; j++)
+				{
+					const NumberType result = ApplyScalar(ins.op, Traits::Make(ar[j], ai[j]), Traits::Make(br[j], bi[j]));
+					ar[j] = Traits::Real(result);
+					if constexpr (Traits::isComplex)
+						ai[j] = Traits::Imag(result);
+				}
+				break;
+			}
+		}
+		for (size_t j = 0; j < lanes; j++)
+			output[first + j] = Traits::Make(re[j], im[j]);
 	}
 
+	// The one place opcodes map to math functions. Types without transcendental kernels are rejected at
+	// construction unless the function only needs the ones kept at FunctionParser::Precision::Extended.
+	// Calls are unqualified so number types outside std (mth::Dual) bring their own overloads.
+	template <OpCode op>
+	static NumberType Binary(const NumberType lhs, const NumberType rhs)
+	{
+		using std::pow; using std::sin; using std::cos; using std::tan; using std::sinh; using std::cosh;
+		using std::tanh; using std::exp; using std::log; using std::abs; using mth::ang;
+		if constexpr (OpCode::Pos == op) return Traits::Pos(lhs);
+		else if constexpr (OpCode::Re == op) return Traits::Re(lhs);
+		else if constexpr (OpCode::Im == op) return Traits::Im(lhs);
+		else if constexpr (!Traits::transcendental) throw FuncParseExcept(FuncParseExcept::UnsupportedPrecision, 0);
+		else if constexpr (OpCode::Pow == op) return pow(lhs, rhs);
+		else if constexpr (OpCode::Sin == op) return sin(lhs);
+		else if constexpr (OpCode::Cos == op) return cos(lhs);
+		else if constexpr (OpCode::Tan == op) return tan(lhs);
+		else if constexpr (OpCode::Sinh == op) return sinh(lhs);
+		else if constexpr (OpCode::Cosh == op) return cosh(lhs);
+		else if constexpr (OpCode::Tanh == op) return tanh(lhs);
+		else if constexpr (OpCode::Exp == op) return exp(lhs);
+		else if constexpr (OpCode::Log == op) return log(lhs);
+		else if constexpr (OpCode::Abs == op) return abs(lhs);
+		else if constexpr (OpCode::Ang == op) return ang(lhs);
+		else throw FuncParseExcept(FuncParseExcept::UnknownError, 0);
+	}
+	template <OpCode op>
+	static NumberType Unary(const NumberType p) { return Binary<op>(p, p); }
+
+	static NumberType ApplyScalar(const OpCode op, const NumberType& lhs, const NumberType& rhs)
+	{
+		switch (op)
+		{
+		case OpCode::Pow: return Binary<OpCode::Pow>(lhs, rhs);
+		case OpCode::Sin: return Unary<OpCode::Sin>(lhs);
+		case OpCode::Cos: return Unary<OpCode::Cos>(lhs);
+		case OpCode::Tan: return Unary<OpCode::Tan>(lhs);
+		case OpCode::Sinh: return Unary<OpCode::Sinh>(lhs);
+		case OpCode::Cosh: return Unary<OpCode::Cosh>(lhs);
+		case OpCode::Tanh: return Unary<OpCode::Tanh>(lhs);
+		case OpCode::Exp: return Unary<OpCode::Exp>(lhs);
+		case OpCode::Log: return Unary<OpCode::Log>(lhs);
+		case OpCode::Abs: return Unary<OpCode::Abs>(lhs);
+		case OpCode::Pos: return Unary<OpCode::Pos>(lhs);
+		case OpCode::Ang: return Unary<OpCode::Ang>(lhs);
+		case OpCode::Re: return Unary<OpCode::Re>(lhs);
+		case OpCode::Im: return Unary<OpCode::Im>(lhs);
+		default: throw FuncParseExcept(FuncParseExcept::UnknownError, 0);
+		}
+	}
+
+	inline size_t BatchStackSize() const { return (m_stackDepth + 1) * BatchLanes * 2; }
+	inline size_t BatchTempSize() const { return m_tempCount * BatchLanes * 2; }
+	inline size_t ConstantCount() const { return m_constantCount; }
+
 public:
-	FunctionEvaluator(const FunctionParser& parser)
+	CompiledFunction(const FunctionParser& parser, const Backend backend = Backend::Bytecode) :
+		CompiledFunction(std::vector<const FunctionParser*>{ &parser }, backend)
 	{
-		for (const int v : parser.UsedVariables())
-			m_variables[v] = NumberType();
-		m_funcTree = ConvertElem(parser.PseudoCode());
 	}
-	NumberType operator()() const { return m_funcTree->Eval(); }
-	inline std::map<int, NumberType>& Variables() { return m_variables; }
+	// Compiles several functions of the same variables into one program that evaluates their common
+	// subexpressions once, see EvalContext::Evaluate(NumberType*) and IterateSystem. The functions have to
+	// agree on their $parameters. With more than one function a Tree request runs as Bytecode, and
+	// operator() gives the first function's value.
+	CompiledFunction(const std::vector<const FunctionParser*>& functions, const Backend backend = Backend::Bytecode) :
+		m_backend(Backend::Tree == backend && functions.size() > 1 ? Backend::Bytecode : backend),
+		m_specializePower(!Traits::transcendental ||
+			std::all_of(functions.begin(), functions.end(), [](const FunctionParser* function) { return function->OptimizationEnabled(); })),
+		m_slotCount(FunctionParser::VariableSlot(0) + 1),
+		m_stackDepth(0),
+		m_tempCount(0),
+		m_funcTree(nullptr),
+		m_code(nullptr),
+		m_codeSize(0),
+		m_constantData(nullptr),
+		m_constantCount(0),
+		m_precision(FunctionParser::Precision::Extended),
+		m_firstParameterSlot(0),
+		m_quadraticMap(false)
+	{
+		if (functions.empty())
+			throw FuncParseExcept(FuncParseExcept::NoInput, 0);
+		m_parameters = functions.front()->Parameters();
+		m_firstParameterSlot = functions.front()->FirstParameterSlot();
+		bool realOnly = true;
+		std::vector<const FunctionParser::FuncElem*> roots;
+		for (const FunctionParser* function : functions)
+		{
+			if (function->Parameters() != m_parameters || (!m_parameters.empty() && function->FirstParameterSlot() != m_firstParameterSlot))
+				throw FuncParseExcept(FuncParseExcept::InvalidVariableIndex, 0);
+			if constexpr (Traits::dual)
+				if (!function->IsDifferentiable())
+					throw FuncParseExcept(FuncParseExcept::NotDifferentiable, 0);
+			m_slotCount = std::max(m_slotCount, function->UsedVariables().size());
+			m_precision = std::min(m_precision, function->SupportedPrecision());
+			realOnly = realOnly && function->IsRealOnly();
+			roots.push_back(function->PseudoCode());
+		}
+		if constexpr (!Traits::transcendental)
+			if (FunctionParser::Precision::Extended != m_precision)
+				throw FuncParseExcept(FuncParseExcept::UnsupportedPrecision, 0);
+		m_usedSlots.assign(m_slotCount, false);
+		for (const FunctionParser* function : functions)
+			for (size_t slot = 0; slot < function->UsedVariables().size(); slot++)
+				if (function->UsedVariables()[slot])
+					m_usedSlots[slot] = true;
+
+		const FunctionDag dag(roots);
+		m_quadraticMap = QuadraticMap(dag);
+		CompileState state(dag);
+		for (size_t id = 0; id < dag.Size(); id++)
+			if (dag.IsShared(id))
+				state.temps[id] = m_tempCount++;
+		if (Backend::Tree == m_backend)
+		{
+			m_funcTree = ConvertElem(state, dag.Root());
+		}
+		else
+		{
+			if (1 == dag.Roots().size())
+				m_stackDepth = CompileElem(state, dag.Root());
+			else
+				CompileOutputs(state);
+			m_code = m_program.data();
+			m_codeSize = m_program.size();
+			m_constantData = m_constants.data();
+			m_constantCount = m_constants.size();
+			if (Backend::Jit == m_backend)
+				CompileJit();
+			m_dag = std::make_unique<const FunctionDag>(dag);
+		}
+		// not const, PatchConstants updates it together with this function
+		if constexpr (Traits::isComplex)
+			if (realOnly && RealClosed(dag))
+				m_realFunction = std::make_shared<CompiledFunction<Scalar>>(functions, static_cast<typename CompiledFunction<Scalar>::Backend>(backend));
+	}
+
+	// Runs the program straight out of a FunctionImage, owner keeps that memory alive (e.g. a mapped archive).
+	// Constants are only copied when NumberType is not complex<double>; a Tree request runs as Bytecode.
+	// Images do not keep parameter names, their parameters are only reachable by slot.
+	CompiledFunction(const void* const image, const size_t size, std::shared_ptr<const void> owner, const Backend backend = Backend::Bytecode) :
+		m_backend(Backend::Tree == backend ? Backend::Bytecode : backend),
+		m_specializePower(true),
+		m_funcTree(nullptr),
+		m_image(std::move(owner)),
+		m_firstParameterSlot(0),
+		m_quadraticMap(false)
+	{
+		const FunctionImage::Header& header = FunctionImage::Validate(image, size);
+		if constexpr (!Traits::transcendental)
+			if (static_cast<unsigned>(FunctionParser::Precision::Extended) != header.precision)
+				throw FuncParseExcept(FuncParseExcept::UnsupportedPrecision, 0);
+		const unsigned char* const bytes = static_cast<const unsigned char*>(image);
+		m_slotCount = header.slotCount;
+		m_stackDepth = header.stackDepth;
+		m_tempCount = header.tempCount;
+		m_precision = static_cast<FunctionParser::Precision>(header.precision);
+		m_code = reinterpret_cast<const Instruction*>(bytes + FunctionImage::InstructionOffset());
+		m_codeSize = header.instructionCount;
+		m_constantCount = header.constantCount;
+		if constexpr (Traits::dual)
+			for (size_t pc = 0; pc < m_codeSize; pc++)
+				if (m_code[pc].op >= OpCode::Abs && m_code[pc].op <= OpCode::Im)
+					throw FuncParseExcept(FuncParseExcept::NotDifferentiable, FunctionImage::InstructionOffset() + pc * sizeof(Instruction));
+		const double* const constants = reinterpret_cast<const double*>(bytes + FunctionImage::ConstantOffset(header));
+		if constexpr (std::is_same<NumberType, std::complex<double>>::value)
+		{
+			m_constantData = reinterpret_cast<const NumberType*>(constants);
+		}
+		else
+		{
+			for (size_t i = 0; i < m_constantCount; i++)
+				m_constants.push_back(Traits::FromComplex(std::complex<double>(constants[2 * i], constants[2 * i + 1])));
+			m_constantData = m_constants.data();
+		}
+		const unsigned char* const slotMap = bytes + FunctionImage::SlotMapOffset(header);
+		m_usedSlots.assign(slotMap, slotMap + m_slotCount);
+		if (Backend::Jit == m_backend)
+			CompileJit();
+		if constexpr (Traits::isComplex)
+			if (RealClosed(m_code, m_codeSize, constants, m_constantCount))
+				m_realFunction = std::make_shared<const CompiledFunction<Scalar>>(image, size, m_image, static_cast<typename CompiledFunction<Scalar>::Backend>(m_backend));
+	}
+
+	// Writes the program as a FunctionImage. Only Bytecode and Jit functions of a single function have one;
+	// constants are widened to complex<double>.
+	std::vector<unsigned char> Serialize() const
+	{
+		if (!m_code || !m_outputs.empty())
+			throw FuncParseExcept(FuncParseExcept::InvalidImage, 0);
+		FunctionImage::Header header = {};
+		header.magic = FunctionImage::Magic;
+		header.version = FunctionImage::Version;
+		header.instructionSize = sizeof(Instruction);
+		header.precision = static_cast<unsigned>(m_precision);
+		header.slotCount = static_cast<unsigned>(m_slotCount);
+		header.stackDepth = static_cast<unsigned>(m_stackDepth);
+		header.tempCount = static_cast<unsigned>(m_tempCount);
+		header.instructionCount = static_cast<unsigned>(m_codeSize);
+		header.constantCount = static_cast<unsigned>(m_constantCount);
+		header.size = FunctionImage::Size(header);
+
+		std::vector<unsigned char> image(static_cast<size_t>(header.size), 0);
+		std::memcpy(image.data(), &header, sizeof(header));
+		std::memcpy(image.data() + FunctionImage::InstructionOffset(), m_code, m_codeSize * sizeof(Instruction));
+		unsigned char* constants = image.data() + FunctionImage::ConstantOffset(header);
+		for (size_t i = 0; i < m_constantCount; i++)
+		{
+			const double parts[2] = { static_cast<double>(Traits::Real(m_constantData[i])), static_cast<double>(Traits::Imag(m_constantData[i])) };
+			std::memcpy(constants + i * sizeof(parts), parts, sizeof(parts));
+		}
+		for (size_t slot = 0; slot < m_slotCount; slot++)
+			image[FunctionImage::SlotMapOffset(header) + slot] = m_usedSlots[slot] ? 1 : 0;
+		return image;
+	}
+
+	inline Backend GetBackend() const { return m_backend; }
+	inline size_t SlotCount() const { return m_slotCount; }
+	inline bool IsSlotUsed(const size_t slot) const { return slot < m_usedSlots.size() && m_usedSlots[slot]; }
+	inline FunctionParser::Precision SupportedPrecision() const { return m_precision; }
+	inline const std::shared_ptr<const CompiledFunction<Scalar>>& RealFunction() const { return m_realFunction; }
+	inline size_t OutputCount() const { return std::max<size_t>(m_outputs.size(), 1); }
+	// z*z+c, which EvalContext::InteriorChecks::bulbs applies to; always false for functions loaded from images
+	inline bool IsQuadraticMap() const { return m_quadraticMap; }
+	// see FunctionParser::Parameters
+	inline const std::vector<std::string>& Parameters() const { return m_parameters; }
+	size_t ParameterSlot(const std::string_view name) const
+	{
+		const size_t k = std::find(m_parameters.begin(), m_parameters.end(), name) - m_parameters.begin();
+		return k < m_parameters.size() ? m_firstParameterSlot + k : FunctionParser::NoParameter;
+	}
+	inline bool IsParameterSlot(const size_t slot) const { return slot >= m_firstParameterSlot && slot - m_firstParameterSlot < m_parameters.size(); }
+
+	// Takes over the constants of parser if it compiles to the same program up to their values, e.g. after an
+	// edit that only changed a literal, and returns false without changing anything otherwise. Tree functions
+	// and ones loaded from an image never match. Nothing may evaluate the function meanwhile; existing
+	// contexts see the new values after EvalContext::ReloadConstants.
+	bool PatchConstants(const FunctionParser& parser)
+	{
+		return PatchConstants(parser, FunctionDag(parser.PseudoCode()));
+	}
+	bool PatchConstants(const FunctionParser& parser, const FunctionDag& dag)
+	{
+		if (!m_dag || dag.Size() != m_dag->Size() || dag.Roots() != m_dag->Roots() || parser.SupportedPrecision() != m_precision ||
+			parser.Parameters() != m_parameters)
+			return false;
+		for (size_t id = 0; id < dag.Size(); id++)
+		{
+			const FunctionDag::Node& node = dag[id];
+			const FunctionDag::Node& old = (*m_dag)[id];
+			if (node.type != old.type || node.index != old.index || node.function != old.function || node.op != old.op ||
+				node.params[0] != old.params[0] || node.params[1] != old.params[1] || node.uses != old.uses)
+				return false;
+			// expanded integer powers are part of the program
+			int exponent = 0, oldExponent = 0;
+			const bool expanded = SmallIntExponent(dag, node, exponent);
+			if (expanded != SmallIntExponent(*m_dag, old, oldExponent) || (expanded && exponent != oldExponent))
+				return false;
+		}
+		// the interior shortcuts trust this flag, and z^2 can become z^3 when powers are not expanded
+		if (QuadraticMap(dag) != m_quadraticMap)
+			return false;
+		if constexpr (Traits::isComplex)
+		{
+			if ((parser.IsRealOnly() && RealClosed(dag)) != static_cast<bool>(m_realFunction))
+				return false;
+			if (m_realFunction && !const_cast<CompiledFunction<Scalar>&>(*m_realFunction).PatchConstants(parser, dag))
+				return false;
+		}
+
+		const size_t width = Traits::isComplex ? 2 : 1;
+		double* jitConstants = m_jitScratch.empty() ? nullptr : m_jitScratch.data() + (m_stackDepth + m_tempCount) * width;
+		for (size_t i = 0; i < m_constants.size(); i++)
+		{
+			if (FunctionDag::NoParam == m_constantNodes[i])
+				continue;
+			m_constants[i] = Traits::FromComplex(dag[m_constantNodes[i]].value);
+			if (jitConstants)
+			{
+				jitConstants[i * width] = static_cast<double>(Traits::Real(m_constants[i]));
+				if (Traits::isComplex)
+					jitConstants[i * width + 1] = static_cast<double>(Traits::Imag(m_constants[i]));
+			}
+		}
+		m_dag = std::make_unique<const FunctionDag>(dag);
+		return true;
+	}
+};
+
+template <typename NumberType>
+class EvalContext
+{
+public:
+	using Backend = typename CompiledFunction<NumberType>::Backend;
+
+	static constexpr size_t BatchLanes = CompiledFunction<NumberType>::BatchLanes;
+	static constexpr size_t CSlot = FunctionParser::VariableSlot(-1);
+	static constexpr size_t ZSlot = FunctionParser::VariableSlot(0);
+
+private:
+	using Traits = mth::NumberTraits<NumberType>;
+	using Scalar = typename Traits::Scalar;
+
+public:
+	// Shortcuts for points that never escape, Iterate stops them early and reports maxIter steps (zOut gets
+	// the value the orbit was stopped at). All are off by default; periodicity and derivative are heuristics
+	// that may catch an orbit that would have escaped very late.
+	struct InteriorChecks
+	{
+		// Brent's cycle detection: the orbit is compared with a point saved at steps 1, 2, 4, 8, ... and
+		// stops when it comes back to within periodTolerance (a squared distance)
+		bool periodicity = false;
+		Scalar periodTolerance = Scalar(1e-20);
+		// main cardioid and period-2 bulb in closed form, for IsQuadraticMap functions started at z0 = 0
+		bool bulbs = false;
+		// follows a shadow orbit to estimate the squared derivative of the orbit since the last saved point
+		// and stops once it fell below derivativeTolerance, i.e. the orbit is contracting onto an attracting
+		// cycle; works for any formula at the cost of a second evaluation per step
+		bool derivative = false;
+		Scalar derivativeTolerance = Scalar(1e-24);
+	};
+
+private:
+	struct OrbitCheck
+	{
+		NumberType saved;
+		size_t saveAt;
+		// shadow orbit offset, kept near ShadowOffset in magnitude; the squared derivative is gain * |delta|^2 / offset^2
+		NumberType delta;
+		Scalar gain;
+	};
+
+	// about the square root of the precision, so the difference of the two orbits is still resolved
+	static Scalar ShadowOffset() { return Scalar(std::is_same<Scalar, float>::value ? 1e-3 : 1e-8); }
+
+	std::shared_ptr<const CompiledFunction<NumberType>> m_function;
+	std::vector<NumberType> m_variables;
+	mutable std::vector<NumberType> m_temps;
+	mutable std::vector<NumberType> m_stack;
+	mutable std::vector<Scalar> m_batchStack;
+	mutable std::vector<Scalar> m_batchTemps;
+	mutable std::vector<double> m_jitScratch;
+	// real fast path, only for complex types whose function has a RealFunction
+	std::unique_ptr<EvalContext<Scalar>> m_real;
+	std::vector<size_t> m_usedSlots;
+	std::vector<Scalar> m_realInputs;
+	std::vector<Scalar> m_realOutput;
+	FunctionProfile* m_profile;
+	InteriorChecks m_interior;
+
+	static Scalar Norm(const NumberType& value)
+	{
+		const Scalar re = Traits::Real(value), im = Traits::Imag(value);
+		return re * re + im * im;
+	}
+
+	bool InBulb(const NumberType& c, const NumberType& z0) const
+	{
+		if (!m_interior.bulbs || !m_function->m_quadraticMap || Traits::Real(z0) != Scalar(0) || Traits::Imag(z0) != Scalar(0))
+			return false;
+		const Scalar x = Traits::Real(c), y2 = Traits::Imag(c) * Traits::Imag(c);
+		const Scalar xq = x - Scalar(0.25), q = xq * xq + y2;
+		return q * (q + xq) <= Scalar(0.25) * y2 || (x + Scalar(1)) * (x + Scalar(1)) + y2 <= Scalar(0.0625);
+	}
+	void StartOrbit(OrbitCheck& orbit, const NumberType& z0) const
+	{
+		orbit.saved = z0;
+		orbit.saveAt = 1;
+		orbit.delta = Traits::Make(ShadowOffset(), Scalar(0));
+		orbit.gain = Scalar(1);
+	}
+	// step went from the orbit's previous point to next, shadow is f at that point plus delta (only read by
+	// the derivative check); true if the orbit is taken to be interior
+	bool StepOrbit(OrbitCheck& orbit, const size_t step, const NumberType& next, const NumberType& shadow) const
+	{
+		if (m_interior.periodicity && Norm(next - orbit.saved) <= m_interior.periodTolerance)
+			return true;
+		if (m_interior.derivative)
+		{
+			const Scalar offset2 = ShadowOffset() * ShadowOffset();
+			NumberType delta = shadow - next;
+			// not before the first save, the orbit of z0 = 0 starts at the critical point of every polynomial
+			if (orbit.saveAt > 1 && orbit.gain * Norm(delta) < m_interior.derivativeTolerance * offset2)
+				return true;
+			// rescale by powers of two so the gain stays exact
+			while (Scalar(4) * offset2 < Norm(delta))
+			{
+				delta = delta * Traits::Make(Scalar(0.5), Scalar(0));
+				orbit.gain = orbit.gain * Scalar(4);
+			}
+			while (Scalar(0) < Norm(delta) && Norm(delta) < Scalar(0.25) * offset2)
+			{
+				delta = delta * Traits::Make(Scalar(2), Scalar(0));
+				orbit.gain = orbit.gain * Scalar(0.25);
+			}
+			orbit.delta = delta;
+		}
+		// the derivative restarts with the saved point, so it covers at least the last half of the orbit
+		if (step == orbit.saveAt)
+		{
+			orbit.saved = next;
+			orbit.saveAt *= 2;
+			orbit.delta = Traits::Make(ShadowOffset(), Scalar(0));
+			orbit.gain = Scalar(1);
+		}
+		return false;
+	}
+
+	bool RealVariables() const
+	{
+		for (const size_t slot : m_usedSlots)
+			if (Traits::Imag(m_variables[slot]) != Scalar(0))
+				return false;
+		return true;
+	}
+	bool RealInputs(const NumberType* const* inputs, const size_t first, const size_t lanes) const
+	{
+		for (const size_t slot : m_usedSlots)
+		{
+			if (!inputs[slot])
+				continue;
+			for (size_t j = first; j < first + lanes; j++)
+				if (Traits::Imag(inputs[slot][j]) != Scalar(0))
+					return false;
+		}
+		return true;
+	}
+	void EvaluateReal(const NumberType* const* inputs, NumberType* output, const size_t first, const size_t lanes)
+	{
+		const Scalar* realInputs[FunctionParser::VariableSlot(FunctionParser::MaxVariableIndex) + 1] = {};
+		for (const size_t slot : m_usedSlots)
+		{
+			if (!inputs[slot])
+				continue;
+			Scalar* const plane = m_realInputs.data() + slot * BatchLanes;
+			for (size_t j = 0; j < lanes; j++)
+				plane[j] = Traits::Real(inputs[slot][first + j]);
+			realInputs[slot] = plane;
+		}
+		m_real->Evaluate(realInputs, m_realOutput.data(), lanes);
+		for (size_t j = 0; j < lanes; j++)
+			output[first + j] = Traits::Make(m_realOutput[j], Scalar(0));
+	}
+	NumberType Run() const
+	{
+		if constexpr (FunctionProfile::Enabled)
+		{
+			// the Jit backend is profiled through the interpreter of the same program
+			if (m_profile)
+			{
+				m_profile->CountEvaluations(1);
+				if (Backend::Tree != m_function->m_backend)
+					return m_function->Execute(m_variables.data(), m_stack.data(), m_temps.data(), m_profile);
+			}
+		}
+		switch (m_function->m_backend)
+		{
+		case Backend::Tree:
+			return m_function->m_funcTree->Eval(m_variables.data(), m_temps.data());
+		case Backend::Jit:
+			m_function->m_jit->Get()(reinterpret_cast<const double*>(m_variables.data()), m_jitScratch.data());
+			return Traits::Make(static_cast<Scalar>(m_jitScratch[0]), static_cast<Scalar>(m_jitScratch[Traits::isComplex ? 1 : 0]));
+		default:
+			return m_function->Execute(m_variables.data(), m_stack.data(), m_temps.data());
+		}
+	}
+	// value of output temp after Run, the machine code keeps its temps in the scratch area
+	NumberType Output(const size_t temp) const
+	{
+		bool jit = Backend::Jit == m_function->m_backend;
+		if constexpr (FunctionProfile::Enabled)
+			jit = jit && !m_profile;
+		if (!jit)
+			return m_temps[temp];
+		const size_t width = Traits::isComplex ? 2 : 1;
+		const double* const value = m_jitScratch.data() + (m_function->m_stackDepth + temp) * width;
+		return Traits::Make(static_cast<Scalar>(value[0]), static_cast<Scalar>(value[width - 1]));
+	}
+
+public:
+	EvalContext(std::shared_ptr<const CompiledFunction<NumberType>> function) :
+		m_function(std::move(function)),
+		m_variables(m_function->m_slotCount),
+		m_temps(m_function->m_tempCount),
+		m_stack(m_function->m_stackDepth),
+		m_jitScratch(m_function->m_jitScratch),
+		m_profile(nullptr)
+	{
+		if (Backend::Tree != m_function->m_backend)
+		{
+			m_batchStack.resize(m_function->BatchStackSize());
+			m_batchTemps.resize(m_function->BatchTempSize());
+		}
+		if constexpr (Traits::isComplex)
+		{
+			if (m_function->m_realFunction)
+			{
+				m_real = std::make_unique<EvalContext<Scalar>>(m_function->m_realFunction);
+				for (size_t slot = 0; slot < m_variables.size(); slot++)
+					if (m_function->IsSlotUsed(slot))
+						m_usedSlots.push_back(slot);
+				m_realInputs.resize(m_variables.size() * BatchLanes);
+				m_realOutput.resize(std::max(BatchLanes, m_function->OutputCount()));
+			}
+		}
+	}
+
+	NumberType operator()() const
+	{
+		if constexpr (Traits::isComplex)
+		{
+			if (m_real && RealVariables())
+			{
+				for (const size_t slot : m_usedSlots)
+					m_real->Variables()[slot] = Traits::Real(m_variables[slot]);
+				return Traits::Make((*m_real)(), Scalar(0));
+			}
+		}
+		return Run();
+	}
+	// All OutputCount values of the function at Variables() from one run of the program
+	void Evaluate(NumberType* outputs)
+	{
+		const std::vector<size_t>& temps = m_function->m_outputs;
+		if (temps.empty())
+		{
+			outputs[0] = (*this)();
+			return;
+		}
+		if constexpr (Traits::isComplex)
+		{
+			if (m_real && RealVariables())
+			{
+				for (const size_t slot : m_usedSlots)
+					m_real->Variables()[slot] = Traits::Real(m_variables[slot]);
+				m_real->Evaluate(m_realOutput.data());
+				for (size_t i = 0; i < temps.size(); i++)
+					outputs[i] = Traits::Make(m_realOutput[i], Scalar(0));
+				return;
+			}
+		}
+		outputs[0] = Run();
+		for (size_t i = 1; i < temps.size(); i++)
+			outputs[i] = Output(temps[i]);
+	}
+	// inputs[slot] holds count values of that variable slot, unused slots may be null. Outside the tree
+	// backend sin, cos, tan, sinh, cosh, tanh, exp and log go through the vector_math.h kernels, so they
+	// may differ from a scalar evaluation in the last bits, within the bounds listed there.
+	void Evaluate(const NumberType* const* inputs, NumberType* output, const size_t count)
+	{
+		if (Backend::Tree == m_function->m_backend)
+		{
+			for (size_t i = 0; i < count; i++)
+			{
+				for (size_t k = 0; k < m_variables.size(); k++)
+					if (inputs[k])
+						m_variables[k] = inputs[k][i];
+				output[i] = (*this)();
+			}
+			return;
+		}
+		for (size_t first = 0; first < count; first += BatchLanes)
+		{
+			const size_t lanes = std::min(BatchLanes, count - first);
+			if constexpr (Traits::isComplex)
+			{
+				if (m_real && RealInputs(inputs, first, lanes))
+				{
+					EvaluateReal(inputs, output, first, lanes);
+					continue;
+				}
+			}
+			if constexpr (FunctionProfile::Enabled)
+				if (m_profile)
+					m_profile->CountEvaluations(lanes);
+			m_function->ExecuteBlock(inputs, output, first, lanes, m_batchStack.data(), m_batchTemps.data(), m_profile);
+		}
+	}
+	// outputs[i] receives count values of function i, every input is read once for all of them
+	void Evaluate(const NumberType* const* inputs, NumberType* const* outputs, const size_t count)
+	{
+		const std::vector<size_t>& temps = m_function->m_outputs;
+		if (temps.empty())
+		{
+			Evaluate(inputs, outputs[0], count);
+			return;
+		}
+		const size_t half = m_function->BatchTempSize() / 2;
+		for (size_t first = 0; first < count; first += BatchLanes)
+		{
+			const size_t lanes = std::min(BatchLanes, count - first);
+			if constexpr (FunctionProfile::Enabled)
+				if (m_profile)
+					m_profile->CountEvaluations(lanes);
+			m_function->ExecuteBlock(inputs, outputs[0], first, lanes, m_batchStack.data(), m_batchTemps.data(), m_profile);
+			for (size_t i = 1; i < temps.size(); i++)
+			{
+				const Scalar* const re = m_batchTemps.data() + temps[i] * BatchLanes;
+				const Scalar* const im = re + half;
+				for (size_t j = 0; j < lanes; j++)
+					outputs[i][first + j] = Traits::Make(re[j], Traits::isComplex ? im[j] : Scalar(0));
+			}
+		}
+	}
+	// z <- f(z, c) until |z| > bailout or maxIter steps, returns the number of steps taken
+	size_t Iterate(const NumberType& c, const NumberType& z0, const size_t maxIter, const Scalar bailout, NumberType* zOut = nullptr)
+	{
+		const Scalar limit = bailout * bailout;
+		NumberType* const zSlot = &m_variables[ZSlot];
+		m_variables[CSlot] = c;
+		NumberType z = z0;
+		size_t n = 0;
+		const bool trackOrbit = m_interior.periodicity || m_interior.derivative;
+		OrbitCheck orbit;
+		StartOrbit(orbit, z0);
+		if (InBulb(c, z0))
+			n = maxIter;
+		for (; n < maxIter && Norm(z) <= limit; n++)
+		{
+			*zSlot = z;
+			const NumberType next = (*this)();
+			NumberType shadow = next;
+			if (m_interior.derivative)
+			{
+				*zSlot = z + orbit.delta;
+				shadow = (*this)();
+			}
+			z = next;
+			if (trackOrbit && Norm(z) <= limit && StepOrbit(orbit, n + 1, z, shadow))
+			{
+				n = maxIter;
+				break;
+			}
+		}
+		if (zOut)
+			*zOut = z;
+		if constexpr (FunctionProfile::Enabled)
+			if (m_profile)
+				m_profile->RecordIterations(n);
+		return n;
+	}
+	// Iterate over count points, z0 may be null for zero starting values
+	void Iterate(const NumberType* c, const NumberType* z0, const size_t count, const size_t maxIter, const Scalar bailout,
+		size_t* iterations, NumberType* zOut = nullptr)
+	{
+		if (Backend::Tree == m_function->m_backend)
+		{
+			for (size_t i = 0; i < count; i++)
+				iterations[i] = Iterate(c[i], z0 ? z0[i] : NumberType(), maxIter, bailout, zOut ? zOut + i : nullptr);
+			return;
+		}
+
+		const Scalar limit = bailout * bailout;
+		const size_t slotCount = m_variables.size();
+		const bool trackOrbit = m_interior.periodicity || m_interior.derivative;
+		std::vector<NumberType> buffers(BatchLanes * (slotCount + 3));
+		std::vector<size_t> pixel(BatchLanes), steps(BatchLanes);
+		std::vector<OrbitCheck> orbits(trackOrbit ? BatchLanes : 0);
+		std::vector<char> interior(BatchLanes);
+		std::vector<NumberType> shadowIn(m_interior.derivative ? BatchLanes : 0), shadowOut(shadowIn.size());
+		NumberType* const zBuf = buffers.data();
+		NumberType* const cBuf = zBuf + BatchLanes;
+		NumberType* const outBuf = cBuf + BatchLanes;
+		std::vector<const NumberType*> inputs(slotCount);
+		for (size_t k = 0; k < slotCount; k++)
+		{
+			if (ZSlot == k)
+				inputs[k] = zBuf;
+			else if (CSlot == k)
+				inputs[k] = cBuf;
+			else
+			{
+				NumberType* const broadcast = outBuf + BatchLanes * (k + 1);
+				std::fill(broadcast, broadcast + BatchLanes, m_variables[k]);
+				inputs[k] = broadcast;
+			}
+		}
+		std::vector<const NumberType*> shadowInputs(inputs);
+		shadowInputs[ZSlot] = shadowIn.data();
+
+		size_t next = 0, active = 0;
+		for (;;)
+		{
+			for (; active < BatchLanes && next < count; next++)
+			{
+				const NumberType start = z0 ? z0[next] : NumberType();
+				if (InBulb(c[next], start))
+				{
+					iterations[next] = maxIter;
+					if constexpr (FunctionProfile::Enabled)
+						if (m_profile)
+							m_profile->RecordIterations(maxIter);
+					if (zOut)
+						zOut[next] = start;
+					continue;
+				}
+				zBuf[active] = start;
+				cBuf[active] = c[next];
+				pixel[active] = next;
+				steps[active] = 0;
+				interior[active] = false;
+				if (trackOrbit)
+					StartOrbit(orbits[active], start);
+				active++;
+			}
+			for (size_t j = 0; j < active;)
+			{
+				if (!interior[j] && steps[j] < maxIter && Norm(zBuf[j]) <= limit)
+				{
+					j++;
+					continue;
+				}
+				const size_t n = interior[j] ? maxIter : steps[j];
+				iterations[pixel[j]] = n;
+				if constexpr (FunctionProfile::Enabled)
+					if (m_profile)
+						m_profile->RecordIterations(n);
+				if (zOut)
+					zOut[pixel[j]] = zBuf[j];
+				if (j != --active)
+				{
+					zBuf[j] = zBuf[active];
+					cBuf[j] = cBuf[active];
+					pixel[j] = pixel[active];
+					steps[j] = steps[active];
+					interior[j] = interior[active];
+					if (trackOrbit)
+						orbits[j] = orbits[active];
+				}
+			}
+			if (!active)
+			{
+				if (next < count)
+					continue;
+				break;
+			}
+			if constexpr (FunctionProfile::Enabled)
+				if (m_profile)
+					m_profile->CountEvaluations(active);
+			m_function->ExecuteBlock(inputs.data(), outBuf, 0, active, m_batchStack.data(), m_batchTemps.data(), m_profile);
+			if (m_interior.derivative)
+			{
+				for (size_t j = 0; j < active; j++)
+					shadowIn[j] = zBuf[j] + orbits[j].delta;
+				m_function->ExecuteBlock(shadowInputs.data(), shadowOut.data(), 0, active, m_batchStack.data(), m_batchTemps.data(), m_profile);
+			}
+			for (size_t j = 0; j < active; j++)
+			{
+				zBuf[j] = outBuf[j];
+				steps[j]++;
+				if (trackOrbit && Norm(zBuf[j]) <= limit)
+					interior[j] = StepOrbit(orbits[j], steps[j], zBuf[j], m_interior.derivative ? shadowOut[j] : zBuf[j]);
+			}
+		}
+	}
+	// Coupled iteration of a multi-output function: every step evaluates all outputs from the current
+	// Variables() and then writes output i to slot targets[i], all at once. Stops when one of the targets
+	// exceeds bailout in magnitude or after maxIter steps and returns the number of steps; Variables() holds
+	// the last state.
+	size_t IterateSystem(const size_t* targets, const size_t maxIter, const Scalar bailout)
+	{
+		const size_t outputCount = m_function->OutputCount();
+		for (size_t i = 0; i < outputCount; i++)
+			if (targets[i] >= m_variables.size())
+				throw FuncParseExcept(FuncParseExcept::InvalidVariableIndex, 0);
+		const Scalar limit = bailout * bailout;
+		const auto escaped = [&]()
+		{
+			for (size_t i = 0; i < outputCount; i++)
+				if (Norm(m_variables[targets[i]]) > limit)
+					return true;
+			return false;
+		};
+		std::vector<NumberType> outputs(outputCount);
+		size_t n = 0;
+		for (; n < maxIter && !escaped(); n++)
+		{
+			Evaluate(outputs.data());
+			for (size_t i = 0; i < outputCount; i++)
+				m_variables[targets[i]] = outputs[i];
+		}
+		if constexpr (FunctionProfile::Enabled)
+			if (m_profile)
+				m_profile->RecordIterations(n);
+		return n;
+	}
+	// applies to every later Iterate
+	inline void SetInteriorChecks(const InteriorChecks& checks) { m_interior = checks; }
+	inline const InteriorChecks& GetInteriorChecks() const { return m_interior; }
+	inline Backend GetBackend() const { return m_function->m_backend; }
+	inline bool HasRealPath() const { return static_cast<bool>(m_real); }
+	// Counters of every later evaluation go to profile (null detaches it), see FunctionProfile. The Tree
+	// backend only counts evaluations and iterations. The context does not own the profile and only one
+	// thread may use it at a time.
+	void SetProfile(FunctionProfile* const profile)
+	{
+		m_profile = profile;
+		if (m_real)
+			m_real->SetProfile(profile);
+	}
+	inline FunctionProfile* Profile() const { return m_profile; }
+	// Picks up constants changed by CompiledFunction::PatchConstants, the Jit backend keeps a copy of them
+	void ReloadConstants()
+	{
+		const std::vector<double>& scratch = m_function->m_jitScratch;
+		if (!scratch.empty())
+		{
+			const size_t first = scratch.size() - m_function->ConstantCount() * (Traits::isComplex ? 2 : 1);
+			std::copy(scratch.begin() + first, scratch.end(), m_jitScratch.begin() + first);
+		}
+		if (m_real)
+			m_real->ReloadConstants();
+	}
+	inline const std::shared_ptr<const CompiledFunction<NumberType>>& Function() const { return m_function; }
+	inline NumberType* Variables() { return m_variables.data(); }
+	inline const NumberType* Variables() const { return m_variables.data(); }
+	inline size_t VariableCount() const { return m_variables.size(); }
+	inline NumberType& VariableValue(const int index) { return m_variables[FunctionParser::VariableSlot(index)]; }
+	// False if the function has no parameter of that name; per-frame updates can cache ParameterSlot instead
+	bool SetParameter(const std::string_view name, const NumberType& value)
+	{
+		const size_t slot = m_function->ParameterSlot(name);
+		if (FunctionParser::NoParameter == slot)
+			return false;
+		m_variables[slot] = value;
+		return true;
+	}
+	void SetVariables(const NumberType* values, const size_t count)
+	{
+		std::copy(values, values + std::min(count, m_variables.size()), m_variables.begin());
+	}
+};
+
+template <typename NumberType>
+class FunctionEvaluator : public EvalContext<NumberType>
+{
+public:
+	using Backend = typename CompiledFunction<NumberType>::Backend;
+
+	FunctionEvaluator(const FunctionParser& parser, const Backend backend = Backend::Bytecode) :
+		EvalContext<NumberType>(std::make_shared<const CompiledFunction<NumberType>>(parser, backend)) {}
 };
 
 std::ostream& operator<<(std::ostream& os, const FunctionParser::FuncElem& funcElem);
@@ -0,0 +1,543 @@
+#include "perturbation.h"
+
+using Complex = PerturbationRenderer::Complex;
+using FuncType = FunctionParser::FuncElem::Type;
+using FunctionName = FunctionParser::Function::Name;
+using OperatorName = FunctionParser::Operator::Name;
+
+static constexpr double Pi = 3.14159265358979323846;
+
+static Complex Expm1(const Complex z)
+{
+	const double s = std::sin(z.imag() / 2);
+	return Complex(std::expm1(z.real()) * std::cos(z.imag()) - 2 * s * s, std::exp(z.real()) * std::sin(z.imag()));
+}
+
+// log(R + d) - log(R) on the principal branch
+static Complex LogDelta(const Complex r, const Complex d)
+{
+	const Complex a = r + d;
+	if (r.real() < 0 && (r.imag() < 0) != (a.imag() < 0))
+		return std::log(a) - std::log(r);
+	const Complex x = d / r;
+	return Complex(std::log1p(2 * x.real() + std::norm(x)) / 2, std::atan2(x.imag(), 1 + x.real()));
+}
+
+// |x + d| - |x|
+static double AbsDelta(const double x, const double d)
+{
+	if (x >= 0 && x + d >= 0)
+		return d;
+	if (x < 0 && x + d < 0)
+		return -d;
+	return std::abs(x + d) - std::abs(x);
+}
+
+// (R + d)^n - R^n = d * sum (R + d)^k R^(n-1-k)
+static Complex IntPowerDelta(const Complex r, const Complex d, const int n)
+{
+	const Complex a = r + d;
+	Complex sum(1), power(1);
+	for (int k = 1; k < std::abs(n); k++)
+	{
+		power *= r;
+		sum = a * sum + power;
+	}
+	const Complex delta = d * sum;
+	if (n > 0)
+		return delta;
+	const Complex rn = power * r;
+	return -delta / ((rn + delta) * rn);
+}
+
+static Complex FunctionDelta(const FunctionName name, const Complex r, const Complex d)
+{
+	const Complex h = d / 2.0;
+	switch (name)
+	{
+	case FunctionName::sin: return 2.0 * std::cos(r + h) * std::sin(h);
+	case FunctionName::cos: return -2.0 * std::sin(r + h) * std::sin(h);
+	case FunctionName::tan: return std::sin(d) / (std::cos(r) * std::cos(r + d));
+	case FunctionName::sinh: return 2.0 * std::cosh(r + h) * std::sinh(h);
+	case FunctionName::cosh: return 2.0 * std::sinh(r + h) * std::sinh(h);
+	case FunctionName::tanh: return std::sinh(d) / (std::cosh(r) * std::cosh(r + d));
+	case FunctionName::exp: return std::exp(r) * Expm1(d);
+	case FunctionName::log: return LogDelta(r, d);
+	case FunctionName::abs:
+	{
+		const double sum = std::abs(r + d) + std::abs(r);
+		return sum > 0 ? (2 * (r.real() * d.real() + r.imag() * d.imag()) + std::norm(d)) / sum : 0.0;
+	}
+	case FunctionName::pos: return Complex(AbsDelta(r.real(), d.real()), AbsDelta(r.imag(), d.imag()));
+	case FunctionName::re: return AbsDelta(r.real(), d.real());
+	case FunctionName::im: return AbsDelta(r.imag(), d.imag());
+	case FunctionName::ang:
+	{
+		const Complex a = r + d;
+		const double direct = std::arg(a) - std::arg(r);
+		const double turn = std::arg(a * std::conj(r));
+		return turn + 2 * Pi * std::round((direct - turn) / (2 * Pi));
+	}
+	default:
+		throw FuncParseExcept(FuncParseExcept::UnknownSymbol, 0);
+	}
+}
+
+// Reference value of a function or operator node, the same kernels CompiledFunction<complex<double>> uses
+static Complex Apply(const FunctionDag::Node& node, const Complex lhs, const Complex rhs)
+{
+	if (FuncType::Operator == node.type)
+	{
+		switch (node.op)
+		{
+		case OperatorName::add: return lhs + rhs;
+		case OperatorName::sub: return lhs - rhs;
+		case OperatorName::mul: return lhs * rhs;
+		case OperatorName::div: return lhs / rhs;
+		case OperatorName::pow: return std::pow(lhs, rhs);
+		default: throw FuncParseExcept(FuncParseExcept::UnknownSymbol, 0);
+		}
+	}
+	switch (node.function)
+	{
+	case FunctionName::sin: return std::sin(lhs);
+	case FunctionName::cos: return std::cos(lhs);
+	case FunctionName::tan: return std::tan(lhs);
+	case FunctionName::sinh: return std::sinh(lhs);
+	case FunctionName::cosh: return std::cosh(lhs);
+	case FunctionName::tanh: return std::tanh(lhs);
+	case FunctionName::exp: return std::exp(lhs);
+	case FunctionName::log: return std::log(lhs);
+	case FunctionName::abs: return std::abs(lhs);
+	case FunctionName::pos: return mth::pos(lhs);
+	case FunctionName::ang: return mth::ang(lhs);
+	case FunctionName::re: return mth::re(lhs);
+	case FunctionName::im: return mth::im(lhs);
+	default: throw FuncParseExcept(FuncParseExcept::UnknownSymbol, 0);
+	}
+}
+
+// Truncated power series arithmetic in dc, element 0 is the value at dc = 0
+template <typename Series>
+static Series SeriesMul(const Series& a, const Series& b)
+{
+	Series r = {};
+	for (size_t k = 0; k < r.size(); k++)
+		for (size_t j = 0; j <= k; j++)
+			r[k] += a[j] * b[k - j];
+	return r;
+}
+
+template <typename Series>
+static Series SeriesDiv(const Series& a, const Series& b)
+{
+	Series q = {};
+	for (size_t k = 0; k < q.size(); k++)
+	{
+		Complex sum = a[k];
+		for (size_t j = 1; j <= k; j++)
+			sum -= b[j] * q[k - j];
+		q[k] = sum / b[0];
+	}
+	return q;
+}
+
+template <typename Series>
+static Series SeriesExp(const Series& a)
+{
+	Series e = {};
+	e[0] = std::exp(a[0]);
+	for (size_t k = 1; k < e.size(); k++)
+	{
+		for (size_t j = 1; j <= k; j++)
+			e[k] += static_cast<double>(j) * a[j] * e[k - j];
+		e[k] /= static_cast<double>(k);
+	}
+	return e;
+}
+
+template <typename Series>
+static Series SeriesLog(const Series& a)
+{
+	Series l = {};
+	l[0] = std::log(a[0]);
+	for (size_t k = 1; k < l.size(); k++)
+	{
+		Complex sum = a[k];
+		for (size_t j = 1; j < k; j++)
+			sum -= static_cast<double>(j) / static_cast<double>(k) * l[j] * a[k - j];
+		l[k] = sum / a[0];
+	}
+	return l;
+}
+
+// sin and cos (hyperbolic: sinh and cosh) of a, from s' = a' c and c' = -+ a' s
+template <typename Series>
+static void SeriesSinCos(const Series& a, const bool hyperbolic, Series& s, Series& c)
+{
+	s = {};
+	c = {};
+	s[0] = hyperbolic ? std::sinh(a[0]) : std::sin(a[0]);
+	c[0] = hyperbolic ? std::cosh(a[0]) : std::cos(a[0]);
+	for (size_t k = 1; k < s.size(); k++)
+	{
+		for (size_t j = 1; j <= k; j++)
+		{
+			s[k] += static_cast<double>(j) * a[j] * c[k - j];
+			c[k] += static_cast<double>(j) * a[j] * s[k - j];
+		}
+		s[k] /= static_cast<double>(k);
+		c[k] /= hyperbolic ? static_cast<double>(k) : -static_cast<double>(k);
+	}
+}
+
+template <typename Series>
+static Series SeriesIntPower(const Series& a, const int n)
+{
+	Series result = {};
+	result[0] = 1.0;
+	Series base = a;
+	for (int m = std::abs(n); m; m >>= 1)
+	{
+		if (m & 1)
+			result = SeriesMul(result, base);
+		base = SeriesMul(base, base);
+	}
+	if (n > 0)
+		return result;
+	Series one = {};
+	one[0] = 1.0;
+	return SeriesDiv(one, result);
+}
+
+PerturbationRenderer::PerturbationRenderer(const FunctionParser& parser, WorkStealingPool& pool) :
+	m_dag(parser.PseudoCode()),
+	m_intPowers(m_dag.Size(), 0),
+	m_holomorphic(parser.IsDifferentiable()),
+	m_double(std::make_shared<const CompiledFunction<Complex>>(parser)),
+	m_variables(std::max(parser.UsedVariables().size(), ZSlot + 1)),
+	m_pool(pool),
+	m_stats()
+{
+	if (FunctionParser::Precision::Extended == parser.SupportedPrecision())
+		m_extended = std::make_shared<const CompiledFunction<mth::DoubleDoubleComplex>>(parser);
+	for (size_t id = 0; id < m_dag.Size(); id++)
+	{
+		const FunctionDag::Node& node = m_dag[id];
+		if (FuncType::Operator == node.type && OperatorName::pow == node.op && FuncType::Constant == m_dag[node.params[1]].type)
+		{
+			const Complex exponent = m_dag[node.params[1]].value;
+			if (exponent.imag() == 0 && exponent.real() != 0 && exponent.real() == std::floor(exponent.real()) &&
+				std::abs(exponent.real()) <= FunctionParser::MaxIntPower)
+				m_intPowers[id] = static_cast<int>(exponent.real());
+		}
+	}
+}
+
+void PerturbationRenderer::ComputeReference(const mth::DoubleDoubleComplex& c, const Options& options)
+{
+	const double limit = options.bailout * options.bailout;
+	m_orbit.assign(1, Complex());
+	if (m_extended)
+	{
+		EvalContext<mth::DoubleDoubleComplex> context(m_extended);
+		for (size_t slot = 0; slot < m_variables.size(); slot++)
+			context.Variables()[slot] = mth::NumberTraits<mth::DoubleDoubleComplex>::FromComplex(m_variables[slot]);
+		context.Variables()[CSlot] = c;
+		mth::DoubleDoubleComplex z;
+		while (m_orbit.size() <= options.maxIter && std::norm(m_orbit.back()) <= limit)
+		{
+			context.Variables()[ZSlot] = z;
+			z = context();
+			m_orbit.emplace_back(static_cast<double>(z.re), static_cast<double>(z.im));
+		}
+	}
+	else
+	{
+		EvalContext<Complex> context(m_double);
+		context.SetVariables(m_variables.data(), m_variables.size());
+		context.Variables()[CSlot] = Complex(static_cast<double>(c.re), static_cast<double>(c.im));
+		while (m_orbit.size() <= options.maxIter && std::norm(m_orbit.back()) <= limit)
+		{
+			context.Variables()[ZSlot] = m_orbit.back();
+			m_orbit.push_back(context());
+		}
+	}
+
+	const size_t nodeCount = m_dag.Size();
+	m_reference.resize((m_orbit.size() - 1) * nodeCount);
+	for (size_t step = 0; step + 1 < m_orbit.size(); step++)
+	{
+		Complex* const values = m_reference.data() + step * nodeCount;
+		for (size_t id = 0; id < nodeCount; id++)
+		{
+			const FunctionDag::Node& node = m_dag[id];
+			if (FuncType::Constant == node.type)
+				values[id] = node.value;
+			else if (FuncType::Variable == node.type)
+				values[id] = CSlot == FunctionParser::VariableSlot(node.index) ? m_center :
+					ZSlot == FunctionParser::VariableSlot(node.index) ? m_orbit[step] : m_variables[FunctionParser::VariableSlot(node.index)];
+			else
+				values[id] = Apply(node, values[node.params[0]], FunctionDag::NoParam == node.params[1] ? Complex() : values[node.params[1]]);
+		}
+	}
+}
+
+Complex PerturbationRenderer::Delta(const size_t step, const Complex delta, const Complex dc, Complex* deltas) const
+{
+	const Complex* const values = m_reference.data() + step * m_dag.Size();
+	for (size_t id = 0; id < m_dag.Size(); id++)
+	{
+		const FunctionDag::Node& node = m_dag[id];
+		switch (node.type)
+		{
+		case FuncType::Constant:
+			deltas[id] = 0.0;
+			break;
+		case FuncType::Variable:
+			deltas[id] = CSlot == FunctionParser::VariableSlot(node.index) ? dc : ZSlot == FunctionParser::VariableSlot(node.index) ? delta : 0.0;
+			break;
+		case FuncType::Function:
+			deltas[id] = FunctionDelta(node.function, values[node.params[0]], deltas[node.params[0]]);
+			break;
+		case FuncType::Operator:
+		{
+			const Complex ra = values[node.params[0]], rb = values[node.params[1]];
+			const Complex da = deltas[node.params[0]], db = deltas[node.params[1]];
+			switch (node.op)
+			{
+			case OperatorName::add: deltas[id] = da + db; break;
+			case OperatorName::sub: deltas[id] = da - db; break;
+			case OperatorName::mul: deltas[id] = ra * db + da * (rb + db); break;
+			case OperatorName::div: deltas[id] = (da * rb - ra * db) / (rb * (rb + db)); break;
+			case OperatorName::pow:
+				if (m_intPowers[id])
+					deltas[id] = IntPowerDelta(ra, da, m_intPowers[id]);
+				else if (ra == 0.0)
+					deltas[id] = std::pow(ra + da, rb + db) - values[id];
+				else
+					deltas[id] = values[id] * Expm1(rb * LogDelta(ra, da) + db * std::log(ra + da));
+				break;
+			default:
+				throw FuncParseExcept(FuncParseExcept::UnknownSymbol, 0);
+			}
+			break;
+		}
+		default:
+			throw FuncParseExcept(FuncParseExcept::UnknownError, 0);
+		}
+	}
+	return deltas[m_dag.Root()];
+}
+
+PerturbationRenderer::Series PerturbationRenderer::SeriesStep(const size_t step, const Series& delta, Series* values) const
+{
+	for (size_t id = 0; id < m_dag.Size(); id++)
+	{
+		const FunctionDag::Node& node = m_dag[id];
+		Series& value = values[id];
+		switch (node.type)
+		{
+		case FuncType::Constant:
+			value = {};
+			value[0] = node.value;
+			break;
+		case FuncType::Variable:
+			value = {};
+			if (ZSlot == FunctionParser::VariableSlot(node.index))
+			{
+				value = delta;
+				value[0] = m_orbit[step];
+			}
+			else if (CSlot == FunctionParser::VariableSlot(node.index))
+			{
+				value[0] = m_center;
+				value[1] = 1.0;
+			}
+			else
+				value[0] = m_variables[FunctionParser::VariableSlot(node.index)];
+			break;
+		case FuncType::Function:
+		{
+			const Series& a = values[node.params[0]];
+			Series s, c;
+			switch (node.function)
+			{
+			case FunctionName::sin: SeriesSinCos(a, false, value, c); break;
+			case FunctionName::cos: SeriesSinCos(a, false, s, value); break;
+			case FunctionName::tan: SeriesSinCos(a, false, s, c); value = SeriesDiv(s, c); break;
+			case FunctionName::sinh: SeriesSinCos(a, true, value, c); break;
+			case FunctionName::cosh: SeriesSinCos(a, true, s, value); break;
+			case FunctionName::tanh: SeriesSinCos(a, true, s, c); value = SeriesDiv(s, c); break;
+			case FunctionName::exp: value = SeriesExp(a); break;
+			case FunctionName::log: value = SeriesLog(a); break;
+			default: throw FuncParseExcept(FuncParseExcept::UnknownSymbol, 0);
+			}
+			break;
+		}
+		case FuncType::Operator:
+		{
+			const Series& a = values[node.params[0]];
+			const Series& b = values[node.params[1]];
+			switch (node.op)
+			{
+			case OperatorName::add: for (size_t k = 0; k < value.size(); k++) value[k] = a[k] + b[k]; break;
+			case OperatorName::sub: for (size_t k = 0; k < value.size(); k++) value[k] = a[k] - b[k]; break;
+			case OperatorName::mul: value = SeriesMul(a, b); break;
+			case OperatorName::div: value = SeriesDiv(a, b); break;
+			case OperatorName::pow: value = m_intPowers[id] ? SeriesIntPower(a, m_intPowers[id]) : SeriesExp(SeriesMul(b, SeriesLog(a))); break;
+			default: throw FuncParseExcept(FuncParseExcept::UnknownSymbol, 0);
+			}
+			break;
+		}
+		default:
+			throw FuncParseExcept(FuncParseExcept::UnknownError, 0);
+		}
+	}
+	Series next = values[m_dag.Root()];
+	next[0] = 0.0;
+	return next;
+}
+
+static Complex EvaluateSeries(const std::array<Complex, PerturbationRenderer::SeriesOrder + 1>& series, const Complex dc)
+{
+	Complex sum = 0.0;
+	for (size_t k = series.size() - 1; k > 0; k--)
+		sum = (sum + series[k]) * dc;
+	return sum;
+}
+
+// Longest prefix of the orbit the series stays accurate for: its last term has to be negligible over the
+// whole region and it has to agree with plain perturbation at the probe pixels
+size_t PerturbationRenderer::ComputeSeries(const double radius, const std::vector<Complex>& probes, const Options& options)
+{
+	const size_t steps = std::min(m_orbit.size() - 1, options.maxIter);
+	std::vector<Series> values(m_dag.Size());
+	m_series.assign(1, Series());
+	for (size_t step = 0; step < steps; step++)
+	{
+		const Series next = SeriesStep(step, m_series.back(), values.data());
+		double lead = 0, power = 1;
+		for (size_t k = 1; k < SeriesOrder; k++)
+			lead += std::abs(next[k]) * (power *= radius);
+		if (!(std::abs(next[SeriesOrder]) * power * radius <= options.seriesTolerance * lead))
+			break;
+		m_series.push_back(next);
+	}
+
+	size_t skip = m_series.size() - 1;
+	const double limit = options.bailout * options.bailout;
+	std::vector<Complex> deltas(m_dag.Size());
+	std::vector<std::vector<Complex>> paths(probes.size());
+	for (size_t p = 0; p < probes.size(); p++)
+	{
+		Complex delta = 0.0;
+		paths[p].push_back(delta);
+		for (size_t step = 0; step < skip; step++)
+		{
+			const Complex z = m_orbit[step] + delta;
+			if (std::norm(z) > limit || std::norm(z) < std::norm(delta))
+			{
+				skip = step;
+				break;
+			}
+			delta = Delta(step, delta, probes[p], deltas.data());
+			paths[p].push_back(delta);
+		}
+	}
+	for (; skip > 0; skip--)
+	{
+		bool valid = true;
+		for (size_t p = 0; p < probes.size() && valid; p++)
+			valid = std::abs(EvaluateSeries(m_series[skip], probes[p]) - paths[p][skip]) <= options.seriesTolerance * std::abs(paths[p][skip]);
+		if (valid)
+			break;
+	}
+	m_series.resize(skip + 1);
+	return skip;
+}
+
+size_t PerturbationRenderer::RenderPixel(const Complex dc, const size_t skip, const Options& options, Complex* deltas, size_t& rebases) const
+{
+	const double limit = options.bailout * options.bailout;
+	const size_t last = m_orbit.size() - 1;
+	Complex delta = skip ? EvaluateSeries(m_series[skip], dc) : 0.0;
+	size_t step = skip, n = skip;
+	for (; n < options.maxIter; n++)
+	{
+		const Complex z = m_orbit[step] + delta;
+		if (std::norm(z) > limit)
+			break;
+		if (step == last || std::norm(z) < std::norm(delta))
+		{
+			delta = z;
+			step = 0;
+			rebases++;
+		}
+		delta = Delta(step++, delta, dc, deltas);
+	}
+	return n;
+}
+
+bool PerturbationRenderer::Render(const GridRegion<mth::DoubleDouble>& region, const Options& options, size_t* iterations)
+{
+	const mth::DoubleDoubleComplex center((region.minRe + region.maxRe) * 0.5, (region.minIm + region.maxIm) * 0.5);
+	m_center = Complex(static_cast<double>(center.re), static_cast<double>(center.im));
+	ComputeReference(center, options);
+	m_stats = {};
+	m_stats.referenceLength = m_orbit.size() - 1;
+	const auto offset = [&](const size_t x, const size_t y)
+	{
+		return Complex(static_cast<double>(region.Re(x) - center.re), static_cast<double>(region.Im(y) - center.im));
+	};
+
+	size_t skip = 0;
+	m_series.assign(1, Series());
+	if (options.seriesApproximation && m_holomorphic && region.width && region.height)
+	{
+		const size_t xs[] = { 0, region.width / 2, region.width - 1 };
+		const size_t ys[] = { 0, region.height / 2, region.height - 1 };
+		std::vector<Complex> probes;
+		for (const size_t y : ys)
+			for (const size_t x : xs)
+				if (x != region.width / 2 || y != region.height / 2)
+					probes.push_back(offset(x, y));
+		double radius = 0;
+		for (const Complex& probe : probes)
+			radius = std::max(radius, std::abs(probe));
+		skip = ComputeSeries(radius, probes, options);
+	}
+	m_stats.skippedIterations = skip;
+
+	const size_t tileSize = std::max<size_t>(options.tileSize, 1);
+	std::vector<Tile> tiles;
+	for (size_t y = 0; y < region.height; y += tileSize)
+		for (size_t x = 0; x < region.width; x += tileSize)
+			tiles.push_back({ x, y, std::min(tileSize, region.width - x), std::min(tileSize, region.height - y) });
+	std::vector<std::vector<Complex>> scratch(m_pool.ThreadCount(), std::vector<Complex>(m_dag.Size()));
+	std::atomic<size_t> finished(0), rebases(0);
+	std::atomic<bool> cancelled(false);
+	std::mutex progressLock;
+	m_pool.Run(tiles.size(), [&](const size_t task, const size_t worker)
+	{
+		if (cancelled || (options.cancel && *options.cancel))
+		{
+			cancelled = true;
+			return;
+		}
+		const Tile& tile = tiles[task];
+		size_t tileRebases = 0;
+		for (size_t y = tile.y; y < tile.y + tile.height; y++)
+			for (size_t x = tile.x; x < tile.x + tile.width; x++)
+				iterations[y * region.width + x] = RenderPixel(offset(x, y), skip, options, scratch[worker].data(), tileRebases);
+		rebases += tileRebases;
+		const size_t done = ++finished;
+		if (options.progress)
+		{
+			std::lock_guard<std::mutex> lock(progressLock);
+			options.progress(static_cast<double>(done) / static_cast<double>(tiles.size()));
+		}
+	});
+	m_stats.rebases = rebases;
+	return !cancelled;
+}
@@ -0,0 +1,89 @@
+#pragma once
+
+#include "double_double.h"
+#include "grid.h"
+#include <array>
+
+// Deep-zoom escape-time renderer for z <- f(z, c), z0 = 0. One reference orbit Z at the region centre C is
+// iterated in double-double (or double if the function has no Extended kernels), every pixel then only
+// iterates its difference d = z - Z in double:
+//   d' = f(Z + d, C + dc) - f(Z, C)
+// The recurrence is derived node by node from the parsed function using cancellation-free identities
+// (e.g. sin(R + d) - sin(R) = 2 cos(R + d/2) sin(d/2)), so no formula is special-cased. A truncated series
+// d = a1 dc + ... + aK dc^K, propagated through the same nodes, skips the iterations every pixel shares.
+// Pixels whose orbit drifts too close to zero are rebased onto the start of the reference orbit.
+// Only z0 = 0 is supported: the reference orbit and every pixel orbit start at zero.
+class PerturbationRenderer
+{
+public:
+	using Complex = std::complex<double>;
+
+	static constexpr size_t SeriesOrder = 4;
+	static constexpr size_t CSlot = FunctionParser::VariableSlot(-1);
+	static constexpr size_t ZSlot = FunctionParser::VariableSlot(0);
+
+	struct Options
+	{
+		size_t tileSize = 64;
+		size_t maxIter = 1024;
+		double bailout = 2;
+		// only used when every function in the input is holomorphic (not abs, pos, ang, re or im)
+		bool seriesApproximation = true;
+		// relative error the series may introduce, checked on its last term and against probe pixels
+		double seriesTolerance = 1e-10;
+		// called from worker threads, one call at a time, with the finished fraction
+		std::function<void(double)> progress;
+		const std::atomic<bool>* cancel = nullptr;
+	};
+
+	struct Stats
+	{
+		size_t referenceLength;
+		size_t skippedIterations;
+		size_t rebases;
+	};
+
+private:
+	using Series = std::array<Complex, SeriesOrder + 1>;
+
+	struct Tile
+	{
+		size_t x, y, width, height;
+	};
+
+	FunctionDag m_dag;
+	// exponent of every pow node with a small integer constant exponent, 0 for the other nodes
+	std::vector<int> m_intPowers;
+	bool m_holomorphic;
+	std::shared_ptr<const CompiledFunction<mth::DoubleDoubleComplex>> m_extended;
+	std::shared_ptr<const CompiledFunction<Complex>> m_double;
+	std::vector<Complex> m_variables;
+	WorkStealingPool& m_pool;
+	// Z0 .. ZL, the last one escaped or reached maxIter
+	std::vector<Complex> m_orbit;
+	// node values along the reference orbit, m_dag.Size() per step Zn -> Zn+1
+	std::vector<Complex> m_reference;
+	Complex m_center;
+	// delta series at every step it is still valid for, m_series[0] is zero
+	std::vector<Series> m_series;
+	Stats m_stats;
+
+	void ComputeReference(const mth::DoubleDoubleComplex& c, const Options& options);
+	Complex Delta(const size_t step, const Complex delta, const Complex dc, Complex* deltas) const;
+	Series SeriesStep(const size_t step, const Series& delta, Series* values) const;
+	size_t ComputeSeries(const double radius, const std::vector<Complex>& probes, const Options& options);
+	inline const Complex& Reference(const size_t step, const size_t node) const { return m_reference[step * m_dag.Size() + node]; }
+	size_t RenderPixel(const Complex dc, const size_t skip, const Options& options, Complex* deltas, size_t& rebases) const;
+
+public:
+	PerturbationRenderer(const FunctionParser& parser, WorkStealingPool& pool);
+
+	// values of the variables other than c and z, indexed by slot like EvalContext::Variables
+	inline Complex* Variables() { return m_variables.data(); }
+	inline size_t VariableCount() const { return m_variables.size(); }
+	inline bool HasExtendedReference() const { return static_cast<bool>(m_extended); }
+	inline const Stats& LastStats() const { return m_stats; }
+
+	// Same layout as GridRenderer::Render, c at each pixel centre. Returns false if cancelled.
+	bool Render(const GridRegion<mth::DoubleDouble>& region, const Options& options, size_t* iterations);
+};
@@ -0,0 +1,465 @@
+#pragma once
+
+#include "parser.h"
+
+// Compile-time front end: FUNCTION_SOURCE(Mandelbrot, "z*z+c") declares a source type,
+// StaticFunctionEvaluator<Mandelbrot, std::complex<double>> evaluates it with no runtime tree.
+// The grammar is FunctionParser's, $name parameters included, and they get the same slots.
+#define FUNCTION_SOURCE(name, text) \
+	struct name \
+	{ \
+		static constexpr const char* source = text; \
+		static constexpr auto program = StaticFunctionParser<sizeof(text)>(text).Result(); \
+	}
+
+struct StaticFunctionNode
+{
+	FunctionParser::FuncElem::Type type;
+	int index;
+	FunctionParser::Function::Name function;
+	FunctionParser::Operator::Name op;
+	double re, im;
+	size_t params[2];
+	// a Variable node for a $name; index is the parameter number until the parser moves it past the z's
+	bool parameter;
+};
+
+struct StaticFunctionParameter
+{
+	// of the '$' in the source, the name follows it
+	size_t offset;
+	size_t length;
+};
+
+template <size_t MaxNodes>
+struct StaticFunctionProgram
+{
+	StaticFunctionNode nodes[MaxNodes];
+	size_t count;
+	size_t root;
+	size_t slotCount;
+	// see FunctionParser::Parameters, in order of first appearance
+	StaticFunctionParameter parameters[MaxNodes];
+	size_t parameterCount;
+	size_t firstParameterSlot;
+	bool valid;
+	FuncParseExcept::ErrorType error;
+	size_t errorOffset;
+};
+
+template <size_t MaxNodes>
+class StaticFunctionParser
+{
+	const char* m_func;
+	size_t m_offset;
+	StaticFunctionProgram<MaxNodes> m_program;
+
+	static constexpr bool IsLetter(const char ch) { return (ch >= 'a' && ch <= 'z') || (ch >= 'A' && ch <= 'Z'); }
+	static constexpr bool IsDigit(const char ch) { return ch >= '0' && ch <= '9'; }
+	static constexpr bool IsNamePart(const char ch) { return IsLetter(ch) || IsDigit(ch) || '_' == ch; }
+	static constexpr bool IsSpace(const char ch) { return ' ' == ch || '\t' == ch || '\n' == ch || '\r' == ch || '\v' == ch || '\f' == ch; }
+
+	constexpr bool Fail(const FuncParseExcept::ErrorType error, const size_t where)
+	{
+		if (m_program.valid)
+		{
+			m_program.valid = false;
+			m_program.error = error;
+			m_program.errorOffset = where;
+		}
+		return false;
+	}
+	constexpr char Peek()
+	{
+		while (IsSpace(m_func[m_offset]))
+			m_offset++;
+		return m_func[m_offset];
+	}
+	constexpr size_t Add(const StaticFunctionNode& node)
+	{
+		if (m_program.count >= MaxNodes)
+		{
+			Fail(FuncParseExcept::UnknownError, m_offset);
+			return 0;
+		}
+		m_program.nodes[m_program.count] = node;
+		return m_program.count++;
+	}
+	constexpr size_t AddVariable(const int index)
+	{
+		StaticFunctionNode node = {};
+		node.type = FunctionParser::FuncElem::Type::Variable;
+		node.index = index;
+		if (FunctionParser::VariableSlot(index) + 1 > m_program.slotCount)
+			m_program.slotCount = FunctionParser::VariableSlot(index) + 1;
+		return Add(node);
+	}
+	constexpr size_t AddConstant(const double re, const double im)
+	{
+		StaticFunctionNode node = {};
+		node.type = FunctionParser::FuncElem::Type::Constant;
+		node.re = re;
+		node.im = im;
+		return Add(node);
+	}
+
+	constexpr bool NameEquals(const size_t start, const size_t length, const char* name) const
+	{
+		for (size_t i = 0; i < length; i++)
+			if (m_func[start + i] != name[i])
+				return false;
+		return name[length] == '\0';
+	}
+
+	constexpr size_t ScanParameter()
+	{
+		const size_t start = m_offset++;
+		while (IsNamePart(m_func[m_offset]))
+			m_offset++;
+		const size_t length = m_offset - start - 1;
+		if (!length)
+			return Fail(FuncParseExcept::UnexpectedSymbol, start);
+		size_t k = 0;
+		while (k < m_program.parameterCount && !SameName(m_program.parameters[k], start, length))
+			k++;
+		if (k == m_program.parameterCount)
+			m_program.parameters[m_program.parameterCount++] = { start, length };
+		StaticFunctionNode node = {};
+		node.type = FunctionParser::FuncElem::Type::Variable;
+		node.index = static_cast<int>(k);
+		node.parameter = true;
+		return Add(node);
+	}
+	constexpr bool SameName(const StaticFunctionParameter& parameter, const size_t start, const size_t length) const
+	{
+		if (parameter.length != length)
+			return false;
+		for (size_t i = 1; i <= length; i++)
+			if (m_func[parameter.offset + i] != m_func[start + i])
+				return false;
+		return true;
+	}
+	// parameter k becomes variable base + k, base being the first index after the highest z
+	constexpr void PlaceParameters()
+	{
+		const int base = FunctionParser::SlotVariable(m_program.slotCount);
+		m_program.firstParameterSlot = m_program.slotCount;
+		for (size_t k = 0; k < m_program.parameterCount; k++)
+			if (base + static_cast<int>(k) > FunctionParser::MaxVariableIndex)
+			{
+				Fail(FuncParseExcept::InvalidVariableIndex, m_program.parameters[k].offset);
+				return;
+			}
+		for (size_t i = 0; i < m_program.count; i++)
+			if (m_program.nodes[i].parameter)
+				m_program.nodes[i].index += base;
+		m_program.slotCount += m_program.parameterCount;
+	}
+
+	constexpr size_t ScanNumber()
+	{
+		const size_t first = m_offset;
+		bool negative = false, digitPresent = false;
+		double num = 0.0, fractionalDiv = 1.0;
+		if ('-' == m_func[m_offset])
+		{
+			negative = true;
+			m_offset++;
+		}
+		while (IsDigit(m_func[m_offset]))
+		{
+			num = 10.0 * num + static_cast<double>(m_func[m_offset++] - '0');
+			digitPresent = true;
+		}
+		if ('.' == m_func[m_offset])
+		{
+			while (IsDigit(m_func[++m_offset]))
+			{
+				num = 10.0 * num + static_cast<double>(m_func[m_offset] - '0');
+				fractionalDiv *= 10.0;
+				digitPresent = true;
+			}
+		}
+		if (!digitPresent)
+			return Fail(FuncParseExcept::UnexpectedSymbol, first);
+		num /= fractionalDiv;
+		return AddConstant(negative ? -num : num, 0.0);
+	}
+
+	constexpr size_t ScanEvaluated()
+	{
+		const char ch = Peek();
+		if ('(' == ch)
+		{
+			const size_t open = m_offset++;
+			const size_t inner = ScanLevel(0);
+			if (m_program.valid && '\0' == Peek())
+				return Fail(FuncParseExcept::OpenBraces, open);
+			if (m_program.valid && ')' != Peek())
+				return Fail(FuncParseExcept::OperatorExpected, m_offset);
+			if (!m_program.valid)
+				return 0;
+			m_offset++;
+			return inner;
+		}
+		if (IsLetter(ch))
+		{
+			const size_t start = m_offset;
+			while (IsNamePart(m_func[m_offset]))
+				m_offset++;
+			const size_t length = m_offset - start;
+			if ('(' == Peek())
+			{
+				for (size_t i = 0; i < FunctionParser::Function::NameCount; i++)
+				{
+					if (NameEquals(start, length, FunctionParser::Function::Names[i]))
+					{
+						StaticFunctionNode node = {};
+						node.type = FunctionParser::FuncElem::Type::Function;
+						node.function = static_cast<FunctionParser::Function::Name>(i);
+						node.params[0] = ScanEvaluated();
+						return Add(node);
+					}
+				}
+				return Fail(FuncParseExcept::UnknownSymbol, start);
+			}
+			if (NameEquals(start, length, "i"))
+				return AddConstant(0.0, 1.0);
+			if (NameEquals(start, length, "c"))
+				return AddVariable(-1);
+			if ('z' == m_func[start])
+			{
+				if ((length > 1 && '0' == m_func[start + 1]) || length > 10)
+					return Fail(FuncParseExcept::UnexpectedSymbol, start);
+				int index = 0;
+				for (size_t i = 1; i < length; i++)
+				{
+					if (!IsDigit(m_func[start + i]))
+						return Fail(FuncParseExcept::UnexpectedSymbol, start);
+					index = index * 10 + (m_func[start + i] - '0');
+				}
+				if (index > FunctionParser::MaxVariableIndex)
+					return Fail(FuncParseExcept::InvalidVariableIndex, start);
+				return AddVariable(index);
+			}
+			return Fail(FuncParseExcept::UnexpectedSymbol, start);
+		}
+		if ('$' == ch)
+			return ScanParameter();
+		if (IsDigit(ch) || '.' == ch || '-' == ch)
+			return ScanNumber();
+		if ('\0' == ch || ')' == ch)
+			return Fail(FuncParseExcept::EmptyFunction, m_offset);
+		return Fail(FuncParseExcept::UnknownSymbol, m_offset);
+	}
+
+	constexpr size_t ScanLevel(const int precedence)
+	{
+		if (precedence > 2)
+			return ScanEvaluated();
+		size_t lhs = ScanLevel(precedence + 1);
+		FunctionParser::Operator::Name name = FunctionParser::Operator::Name::add;
+		int opPrecedence = 0;
+		while (m_program.valid && FunctionParser::Operator::FromSymbol(Peek(), name, opPrecedence) && opPrecedence == precedence)
+		{
+			const size_t opOffset = m_offset++;
+			if ('\0' == Peek() || ')' == Peek())
+				return Fail(FuncParseExcept::DanglingOperator, opOffset);
+			StaticFunctionNode node = {};
+			node.type = FunctionParser::FuncElem::Type::Operator;
+			node.op = name;
+			node.params[0] = lhs;
+			node.params[1] = ScanLevel(FunctionParser::Operator::RightAssociative(name) ? precedence : precedence + 1);
+			lhs = Add(node);
+		}
+		return lhs;
+	}
+
+public:
+	constexpr StaticFunctionParser(const char* const function) :
+		m_func(function),
+		m_offset(0),
+		m_program()
+	{
+		m_program.valid = true;
+		m_program.error = FuncParseExcept::UnknownError;
+		m_program.slotCount = FunctionParser::VariableSlot(0) + 1;
+		if ('\0' == Peek())
+		{
+			Fail(FuncParseExcept::NoInput, 0);
+			return;
+		}
+		m_program.root = ScanLevel(0);
+		if (m_program.valid && '\0' != Peek())
+			Fail(FuncParseExcept::OperatorExpected, m_offset);
+		if (m_program.valid)
+			PlaceParameters();
+	}
+
+	constexpr StaticFunctionProgram<MaxNodes> Result() const { return m_program; }
+};
+
+template <typename Source, size_t Id>
+struct StaticFunctionExpr
+{
+	static constexpr StaticFunctionNode node = Source::program.nodes[Id];
+
+	template <typename T, int N>
+	static inline T IntPower(const T& base)
+	{
+		if constexpr (N < 0)
+			return T(1) / IntPower<T, -N>(base);
+		else if constexpr (N == 1)
+			return base;
+		else if constexpr (N % 2 == 0)
+		{
+			const T half = IntPower<T, N / 2>(base);
+			return half * half;
+		}
+		else
+			return base * IntPower<T, N - 1>(base);
+	}
+
+	static constexpr bool IsSmallIntPower()
+	{
+		if (FunctionParser::FuncElem::Type::Operator != node.type || FunctionParser::Operator::Name::pow != node.op)
+			return false;
+		const StaticFunctionNode& e = Source::program.nodes[node.params[1]];
+		return FunctionParser::FuncElem::Type::Constant == e.type && e.im == 0.0 && e.re != 0.0 &&
+			e.re >= -FunctionParser::MaxIntPower && e.re <= FunctionParser::MaxIntPower && e.re == static_cast<double>(static_cast<int>(e.re));
+	}
+
+	template <typename T>
+	static inline T Eval(const T* variables)
+	{
+		using Traits = mth::NumberTraits<T>;
+		using Type = FunctionParser::FuncElem::Type;
+		if constexpr (Type::Constant == node.type)
+			return Traits::FromComplex(std::complex<double>(node.re, node.im));
+		else if constexpr (Type::Variable == node.type)
+			return variables[FunctionParser::VariableSlot(node.index)];
+		else if constexpr (Type::Function == node.type)
+		{
+			using Name = FunctionParser::Function::Name;
+			const T p = StaticFunctionExpr<Source, node.params[0]>::Eval(variables);
+			if constexpr (Name::sin == node.function) return std::sin(p);
+			else if constexpr (Name::cos == node.function) return std::cos(p);
+			else if constexpr (Name::tan == node.function) return std::tan(p);
+			else if constexpr (Name::sinh == node.function) return std::sinh(p);
+			else if constexpr (Name::cosh == node.function) return std::cosh(p);
+			else if constexpr (Name::tanh == node.function) return std::tanh(p);
+			else if constexpr (Name::exp == node.function) return std::exp(p);
+			else if constexpr (Name::log == node.function) return std::log(p);
+			else if constexpr (Name::abs == node.function) return std::abs(p);
+			else if constexpr (Name::pos == node.function) return mth::pos(p);
+			else if constexpr (Name::ang == node.function) return mth::ang(p);
+			else if constexpr (Name::re == node.function) return mth::re(p);
+			else return mth::im(p);
+		}
+		else if constexpr (IsSmallIntPower())
+			return IntPower<T, static_cast<int>(Source::program.nodes[node.params[1]].re)>(StaticFunctionExpr<Source, node.params[0]>::Eval(variables));
+		else
+		{
+			using Name = FunctionParser::Operator::Name;
+			const T lhs = StaticFunctionExpr<Source, node.params[0]>::Eval(variables);
+			const T rhs = StaticFunctionExpr<Source, node.params[1]>::Eval(variables);
+			if constexpr (Name::add == node.op) return lhs + rhs;
+			else if constexpr (Name::sub == node.op) return lhs - rhs;
+			else if constexpr (Name::mul == node.op) return lhs * rhs;
+			else if constexpr (Name::div == node.op) return lhs / rhs;
+			else return std::pow(lhs, rhs);
+		}
+	}
+};
+
+template <typename Source, typename NumberType>
+class StaticFunctionEvaluator
+{
+	static_assert(Source::program.valid, "FUNCTION_SOURCE does not contain a valid function");
+
+	using Traits = mth::NumberTraits<NumberType>;
+	using Scalar = typename Traits::Scalar;
+	using Root = StaticFunctionExpr<Source, Source::program.root>;
+
+public:
+	static constexpr size_t SlotCount = Source::program.slotCount;
+	static constexpr size_t CSlot = FunctionParser::VariableSlot(-1);
+	static constexpr size_t ZSlot = FunctionParser::VariableSlot(0);
+	static constexpr size_t ParameterCount = Source::program.parameterCount;
+	static constexpr size_t FirstParameterSlot = Source::program.firstParameterSlot;
+
+	static constexpr std::string_view ParameterName(const size_t k)
+	{
+		return std::string_view(Source::source + Source::program.parameters[k].offset + 1, Source::program.parameters[k].length);
+	}
+	// FunctionParser::NoParameter if there is no parameter of that name
+	static constexpr size_t ParameterSlot(const std::string_view name)
+	{
+		for (size_t k = 0; k < ParameterCount; k++)
+			if (ParameterName(k) == name)
+				return FirstParameterSlot + k;
+		return FunctionParser::NoParameter;
+	}
+
+private:
+	NumberType m_variables[SlotCount];
+
+public:
+	StaticFunctionEvaluator() : m_variables() {}
+
+	NumberType operator()() const { return Root::Eval(m_variables); }
+	// inputs[slot] holds count values of that variable slot, unused slots may be null
+	void Evaluate(const NumberType* const* inputs, NumberType* output, const size_t count)
+	{
+		NumberType variables[SlotCount];
+		std::copy(m_variables, m_variables + SlotCount, variables);
+		for (size_t i = 0; i < count; i++)
+		{
+			for (size_t k = 0; k < SlotCount; k++)
+				if (inputs[k])
+					variables[k] = inputs[k][i];
+			output[i] = Root::Eval(variables);
+		}
+	}
+	size_t Iterate(const NumberType& c, const NumberType& z0, const size_t maxIter, const Scalar bailout, NumberType* zOut = nullptr)
+	{
+		const Scalar limit = bailout * bailout;
+		NumberType variables[SlotCount];
+		std::copy(m_variables, m_variables + SlotCount, variables);
+		variables[CSlot] = c;
+		NumberType z = z0;
+		size_t n = 0;
+		for (; n < maxIter && Traits::Real(z) * Traits::Real(z) + Traits::Imag(z) * Traits::Imag(z) <= limit; n++)
+		{
+			variables[ZSlot] = z;
+			z = Root::Eval(variables);
+		}
+		if (zOut)
+			*zOut = z;
+		return n;
+	}
+	void Iterate(const NumberType* c, const NumberType* z0, const size_t count, const size_t maxIter, const Scalar bailout,
+		size_t* iterations, NumberType* zOut = nullptr)
+	{
+		for (size_t i = 0; i < count; i++)
+			iterations[i] = Iterate(c[i], z0 ? z0[i] : NumberType(), maxIter, bailout, zOut ? zOut + i : nullptr);
+	}
+
+	inline NumberType* Variables() { return m_variables; }
+	inline const NumberType* Variables() const { return m_variables; }
+	inline size_t VariableCount() const { return SlotCount; }
+	inline NumberType& VariableValue(const int index) { return m_variables[FunctionParser::VariableSlot(index)]; }
+	// False if the function has no parameter of that name
+	bool SetParameter(const std::string_view name, const NumberType& value)
+	{
+		const size_t slot = ParameterSlot(name);
+		if (FunctionParser::NoParameter == slot)
+			return false;
+		m_variables[slot] = value;
+		return true;
+	}
+	void SetVariables(const NumberType* values, const size_t count)
+	{
+		std::copy(values, values + std::min(count, SlotCount), m_variables);
+	}
+};
@@ -0,0 +1,997 @@
+#include "parser.h"
+#include "grid.h"
+#include "function_archive.h"
+#include "static_function.h"
+#include "perturbation.h"
+#include "gpu_renderer.h"
+#include "mixed_precision.h"
+#include "function_cache.h"
+#include "function_stream.h"
+#include "incremental.h"
+#include "dual.h"
+#include "vector_math.h"
+#include <cstdio>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+
+// tests, registered with ctest; prints every failed check and returns nonzero if there was one
+
+using Complex = std::complex<double>;
+using Backend = CompiledFunction<Complex>::Backend;
+
+static int g_failures = 0;
+static size_t g_allocations = 0;
+
+void* operator new(const size_t size)
+{
+	g_allocations++;
+	if (void* const p = std::malloc(size ? size : 1))
+		return p;
+	throw std::bad_alloc();
+}
+// GCC flags the free once it inlines these next to a new expression
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+void operator delete(void* const p) noexcept { std::free(p); }
+void operator delete(void* const p, size_t) noexcept { std::free(p); }
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic pop
+#endif
+
+#define CHECK(condition) \
+	do { if (!(condition)) { g_failures++; std::printf("%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #condition); } } while (false)
+
+static const char* const s_Expressions[] = {
+	"z*z+c",
+	"z/c",
+	"(z-c)/(z+c)+1/z",
+	"z^3-2*z^2+c",
+	"sin(z)*cos(c)-exp(z/4)",
+	"log(z*c)+tanh(z)",
+	"abs(z)+pos(c)*ang(z)-re(z)*im(c)",
+	"z^c+sinh(c/z)",
+};
+
+static const Complex s_Inputs[][2] = {
+	{ Complex(0.5, 0.25), Complex(-0.75, 0.1) },
+	{ Complex(-1.5, 2.0), Complex(0.3, -0.7) },
+	{ Complex(3.0, 0.0), Complex(-2.0, 0.0) },
+	{ Complex(1e-3, -4.0), Complex(7.0, 1e-5) },
+	// br * br + bi * bi overflows, a scaled division does not
+	{ Complex(1e200, 1e200), Complex(1e200, 1e200) },
+	{ Complex(1e-200, 3e-200), Complex(-2e-200, 1e-200) },
+};
+
+static bool Close(const double a, const double b)
+{
+	if (std::isnan(a) || std::isnan(b))
+		return std::isnan(a) && std::isnan(b);
+	if (std::isinf(a) || std::isinf(b))
+		return a == b;
+	return std::abs(a - b) <= 1e-12 * std::max({ 1.0, std::abs(a), std::abs(b) });
+}
+static bool Close(const Complex& a, const Complex& b)
+{
+	return Close(a.real(), b.real()) && Close(a.imag(), b.imag());
+}
+
+static Complex Evaluate(const FunctionParser& parser, const Backend backend, const Complex& z, const Complex& c)
+{
+	FunctionEvaluator<Complex> eval(parser, backend);
+	eval.Variables()[EvalContext<Complex>::ZSlot] = z;
+	eval.Variables()[EvalContext<Complex>::CSlot] = c;
+	return eval();
+}
+
+// every backend against the tree, which evaluates with std::complex
+static void TestBackends()
+{
+	for (const char* const expression : s_Expressions)
+	{
+		FunctionParser parser(expression);
+		for (const Complex* const input : s_Inputs)
+		{
+			const Complex expected = Evaluate(parser, Backend::Tree, input[0], input[1]);
+			for (const Backend backend : { Backend::Bytecode, Backend::Jit })
+			{
+				const Complex value = Evaluate(parser, backend, input[0], input[1]);
+				if (!Close(value, expected))
+					std::printf("%s, backend %d: (%g,%g), tree (%g,%g)\n", expression, static_cast<int>(backend),
+						value.real(), value.imag(), expected.real(), expected.imag());
+				CHECK(Close(value, expected));
+			}
+		}
+	}
+}
+
+// Evaluate(inputs, output, count) gives what operator() gives for each point, on every backend, up to the
+// last bits the vector math kernels may lose (Close allows far more than their few ulp)
+static void TestBatch()
+{
+	const size_t count = std::size(s_Inputs);
+	std::vector<Complex> z(count), c(count);
+	for (size_t i = 0; i < count; i++)
+	{
+		z[i] = s_Inputs[i][0];
+		c[i] = s_Inputs[i][1];
+	}
+	for (const char* const expression : s_Expressions)
+	{
+		FunctionParser parser(expression);
+		for (const Backend backend : { Backend::Tree, Backend::Bytecode, Backend::Jit })
+		{
+			FunctionEvaluator<Complex> eval(parser, backend);
+			std::vector<const Complex*> inputs(eval.VariableCount(), nullptr);
+			inputs[EvalContext<Complex>::ZSlot] = z.data();
+			inputs[EvalContext<Complex>::CSlot] = c.data();
+			std::vector<Complex> output(count);
+			eval.Evaluate(inputs.data(), output.data(), count);
+			for (size_t i = 0; i < count; i++)
+				CHECK(Close(output[i], Evaluate(parser, backend, z[i], c[i])));
+		}
+	}
+}
+
+// error of a kernel result in units of the last place of the exact value
+static double Ulps(const double value, const long double exact)
+{
+	const double rounded = static_cast<double>(exact);
+	const double ulp = std::nextafter(std::abs(rounded), HUGE_VAL) - std::abs(rounded);
+	return static_cast<double>(std::abs(static_cast<long double>(value) - exact) / ulp);
+}
+
+// same value or both NaN, bit for bit otherwise so a lost sign of zero shows
+static bool Same(const double a, const double b)
+{
+	return std::isnan(a) ? std::isnan(b) : std::memcmp(&a, &b, sizeof(a)) == 0;
+}
+
+// the vector_math.h kernels against long double within the bounds documented there, and lanes outside
+// the fast ranges exactly like std::
+static void TestVectorMath()
+{
+	using namespace mth::simd;
+	constexpr size_t Sweeps = 2000;
+	std::uint64_t seed = 0x9e3779b97f4a7c15ULL;
+	const auto uniform = [&seed](const double low, const double high)
+	{
+		seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+		return low + (high - low) * static_cast<double>(seed >> 11) * 0x1.0p-53;
+	};
+	double worst[9] = {};
+	double x[Chunk], y[Chunk], a[Chunk], b[Chunk], t[Chunk];
+	for (size_t sweep = 0; sweep < Sweeps; sweep++)
+	{
+		for (size_t j = 0; j < Chunk; j++)
+		{
+			// alternate small and large arguments so the reductions and the polynomials both get exercised
+			x[j] = j & 1 ? uniform(-708.0, 708.0) : uniform(-4.0, 4.0);
+			y[j] = uniform(-4.0, 4.0);
+		}
+		Exp(x, a, Chunk);
+		Expm1(x, b, Chunk);
+		for (size_t j = 0; j < Chunk; j++)
+		{
+			worst[0] = std::max(worst[0], Ulps(a[j], std::exp(static_cast<long double>(x[j]))));
+			worst[1] = std::max(worst[1], Ulps(b[j], std::expm1(static_cast<long double>(x[j]))));
+		}
+		SinhCosh(x, a, b, Chunk);
+		Tanh(y, t, Chunk);
+		for (size_t j = 0; j < Chunk; j++)
+		{
+			worst[2] = std::max(worst[2], Ulps(a[j], std::sinh(static_cast<long double>(x[j]))));
+			worst[3] = std::max(worst[3], Ulps(b[j], std::cosh(static_cast<long double>(x[j]))));
+			worst[4] = std::max(worst[4], Ulps(t[j], std::tanh(static_cast<long double>(y[j]))));
+		}
+		for (size_t j = 0; j < Chunk; j++)
+			x[j] = j & 1 ? uniform(-524288.0, 524288.0) : uniform(-8.0, 8.0);
+		SinCos(x, a, b, Chunk);
+		for (size_t j = 0; j < Chunk; j++)
+		{
+			worst[5] = std::max(worst[5], Ulps(a[j], std::sin(static_cast<long double>(x[j]))));
+			worst[5] = std::max(worst[5], Ulps(b[j], std::cos(static_cast<long double>(x[j]))));
+			t[j] = x[j];
+		}
+		ApplyReal(Function::Tan, t, Chunk);
+		Atan2(y, x, a, Chunk);
+		for (size_t j = 0; j < Chunk; j++)
+		{
+			worst[6] = std::max(worst[6], Ulps(t[j], std::tan(static_cast<long double>(x[j]))));
+			worst[7] = std::max(worst[7], Ulps(a[j], std::atan2(static_cast<long double>(y[j]), static_cast<long double>(x[j]))));
+			// the whole normal range, by exponent
+			x[j] = std::ldexp(uniform(1.0, 2.0), static_cast<int>(uniform(-1022.0, 1024.0)));
+		}
+		Log(x, a, Chunk);
+		for (size_t j = 0; j < Chunk; j++)
+			worst[8] = std::max(worst[8], Ulps(a[j], std::log(static_cast<long double>(x[j]))));
+	}
+	CHECK(worst[0] <= 1.0);
+	CHECK(worst[1] <= 2.0);
+	CHECK(worst[2] <= 2.2);
+	CHECK(worst[3] <= 1.5);
+	CHECK(worst[4] <= 2.5);
+	CHECK(worst[5] <= 1.2);
+	CHECK(worst[6] <= 2.4);
+	CHECK(worst[7] <= 2.6);
+	CHECK(worst[8] <= 1.0);
+
+	const double inf = HUGE_VAL, nan = std::nan("");
+	const double outside[] = { 709.5, -745.0, 1e300, -inf, inf, nan, 0.0, -0.0, 1e-310, -1.0, 1e6, -3e9, 1e300 };
+	const size_t n = std::size(outside);
+	double s[std::size(outside)], c[std::size(outside)];
+	Exp(outside, a, n);
+	Expm1(outside, b, n);
+	for (size_t j = 0; j < n; j++)
+	{
+		if (!(std::abs(outside[j]) <= 708.0))
+		{
+			CHECK(Same(a[j], std::exp(outside[j])));
+			CHECK(Same(b[j], std::expm1(outside[j])));
+		}
+	}
+	SinhCosh(outside, a, b, n);
+	for (size_t j = 0; j < n; j++)
+	{
+		if (!(std::abs(outside[j]) <= 708.0))
+		{
+			CHECK(Same(a[j], std::sinh(outside[j])));
+			CHECK(Same(b[j], std::cosh(outside[j])));
+		}
+	}
+	SinCos(outside, s, c, n);
+	for (size_t j = 0; j < n; j++)
+	{
+		if (!(std::abs(outside[j]) <= 524288.0))
+		{
+			CHECK(Same(s[j], std::sin(outside[j])));
+			CHECK(Same(c[j], std::cos(outside[j])));
+		}
+	}
+	Log(outside, a, n);
+	for (size_t j = 0; j < n; j++)
+		if (!(outside[j] >= 2.2250738585072014e-308) || std::isinf(outside[j]))
+			CHECK(Same(a[j], std::log(outside[j])));
+	Atan2(outside, outside + 1, a, n - 1);
+	for (size_t j = 0; j + 1 < n; j++)
+	{
+		const double big = std::max(std::abs(outside[j]), std::abs(outside[j + 1]));
+		if (!(big >= 2.2250738585072014e-308 && big <= 1.7976931348623157e+308))
+			CHECK(Same(a[j], std::atan2(outside[j], outside[j + 1])));
+	}
+	Tanh(outside, a, n);
+	for (size_t j = 0; j < n; j++)
+		if (std::isnan(outside[j]) || std::abs(outside[j]) >= 20.0)
+			CHECK(Same(a[j], std::tanh(outside[j])));
+}
+
+// a function loaded from its FunctionImage evaluates like the one it was written from
+static void TestImageRoundTrip()
+{
+	for (const char* const expression : s_Expressions)
+	{
+		FunctionParser parser(expression);
+		const CompiledFunction<Complex> original(parser);
+		const std::shared_ptr<const std::vector<unsigned char>> image = std::make_shared<const std::vector<unsigned char>>(original.Serialize());
+		for (const Backend backend : { Backend::Bytecode, Backend::Jit })
+		{
+			EvalContext<Complex> eval(std::make_shared<const CompiledFunction<Complex>>(image->data(), image->size(), image, backend));
+			for (const Complex* const input : s_Inputs)
+			{
+				eval.Variables()[EvalContext<Complex>::ZSlot] = input[0];
+				eval.Variables()[EvalContext<Complex>::CSlot] = input[1];
+				CHECK(Close(eval(), Evaluate(parser, Backend::Bytecode, input[0], input[1])));
+			}
+		}
+	}
+	bool rejected = false;
+	try
+	{
+		const unsigned char garbage[64] = {};
+		CompiledFunction<Complex> function(garbage, sizeof(garbage), nullptr);
+	}
+	catch (const FuncParseExcept& ex)
+	{
+		rejected = FuncParseExcept::InvalidImage == ex.Error();
+	}
+	CHECK(rejected);
+}
+
+// a throwing task fails the run on the calling thread and leaves the pool usable
+static void TestPoolException()
+{
+	WorkStealingPool pool(4);
+	bool thrown = false;
+	try
+	{
+		pool.Run(100, [](const size_t index, size_t) { if (3 == index) throw std::runtime_error("task"); });
+	}
+	catch (const std::runtime_error&)
+	{
+		thrown = true;
+	}
+	CHECK(thrown);
+	std::atomic<size_t> count(0);
+	pool.Run(100, [&](size_t, size_t) { count++; });
+	CHECK(100 == count);
+}
+
+// the OpenCL renderer counts like GridRenderer; skipped without a device, only the kernel source is checked
+static void TestGpuRenderer()
+{
+	const FunctionParser quadratic("z*z+c");
+	CHECK(std::string::npos != GpuRenderer::KernelSource(quadratic, GpuRenderer::Precision::Double).find("__kernel void iterate("));
+	bool rejected = false;
+	try
+	{
+		GpuRenderer::KernelSource(FunctionParser("sin(z)+c"), GpuRenderer::Precision::Extended);
+	}
+	catch (const FuncParseExcept& ex)
+	{
+		rejected = FuncParseExcept::UnsupportedPrecision == ex.Error();
+	}
+	CHECK(rejected);
+	if (!GpuRenderer::Available())
+	{
+		std::printf("TestGpuRenderer: no OpenCL device, skipped\n");
+		return;
+	}
+
+	const GridRegion<double> region = { -2.0, -1.25, 0.75, 1.25, 48, 40 };
+	const size_t pixels = region.width * region.height;
+	WorkStealingPool pool(2);
+	GridRenderer<Complex> reference(std::make_shared<const CompiledFunction<Complex>>(quadratic), pool);
+	GridRenderer<Complex>::Options referenceOptions;
+	referenceOptions.maxIter = 200;
+	std::vector<size_t> expected(pixels);
+	reference.Render(region, referenceOptions, expected.data());
+
+	GpuRenderer renderer(quadratic);
+	GpuRenderer::Options options;
+	options.bandHeight = 16;
+	options.maxIter = referenceOptions.maxIter;
+	options.minimum = std::min(GpuRenderer::Precision::Double, renderer.SupportedPrecision());
+	options.maximum = options.minimum;
+	const GridRegion<mth::DoubleDouble> deviceRegion = { region.minRe, region.minIm, region.maxRe, region.maxIm, region.width, region.height };
+	std::vector<size_t> iterations(pixels);
+	GpuRenderer::Precision used = GpuRenderer::Precision::Extended;
+	CHECK(renderer.Render(deviceRegion, options, iterations.data(), &used));
+	CHECK(options.minimum == used);
+	// pixel centres are computed differently and drivers may contract into fma, so a few boundary pixels
+	// can escape a step apart; float gets more slack
+	size_t differing = 0;
+	for (size_t i = 0; i < pixels; i++)
+		differing += iterations[i] != expected[i];
+	CHECK(differing * (GpuRenderer::Precision::Single == used ? 20 : 100) <= pixels);
+}
+
+// archive entries load back and evaluate like the original, indices past Count() throw
+static void TestArchive()
+{
+	FunctionArchive::Writer writer;
+	for (const char* const expression : s_Expressions)
+		writer.Add(expression, CompiledFunction<Complex>(FunctionParser(expression)));
+	const std::shared_ptr<const FunctionArchive> archive = FunctionArchive::FromBuffer(writer.Build());
+	CHECK(std::size(s_Expressions) == archive->Count());
+	for (size_t i = 0; i < archive->Count(); i++)
+	{
+		CHECK(archive->Name(i) == s_Expressions[i]);
+		CHECK(archive->Find(s_Expressions[i]) == i);
+		EvalContext<Complex> eval(archive->Load<Complex>(i));
+		eval.Variables()[EvalContext<Complex>::ZSlot] = s_Inputs[0][0];
+		eval.Variables()[EvalContext<Complex>::CSlot] = s_Inputs[0][1];
+		CHECK(Close(eval(), Evaluate(FunctionParser(s_Expressions[i]), Backend::Tree, s_Inputs[0][0], s_Inputs[0][1])));
+	}
+	for (int load = 0; load < 2; load++)
+	{
+		FuncParseExcept::ErrorType error = FuncParseExcept::UnknownError;
+		try
+		{
+			if (load)
+				archive->Load<Complex>(archive->Count());
+			else
+				archive->Name(archive->Count());
+		}
+		catch (const FuncParseExcept& ex)
+		{
+			error = ex.Error();
+		}
+		CHECK(FuncParseExcept::IndexOutOfRange == error);
+	}
+}
+
+// the default optimizer does not change a single bit of the result, integer powers aside
+static void TestOptimizerExact()
+{
+	const char* const expressions[] = { "z-c-z+c", "(z+0.1)+0.2", "(z*0.1)*3", "z/3", "z/0.25*2", "1/(c/10)+z*z",
+		"z+0", "0+z", "z-0", "z+-0", "z-(-0)", "z*1", "z/1", "z/2" };
+	const Complex zeros[][2] = { { Complex(-0.0, -2.0), Complex(-0.0, -0.0) }, { Complex(-0.0, 2.0), Complex(1.0, -0.0) } };
+	for (const char* const expression : expressions)
+	{
+		FunctionParser plain;
+		plain.EnableOptimization(false);
+		plain.Parse(expression);
+		FunctionParser optimized(expression);
+		const auto check = [&](const Complex* const input)
+		{
+			const Complex expected = Evaluate(plain, Backend::Tree, input[0], input[1]);
+			const Complex value = Evaluate(optimized, Backend::Tree, input[0], input[1]);
+			if (std::memcmp(&value, &expected, sizeof(value)))
+				std::printf("%s differs at z = (%g,%g)\n", expression, input[0].real(), input[0].imag());
+			CHECK(std::memcmp(&value, &expected, sizeof(value)) == 0);
+		};
+		for (const Complex* const input : s_Inputs)
+			check(input);
+		for (const Complex* const input : zeros)
+			check(input);
+	}
+	FunctionParser reassociated;
+	reassociated.EnableReassociation(true);
+	reassociated.Parse("(z+1)+2");
+	CHECK(FunctionParser::FuncElem::Type::Operator == reassociated.PseudoCode()->type &&
+		FunctionParser::FuncElem::Type::Variable == static_cast<FunctionParser::Operator*>(reassociated.PseudoCode())->params[0]->type);
+}
+
+static std::vector<FunctionParser::Diagnostic> TryParse(FunctionParser& parser, const char* const function)
+{
+	FunctionParser::Diagnostic diagnostics[8];
+	const size_t count = parser.TryParse(function, diagnostics, std::size(diagnostics));
+	return std::vector<FunctionParser::Diagnostic>(diagnostics, diagnostics + std::min(count, std::size(diagnostics)));
+}
+
+// several diagnostics from one pass, the first one equal to what Parse throws
+static void TestDiagnostics()
+{
+	using E = FuncParseExcept;
+	FunctionParser parser;
+	CHECK(TryParse(parser, "z*z+c").empty() && parser.PseudoCode());
+	const std::vector<FunctionParser::Diagnostic> found = TryParse(parser, "foo(z)+)");
+	CHECK(3 == found.size() && !parser.PseudoCode());
+	CHECK(E::UnknownSymbol == found[0].error && 0 == found[0].offset);
+	CHECK(E::DanglingOperator == found[1].error && 6 == found[1].offset);
+	CHECK(E::OperatorExpected == found[2].error && 7 == found[2].offset);
+	CHECK(2 == TryParse(parser, "1 2 3").size());
+	CHECK(3 == TryParse(parser, "z*z+c)))").size());
+	CHECK(1 == TryParse(parser, "").size() && E::NoInput == TryParse(parser, "")[0].error);
+	CHECK(E::InvalidVariableIndex == TryParse(parser, "z99999")[0].error);
+
+	char message[FuncParseExcept::MaxMessageLength];
+	found[0].Format(message, sizeof(message));
+	CHECK(std::string_view(message) == "Unknown symbol at position 1");
+	for (const char* const function : { "sin(", "(z+", "z+*3", "$", "q + w + (" })
+	{
+		const std::vector<FunctionParser::Diagnostic> diagnostics = TryParse(parser, function);
+		CHECK(!diagnostics.empty());
+		try
+		{
+			parser.Parse(function);
+			CHECK(false);
+		}
+		catch (const FuncParseExcept& ex)
+		{
+			CHECK(!diagnostics.empty() && ex.Error() == diagnostics[0].error && ex.Offset() == diagnostics[0].offset);
+		}
+	}
+}
+
+// once a parser has seen its inputs, failing TryParse calls do not allocate, $name parameters included
+static void TestTryParseAllocations()
+{
+	const char* const inputs[] = { "$a_long_parameter_name*z200+$b+", "$first + $second * z17 ) + foo(c)", "z+$", "sin(z" };
+	FunctionParser parser;
+	FunctionParser::Diagnostic diagnostics[4];
+	for (const char* const input : inputs)
+		parser.TryParse(input, diagnostics, std::size(diagnostics));
+	const size_t before = g_allocations;
+	size_t failed = 0;
+	for (int round = 0; round < 100; round++)
+		for (const char* const input : inputs)
+			failed += parser.TryParse(input, diagnostics, std::size(diagnostics)) ? 1 : 0;
+	CHECK(g_allocations == before);
+	CHECK(100 * std::size(inputs) == failed);
+}
+
+FUNCTION_SOURCE(StaticParameters, "$a*z2^2+$b/c-$a");
+FUNCTION_SOURCE(StaticBadParameter, "z+$");
+
+// the constexpr front end gives $parameters the slots FunctionParser gives them
+static void TestStaticParameters()
+{
+	using Static = StaticFunctionEvaluator<StaticParameters, Complex>;
+	static_assert(2 == Static::ParameterCount);
+	static_assert(Static::ParameterName(1) == "b");
+	static_assert(!StaticBadParameter::program.valid && FuncParseExcept::UnexpectedSymbol == StaticBadParameter::program.error);
+
+	FunctionParser parser(StaticParameters::source);
+	CHECK(parser.FirstParameterSlot() == Static::FirstParameterSlot);
+	CHECK(parser.ParameterSlot("a") == Static::ParameterSlot("a"));
+	CHECK(parser.ParameterSlot("b") == Static::ParameterSlot("b"));
+	CHECK(FunctionParser::NoParameter == Static::ParameterSlot("x"));
+
+	Static staticEval;
+	FunctionEvaluator<Complex> eval(parser);
+	CHECK(Static::SlotCount == eval.VariableCount());
+	for (size_t slot = 0; slot < Static::SlotCount; slot++)
+		staticEval.Variables()[slot] = eval.Variables()[slot] = Complex(0.25 * static_cast<double>(slot + 1), -0.5);
+	CHECK(staticEval.SetParameter("b", Complex(3.0, 1.0)) && eval.SetParameter("b", Complex(3.0, 1.0)));
+	CHECK(Close(staticEval(), eval()));
+}
+
+static std::unique_ptr<FunctionParser> Unoptimized(const char* const function)
+{
+	std::unique_ptr<FunctionParser> parser = std::make_unique<FunctionParser>();
+	parser->EnableOptimization(false);
+	parser->Parse(function);
+	return parser;
+}
+
+// patching z^2+c to z^3+c must not keep the quadratic-map shortcut of the old function
+static void TestPatchQuadraticMap()
+{
+	CompiledFunction<Complex> function(*Unoptimized("z^2+c"));
+	CHECK(function.IsQuadraticMap());
+	CHECK(!function.PatchConstants(*Unoptimized("z^3+c")));
+	CHECK(function.IsQuadraticMap());
+
+	// c = -0.9 is in the period-2 bulb of z^2+c but escapes from z^3+c
+	EvalContext<Complex> eval(std::make_shared<const CompiledFunction<Complex>>(*Unoptimized("z^3+c")));
+	EvalContext<Complex>::InteriorChecks checks;
+	checks.bulbs = true;
+	eval.SetInteriorChecks(checks);
+	CHECK(eval.Iterate(Complex(-0.9, 0.0), Complex(), 1000, 2.0) < 1000);
+}
+
+// Interior checks stop z*z+c orbits early but agree with plain iteration on every count: the cardioid,
+// the period-2 bulb and the rabbit (period 3) never escape, the others do after a while
+static void TestInteriorChecks()
+{
+	const Complex points[] = { Complex(-0.1, 0.2), Complex(-1.0, 0.1), Complex(-0.122, 0.745),
+		Complex(0.3, 0.6), Complex(-0.75, 0.02), Complex(0.251, 0.0), Complex(-0.75, 0.1), Complex(-2.0, 1.0) };
+	const size_t maxIter = 4000;
+	FunctionParser parser("z*z+c");
+	const std::shared_ptr<const CompiledFunction<Complex>> function = std::make_shared<const CompiledFunction<Complex>>(parser);
+	CHECK(function->IsQuadraticMap());
+	EvalContext<Complex> plain(function);
+	for (int check = 0; check < 3; check++)
+	{
+		EvalContext<Complex>::InteriorChecks checks;
+		checks.bulbs = 0 == check;
+		checks.periodicity = 1 == check;
+		checks.derivative = 2 == check;
+		EvalContext<Complex> eval(function);
+		eval.SetInteriorChecks(checks);
+		for (const Complex& c : points)
+		{
+			Complex stopped;
+			const size_t n = eval.Iterate(c, Complex(), maxIter, 2.0, &stopped);
+			CHECK(n == plain.Iterate(c, Complex(), maxIter, 2.0));
+			if (n < maxIter)
+				continue;
+			// how far the orbit got before the check stopped it
+			size_t steps = 0;
+			for (Complex z; steps < maxIter && std::memcmp(&z, &stopped, sizeof(z)); steps++)
+				z = z * z + c;
+			const bool caught = checks.bulbs ? c != points[2] : true;
+			if (caught)
+				CHECK(steps < maxIter / 2);
+		}
+	}
+}
+
+// functions that stay on the real line get a real kernel, also after a round trip through their image
+static void TestRealFastPath()
+{
+	for (const char* const expression : { "z^100+c", "z*z+c", "sin(z)/c", "log(z)+c", "z^0.5", "re(z)" })
+	{
+		FunctionParser parser(expression);
+		const bool real = parser.IsRealOnly() && !std::strstr(expression, "log") && !std::strstr(expression, "0.5");
+		const CompiledFunction<Complex> function(parser);
+		CHECK(real == static_cast<bool>(function.RealFunction()));
+		const std::vector<unsigned char> image = function.Serialize();
+		const std::shared_ptr<const CompiledFunction<Complex>> loaded = std::make_shared<const CompiledFunction<Complex>>(image.data(), image.size(), nullptr);
+		CHECK(real == static_cast<bool>(loaded->RealFunction()));
+
+		EvalContext<Complex> eval(loaded);
+		eval.Variables()[EvalContext<Complex>::ZSlot] = Complex(0.75, 0.0);
+		eval.Variables()[EvalContext<Complex>::CSlot] = Complex(-0.5, 0.0);
+		CHECK(Close(eval(), Evaluate(parser, Backend::Tree, Complex(0.75, 0.0), Complex(-0.5, 0.0))));
+	}
+}
+
+// at a shallow zoom, where plain double iteration is still valid, the deep-zoom renderer gives its counts
+static void TestPerturbation()
+{
+	const size_t width = 48, height = 40, maxIter = 500;
+	const GridRegion<mth::DoubleDouble> region = { -0.8, 0.1, -0.7, 0.2, width, height };
+	WorkStealingPool pool(4);
+	for (const char* const expression : { "z*z+c", "z^3+c", "sin(z)+c" })
+	{
+		FunctionParser parser(expression);
+		EvalContext<Complex> eval(std::make_shared<const CompiledFunction<Complex>>(parser));
+		PerturbationRenderer renderer(parser, pool);
+		for (const bool series : { false, true })
+		{
+			PerturbationRenderer::Options options;
+			options.maxIter = maxIter;
+			options.seriesApproximation = series;
+			std::vector<size_t> iterations(width * height);
+			CHECK(renderer.Render(region, options, iterations.data()));
+			size_t mismatches = 0;
+			for (size_t y = 0; y < height; y++)
+				for (size_t x = 0; x < width; x++)
+					if (iterations[y * width + x] != eval.Iterate(Complex(static_cast<double>(region.Re(x)), static_cast<double>(region.Im(y))), Complex(), maxIter, 2.0))
+						mismatches++;
+			CHECK(0 == mismatches);
+		}
+	}
+}
+
+// plain, Mariani-Silver and progressive renders against one Iterate per pixel
+static void TestGridRenderer()
+{
+	const size_t width = 48, height = 40, maxIter = 100;
+	const GridRegion<double> region = { -2.0, -1.25, 0.75, 1.25, width, height };
+	FunctionParser parser("z*z+c");
+	const std::shared_ptr<const CompiledFunction<Complex>> function = std::make_shared<const CompiledFunction<Complex>>(parser);
+	EvalContext<Complex> eval(function);
+	std::vector<size_t> expected(width * height);
+	for (size_t y = 0; y < height; y++)
+		for (size_t x = 0; x < width; x++)
+			expected[y * width + x] = eval.Iterate(Complex(region.Re(x), region.Im(y)), Complex(), maxIter, 2.0);
+
+	WorkStealingPool pool(4);
+	GridRenderer<Complex> renderer(function, pool);
+	GridRenderer<Complex>::Options options;
+	options.tileSize = 16;
+	options.maxIter = maxIter;
+	std::vector<size_t> iterations(width * height);
+	std::vector<Complex> finalValues(width * height);
+	CHECK(renderer.Render(region, options, iterations.data(), finalValues.data()));
+	CHECK(expected == iterations);
+	Complex z;
+	eval.Iterate(Complex(region.Re(5), region.Im(7)), Complex(), maxIter, 2.0, &z);
+	CHECK(z == finalValues[7 * width + 5]);
+
+	// filled rectangles only differ where a border of one count hides a detail inside
+	options.subdivide = true;
+	std::fill(iterations.begin(), iterations.end(), 0);
+	CHECK(renderer.Render(region, options, iterations.data()));
+	size_t differing = 0;
+	for (size_t i = 0; i < iterations.size(); i++)
+		differing += iterations[i] != expected[i];
+	CHECK(differing * 100 <= iterations.size());
+
+	options.subdivide = false;
+	std::vector<size_t> strides;
+	std::fill(iterations.begin(), iterations.end(), 0);
+	CHECK(renderer.RenderProgressive(region, options, iterations.data(), [&](const size_t stride)
+	{
+		strides.push_back(stride);
+		// every pixel holds the count of the top left corner of its block
+		size_t wrong = 0;
+		for (size_t y = 0; y < height; y++)
+			for (size_t x = 0; x < width; x++)
+				wrong += iterations[y * width + x] != expected[y / stride * stride * width + x / stride * stride];
+		CHECK(0 == wrong);
+	}, 6));
+	CHECK((std::vector<size_t>{ 8, 4, 2, 1 }) == strides);
+	CHECK(expected == iterations);
+}
+
+// texts that differ in whitespace share an entry, number types and backends do not, the LRU one is evicted
+static void TestFunctionCache()
+{
+	FunctionCache cache(2);
+	const auto first = cache.Get<Complex>("z * z + c");
+	CHECK(first == cache.Get<Complex>("z*z+c"));
+	CHECK("z*z+c" == FunctionCache::Normalize(" z * z +\tc "));
+	CHECK("sin z" == FunctionCache::Normalize("sin  z"));
+	CHECK(first != cache.Get<Complex>("z*z+c", Backend::Tree));
+	FunctionCache::Stats stats = cache.GetStats();
+	CHECK(1 == stats.hits && 2 == stats.misses && 2 == stats.size && 0 == stats.evictions);
+
+	// the Tree entry was used last, so the first one goes
+	cache.Get<std::complex<float>>("z*z+c");
+	stats = cache.GetStats();
+	CHECK(1 == stats.evictions && 2 == stats.size);
+	CHECK(first != cache.Get<Complex>("z*z+c"));
+	EvalContext<Complex> eval(first);
+	eval.Variables()[EvalContext<Complex>::ZSlot] = Complex(1.0, 1.0);
+	CHECK(Complex(0.0, 2.0) == eval());
+
+	bool thrown = false;
+	try
+	{
+		cache.Get<Complex>("z*+");
+	}
+	catch (const FuncParseExcept&)
+	{
+		thrown = true;
+	}
+	CHECK(thrown);
+	CHECK(2 == cache.GetStats().size);
+	cache.Invalidate("z * z + c");
+	CHECK(0 == cache.GetStats().size);
+}
+
+// the tier follows the pixel spacing and the function, each tier counts like its GridRenderer
+static void TestMixedPrecision()
+{
+	using Precision = MixedPrecisionRenderer::Precision;
+	const size_t width = 32, height = 24;
+	CHECK(Precision::Single == MixedPrecisionRenderer::RequiredPrecision({ -2.0, -1.5, 1.0, 1.5, width, height }));
+	CHECK(Precision::Double == MixedPrecisionRenderer::RequiredPrecision({ -0.75, 0.1, -0.75 + 1e-9, 0.1 + 1e-9, width, height }));
+	CHECK(Precision::Extended == MixedPrecisionRenderer::RequiredPrecision({ -0.75, 0.1, mth::DoubleDouble(-0.75, 1e-17), mth::DoubleDouble(0.1, 1e-17), width, height }));
+
+	WorkStealingPool pool(2);
+	const GridRegion<mth::DoubleDouble> region = { -2.0, -1.5, 1.0, 1.5, width, height };
+	const GridRegion<mth::DoubleDouble> deep = { -0.75, 0.1, mth::DoubleDouble(-0.75, 1e-17), mth::DoubleDouble(0.1, 1e-17), width, height };
+	for (const char* const expression : { "z*z+c", "sin(z)+c" })
+	{
+		FunctionParser parser(expression);
+		MixedPrecisionRenderer renderer(parser, pool);
+		MixedPrecisionRenderer::Options options;
+		options.maxIter = 100;
+		std::vector<size_t> iterations(width * height);
+		Precision used = Precision::Extended;
+		CHECK(renderer.Render(region, options, iterations.data(), &used));
+		CHECK(Precision::Single == used);
+		// a transcendental function has no double-double tier and stays at Double however deep the zoom
+		CHECK(renderer.Render(deep, options, iterations.data(), &used));
+		CHECK(renderer.SupportedPrecision() == used);
+		CHECK((Precision::Extended == used) == !std::strstr(expression, "sin"));
+
+		options.minimum = Precision::Double;
+		CHECK(renderer.Render(region, options, iterations.data(), &used));
+		CHECK(Precision::Double == used);
+		GridRenderer<Complex> reference(std::make_shared<const CompiledFunction<Complex>>(parser), pool);
+		GridRenderer<Complex>::Options referenceOptions;
+		referenceOptions.maxIter = options.maxIter;
+		std::vector<size_t> expected(width * height);
+		reference.Render({ -2.0, -1.5, 1.0, 1.5, width, height }, referenceOptions, expected.data());
+		CHECK(expected == iterations);
+	}
+}
+
+// f and df/dz in one pass, on every backend
+static void TestDual()
+{
+	using Dual = mth::Dual<Complex>;
+	const Complex z(0.4, -0.3), c(-0.2, 0.7);
+	FunctionParser parser("z^3+sin(z)*c-exp(z/c)");
+	const Complex value = z * z * z + std::sin(z) * c - std::exp(z / c);
+	const Complex derivative = 3.0 * z * z + std::cos(z) * c - std::exp(z / c) / c;
+	for (const auto backend : { CompiledFunction<Dual>::Backend::Tree, CompiledFunction<Dual>::Backend::Bytecode })
+	{
+		EvalContext<Dual> eval(std::make_shared<const CompiledFunction<Dual>>(parser, backend));
+		eval.Variables()[EvalContext<Dual>::ZSlot] = Dual(z, 1.0);
+		eval.Variables()[EvalContext<Dual>::CSlot] = Dual(c, 0.0);
+		const Dual result = eval();
+		CHECK(Close(result.value, value));
+		CHECK(Close(result.derivative, derivative));
+	}
+
+	bool rejected = false;
+	try
+	{
+		EvalContext<Dual> eval(std::make_shared<const CompiledFunction<Dual>>(FunctionParser("abs(z)+c")));
+		eval();
+	}
+	catch (const FuncParseExcept& ex)
+	{
+		rejected = FuncParseExcept::NotDifferentiable == ex.Error();
+	}
+	CHECK(rejected);
+}
+
+// counters fill only in FUNCTION_PROFILING builds, Merge adds up either way
+static void TestProfile()
+{
+	FunctionParser parser("z*z+c");
+	EvalContext<Complex> eval(std::make_shared<const CompiledFunction<Complex>>(parser));
+	FunctionProfile profile;
+	eval.SetProfile(&profile);
+	const size_t steps = eval.Iterate(Complex(0.3, 0.6), Complex(), 100, 2.0);
+	eval.Iterate(Complex(-0.1, 0.2), Complex(), 100, 2.0);
+	if constexpr (FunctionProfile::Enabled)
+	{
+		CHECK(steps + 100 == profile.Evaluations());
+		CHECK(steps + 100 == profile.Operator(FunctionParser::Operator::Name::mul).executions);
+		CHECK(101 == profile.IterationHistogram().size());
+		CHECK(1 == profile.IterationHistogram()[steps] && 1 == profile.IterationHistogram()[100]);
+	}
+	else
+	{
+		CHECK(0 == profile.Evaluations() && 0 == profile.Total().executions && profile.IterationHistogram().empty());
+	}
+
+	FunctionProfile a, b;
+	a.RecordIterations(3);
+	b.RecordIterations(3);
+	b.RecordIterations(7);
+	b.CountEvaluations(5);
+	a.Merge(b);
+	CHECK(8 == a.IterationHistogram().size() && 2 == a.IterationHistogram()[3] && 1 == a.IterationHistogram()[7]);
+	CHECK(5 == a.Evaluations());
+	a.Reset();
+	CHECK(a.IterationHistogram().empty() && 0 == a.Evaluations());
+}
+
+// literal edits patch the program, other edits recompile and keep the variables, bad text changes nothing
+static void TestIncremental()
+{
+	IncrementalFunction<Complex> function("z*z+0.5", Backend::Jit);
+	const std::shared_ptr<const CompiledFunction<Complex>> compiled = function.Function();
+	function.Context().Variables()[EvalContext<Complex>::ZSlot] = Complex(2.0, 1.0);
+	CHECK(IncrementalFunction<Complex>::Change::None == function.Update("z*z+0.5"));
+	CHECK(IncrementalFunction<Complex>::Change::Constants == function.Update("z*z+0.25"));
+	CHECK(compiled == function.Function());
+	CHECK(Complex(3.25, 4.0) == function.Context()());
+
+	CHECK(IncrementalFunction<Complex>::Change::Recompiled == function.Update("z*z*z+0.25"));
+	CHECK(compiled != function.Function());
+	CHECK(Close(Complex(2.25, 11.0), function.Context()()));
+
+	bool thrown = false;
+	try
+	{
+		function.Update("z*z*(");
+	}
+	catch (const FuncParseExcept&)
+	{
+		thrown = true;
+	}
+	CHECK(thrown);
+	CHECK("z*z*z+0.25" == function.Source());
+	CHECK(Close(Complex(2.25, 11.0), function.Context()()));
+}
+
+static std::string Column(const std::vector<Complex>& values)
+{
+	return std::string(reinterpret_cast<const char*>(values.data()), values.size() * sizeof(Complex));
+}
+
+// a stream gives the batch results chunk by chunk, ends with its shortest column and stops when the sink says so
+static void TestFunctionStream()
+{
+	const size_t count = 1000, chunkSize = 64;
+	std::vector<Complex> z(count), c(count / 4);
+	for (size_t i = 0; i < count; i++)
+		z[i] = Complex(std::sin(0.1 * static_cast<double>(i)), 0.01 * static_cast<double>(i));
+	for (size_t i = 0; i < c.size(); i++)
+		c[i] = Complex(-0.5, 0.001 * static_cast<double>(i));
+
+	FunctionParser parser("z*z+c/(z+2)");
+	FunctionStream<Complex> stream(std::make_shared<const CompiledFunction<Complex>>(parser), chunkSize);
+	std::istringstream zInput(Column(z), std::ios::binary);
+	StreamSampleSource zSource(zInput);
+	stream.Bind(EvalContext<Complex>::ZSlot, &zSource);
+	stream.Variables()[EvalContext<Complex>::CSlot] = Complex(0.25, -0.5);
+	std::vector<Complex> results;
+	const auto collect = [&results](const Complex* values, const size_t n)
+	{
+		results.insert(results.end(), values, values + n);
+		return true;
+	};
+	CHECK(count == stream.Run(collect));
+	CHECK((count + chunkSize - 1) / chunkSize == stream.LastStats().chunks);
+	CHECK(count == results.size());
+	for (size_t i = 0; i < results.size(); i++)
+		CHECK(Close(results[i], Evaluate(parser, Backend::Bytecode, z[i], Complex(0.25, -0.5))));
+
+	std::istringstream zAgain(Column(z), std::ios::binary), cInput(Column(c), std::ios::binary);
+	StreamSampleSource zSecond(zAgain), cSource(cInput);
+	stream.Bind(EvalContext<Complex>::ZSlot, &zSecond);
+	stream.Bind(EvalContext<Complex>::CSlot, &cSource);
+	results.clear();
+	CHECK(c.size() == stream.Run(collect));
+	CHECK(c.size() == results.size());
+	for (size_t i = 0; i < results.size(); i++)
+		CHECK(Close(results[i], Evaluate(parser, Backend::Bytecode, z[i], c[i])));
+
+	std::istringstream zThird(Column(z), std::ios::binary);
+	StreamSampleSource zSource3(zThird);
+	stream.Bind(EvalContext<Complex>::ZSlot, &zSource3);
+	stream.Bind(EvalContext<Complex>::CSlot, nullptr);
+	CHECK(chunkSize == stream.Run([](const Complex*, size_t) { return false; }));
+	CHECK(1 == stream.LastStats().chunks);
+}
+
+// several functions in one program evaluate like each on its own, IterateSystem steps them together
+static void TestMultiOutput()
+{
+	FunctionParser first("z*z-z1*z1+c"), second("2*z*z1+sin(c)");
+	for (const Backend backend : { Backend::Bytecode, Backend::Jit })
+	{
+		EvalContext<Complex> eval(std::make_shared<const CompiledFunction<Complex>>(std::vector<const FunctionParser*>{ &first, &second }, backend));
+		CHECK(2 == eval.Function()->OutputCount());
+		const size_t z1 = FunctionParser::VariableSlot(1);
+		const Complex* const input = s_Inputs[1];
+		eval.Variables()[EvalContext<Complex>::ZSlot] = input[0];
+		eval.Variables()[z1] = input[1];
+		eval.Variables()[EvalContext<Complex>::CSlot] = Complex(0.1, -0.2);
+		Complex outputs[2];
+		eval.Evaluate(outputs);
+		for (int i = 0; i < 2; i++)
+		{
+			FunctionEvaluator<Complex> single(i ? second : first, backend);
+			for (size_t slot = 0; slot < eval.VariableCount(); slot++)
+				if (slot < single.VariableCount())
+					single.Variables()[slot] = eval.Variables()[slot];
+			CHECK(Close(outputs[i], single()));
+		}
+
+		const size_t count = 100;
+		std::vector<Complex> zs(count), z1s(count), cs(count, Complex(0.1, -0.2)), out0(count), out1(count);
+		for (size_t i = 0; i < count; i++)
+		{
+			zs[i] = Complex(0.01 * static_cast<double>(i), -0.5);
+			z1s[i] = Complex(0.3, 0.02 * static_cast<double>(i));
+		}
+		std::vector<const Complex*> inputs(eval.VariableCount(), nullptr);
+		inputs[EvalContext<Complex>::ZSlot] = zs.data();
+		inputs[z1] = z1s.data();
+		inputs[EvalContext<Complex>::CSlot] = cs.data();
+		Complex* const outs[] = { out0.data(), out1.data() };
+		eval.Evaluate(inputs.data(), outs, count);
+		for (size_t i = 0; i < count; i++)
+		{
+			eval.Variables()[EvalContext<Complex>::ZSlot] = zs[i];
+			eval.Variables()[z1] = z1s[i];
+			eval.Evaluate(outputs);
+			CHECK(Close(out0[i], outputs[0]) && Close(out1[i], outputs[1]));
+		}
+
+		// z, z1 <- first, second is the Mandelbrot map of z + i z1 with an extra sin(c) in the imaginary part
+		const size_t targets[] = { EvalContext<Complex>::ZSlot, z1 };
+		const Complex c(0.3, 0.5);
+		eval.Variables()[EvalContext<Complex>::ZSlot] = 0.0;
+		eval.Variables()[z1] = 0.0;
+		eval.Variables()[EvalContext<Complex>::CSlot] = c;
+		const size_t steps = eval.IterateSystem(targets, 200, 1e3);
+		Complex x, y;
+		size_t expected = 0;
+		for (; expected < 200 && std::abs(x) <= 1e3 && std::abs(y) <= 1e3; expected++)
+		{
+			const Complex nx = x * x - y * y + c;
+			y = 2.0 * x * y + std::sin(c);
+			x = nx;
+		}
+		CHECK(expected == steps);
+		CHECK(Close(x, eval.Variables()[EvalContext<Complex>::ZSlot]) && Close(y, eval.Variables()[z1]));
+	}
+}
+
+int main()
+{
+	TestBackends();
+	TestBatch();
+	TestVectorMath();
+	TestImageRoundTrip();
+	TestPoolException();
+	TestGpuRenderer();
+	TestArchive();
+	TestStaticParameters();
+	TestOptimizerExact();
+	TestDiagnostics();
+	TestTryParseAllocations();
+	TestPatchQuadraticMap();
+	TestInteriorChecks();
+	TestRealFastPath();
+	TestPerturbation();
+	TestGridRenderer();
+	TestFunctionCache();
+	TestMixedPrecision();
+	TestDual();
+	TestProfile();
+	TestIncremental();
+	TestFunctionStream();
+	TestMultiOutput();
+
+	if (g_failures)
+		std::printf("%d check(s) failed\n", g_failures);
+	return g_failures ? 1 : 0;
+}
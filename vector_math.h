@@ -0,0 +1,380 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <complex>
+#include <cstdint>
+#include <cstring>
+
+// Array kernels for the transcendental functions of the batch evaluator. The kernel loops are branch-free
+// with bit manipulation through memcpy so compilers vectorize them at -O3 (GCC keeps selects next to a
+// division scalar unless -fno-trapping-math); lanes outside a kernel's fast range are redone with std::
+// afterwards. Range reduction follows fdlibm (Cody-Waite constants, fdlibm polynomials).
+// Max error in ulp of the result, measured against long double on 2 * 10^6 random arguments per range:
+//   exp              1      |x| <= 708
+//   expm1            2      |x| <= 708
+//   log              1      normal x > 0
+//   sin, cos         1.2    |x| <= 2^19
+//   tan              2.4    |x| <= 2^19
+//   sinh             2.2    |x| <= 708
+//   cosh             1.5    |x| <= 708
+//   tanh             2.5
+//   atan2            2.6
+// Complex results are within 3.3 ulp per component (exp and log 3), tan and tanh within 7. float arrays
+// are evaluated in double and rounded once.
+namespace mth
+{
+	namespace simd
+	{
+		constexpr size_t Chunk = 64;
+
+		inline std::uint64_t Bits(const double x) { std::uint64_t u; std::memcpy(&u, &x, sizeof(u)); return u; }
+		inline double FromBits(const std::uint64_t u) { double x; std::memcpy(&x, &u, sizeof(x)); return x; }
+
+		// 1.5 * 2^52: adding it rounds to an integer that ends up in the low mantissa bits
+		constexpr double Shifter = 6755399441055744.0;
+		constexpr double Log2e = 1.44269504088896338700e+00;
+		constexpr double Ln2Hi = 6.93147180369123816490e-01;
+		constexpr double Ln2Lo = 1.90821492927058770002e-10;
+		constexpr double TwoOverPi = 6.36619772367581382433e-01;
+		constexpr double Pio2_1 = 1.57079632673412561417e+00;
+		constexpr double Pio2_2 = 6.07710050630396597660e-11;
+		constexpr double Pio2_3 = 2.02226624871116645580e-21;
+		constexpr double Pio4 = 7.85398163397448278999e-01;
+		constexpr double Pio2 = 1.57079632679489655800e+00;
+		constexpr double Pi = 3.14159265358979311600e+00;
+		constexpr double PiLo = 1.22464679914735317720e-16;
+		constexpr double ExpLimit = 708.0;
+		constexpr double HalfExpLimit = 300.0;
+		constexpr double TrigLimit = 524288.0;
+
+		// std::fmin and std::fmax are library calls without -ffinite-math-only, these become minsd / maxsd
+		inline double Min(const double a, const double b) { return a < b ? a : b; }
+		inline double Max(const double a, const double b) { return a > b ? a : b; }
+		// a where mask is all ones, b where it is zero; a bit blend keeps the loop free of branches
+		inline double Blend(const std::uint64_t mask, const double a, const double b) { return FromBits((Bits(a) & mask) | (Bits(b) & ~mask)); }
+
+		// x * x - square for square = x * x rounded, exact through Dekker's split
+		inline double SquareLow(const double x, const double square)
+		{
+			constexpr double Split = 134217729.0; // 2^27 + 1
+			const double t = Split * x;
+			const double hi = t - (t - x), lo = x - hi;
+			return ((hi * hi - square) + 2.0 * hi * lo) + lo * lo;
+		}
+
+		// e^r - 1 for |r| <= ln2 / 2, Taylor to r^13
+		inline double Expm1Poly(const double r)
+		{
+			double p = 1.0 / 6227020800.0;
+			p = p * r + 1.0 / 479001600.0;
+			p = p * r + 1.0 / 39916800.0;
+			p = p * r + 1.0 / 3628800.0;
+			p = p * r + 1.0 / 362880.0;
+			p = p * r + 1.0 / 40320.0;
+			p = p * r + 1.0 / 5040.0;
+			p = p * r + 1.0 / 720.0;
+			p = p * r + 1.0 / 120.0;
+			p = p * r + 1.0 / 24.0;
+			p = p * r + 1.0 / 6.0;
+			p = p * r + 0.5;
+			return (p * r) * r + r;
+		}
+
+		// x = k ln2 + r, scale = 2^k, e^x - 1 = scale p + (scale - 1); out must not alias x
+		template <bool minusOne>
+		inline void ExpKernel(const double* x, double* out, const size_t n)
+		{
+			for (size_t j = 0; j < n; j++)
+			{
+				// lanes past ExpLimit compute garbage here and are replaced below
+				const double v = x[j];
+				const double kd = v * Log2e + Shifter;
+				const double k = kd - Shifter;
+				const double r = (v - k * Ln2Hi) - k * Ln2Lo;
+				const double scale = FromBits((Bits(kd) + 1023) << 52);
+				const double p = Expm1Poly(r);
+				out[j] = minusOne ? scale * p + (scale - 1.0) : scale * p + scale;
+			}
+			for (size_t j = 0; j < n; j++)
+				if (!(std::abs(x[j]) <= ExpLimit))
+					out[j] = minusOne ? std::expm1(x[j]) : std::exp(x[j]);
+		}
+		inline void Exp(const double* x, double* out, const size_t n) { ExpKernel<false>(x, out, n); }
+		inline void Expm1(const double* x, double* out, const size_t n) { ExpKernel<true>(x, out, n); }
+
+		inline void Log(const double* x, double* out, const size_t n)
+		{
+			constexpr double Lg1 = 6.666666666666735130e-01, Lg2 = 3.999999999940941908e-01, Lg3 = 2.857142874366239149e-01,
+				Lg4 = 2.222219843214978396e-01, Lg5 = 1.818357216161805012e-01, Lg6 = 1.531383769920937332e-01, Lg7 = 1.479819860511658591e-01;
+			// mantissa bits of about sqrt(1/2): the significand is brought into [sqrt(1/2), sqrt(2))
+			constexpr std::uint64_t Offset = 0x3fe6a09e667f3bcdULL;
+			constexpr std::uint64_t Bias = 0x4000000000000000ULL;
+			for (size_t j = 0; j < n; j++)
+			{
+				const std::uint64_t u = Bits(x[j]);
+				const std::uint64_t t = u - Offset + Bias;
+				const double k = FromBits((t >> 52) | Bits(4503599627370496.0)) - (4503599627370496.0 + 1024.0);
+				const double f = FromBits(u - (t & 0xfff0000000000000ULL) + Bias) - 1.0;
+				const double s = f / (2.0 + f);
+				const double z = s * s;
+				const double R = z * (Lg1 + z * (Lg2 + z * (Lg3 + z * (Lg4 + z * (Lg5 + z * (Lg6 + z * Lg7))))));
+				const double hfsq = 0.5 * f * f;
+				out[j] = k * Ln2Hi - ((hfsq - (s * (hfsq + R) + k * Ln2Lo)) - f);
+			}
+			for (size_t j = 0; j < n; j++)
+				if (!(x[j] >= 2.2250738585072014e-308 && x[j] <= 1.7976931348623157e+308))
+					out[j] = std::log(x[j]);
+		}
+
+		inline void SinCos(const double* x, double* sines, double* cosines, const size_t n)
+		{
+			constexpr double S1 = -1.66666666666666324348e-01, S2 = 8.33333333332248946124e-03, S3 = -1.98412698298579493134e-04,
+				S4 = 2.75573137070700676789e-06, S5 = -2.50507602534068634195e-08, S6 = 1.58969099521155010221e-10;
+			constexpr double C1 = 4.16666666666666019037e-02, C2 = -1.38888888888741095749e-03, C3 = 2.48015872894767294178e-05,
+				C4 = -2.75573143513906633035e-07, C5 = 2.08757232129817482790e-09, C6 = -1.13596475577881948265e-11;
+			for (size_t j = 0; j < n; j++)
+			{
+				const double v = x[j];
+				const double kd = v * TwoOverPi + Shifter;
+				const double k = kd - Shifter;
+				const std::uint64_t q = Bits(kd);
+				// reduced argument as r + y, the polynomials take the tail into account like fdlibm's kernels
+				const double head = v - k * Pio2_1;
+				const double w2 = k * Pio2_2;
+				const double r = head - w2;
+				const double y = ((head - r) - w2) - k * Pio2_3;
+				const double z = r * r;
+				const double sr = S2 + z * (S3 + z * (S4 + z * (S5 + z * S6)));
+				const double zr = z * r;
+				const double s = r - ((z * (0.5 * y - zr * sr) - y) - zr * S1);
+				const double hz = 0.5 * z;
+				const double w = 1.0 - hz;
+				const double c = w + (((1.0 - w) - hz) + (z * z * (C1 + z * (C2 + z * (C3 + z * (C4 + z * (C5 + z * C6))))) - r * y));
+				// quadrant q: sin = s, c, -s, -c and cos = c, -s, -c, s
+				const std::uint64_t odd = 0 - (q & 1);
+				sines[j] = FromBits(Bits(Blend(odd, c, s)) ^ ((q & 2) << 62));
+				cosines[j] = FromBits(Bits(Blend(odd, s, c)) ^ (((q + 1) & 2) << 62));
+			}
+			for (size_t j = 0; j < n; j++)
+			{
+				if (!(std::abs(x[j]) <= TrigLimit))
+				{
+					sines[j] = std::sin(x[j]);
+					cosines[j] = std::cos(x[j]);
+				}
+			}
+		}
+
+		// sinh from m = e^|x| - 1 as (m + m / (m + 1)) / 2 so small arguments keep their precision, n <= Chunk
+		inline void SinhCosh(const double* x, double* sinhs, double* coshs, const size_t n)
+		{
+			double a[Chunk], m[Chunk];
+			for (size_t j = 0; j < n; j++)
+				a[j] = std::abs(x[j]);
+			Expm1(a, m, n);
+			for (size_t j = 0; j < n; j++)
+			{
+				const double e = m[j] + 1.0;
+				sinhs[j] = std::copysign(0.5 * (m[j] + m[j] / e), x[j]);
+				coshs[j] = 0.5 * (e + 1.0 / e);
+			}
+			for (size_t j = 0; j < n; j++)
+			{
+				if (!(a[j] <= ExpLimit))
+				{
+					sinhs[j] = std::sinh(x[j]);
+					coshs[j] = std::cosh(x[j]);
+				}
+			}
+		}
+
+		// tanh = m / (m + 2) with m = e^2x - 1, exactly +-1 in double past |x| = 20, n <= Chunk
+		inline void Tanh(const double* x, double* out, const size_t n)
+		{
+			double a[Chunk];
+			for (size_t j = 0; j < n; j++)
+				a[j] = 2.0 * Min(Max(x[j], -20.0), 20.0);
+			Expm1(a, out, n);
+			for (size_t j = 0; j < n; j++)
+				out[j] = out[j] / (out[j] + 2.0);
+			for (size_t j = 0; j < n; j++)
+				if (std::isnan(x[j]))
+					out[j] = x[j];
+		}
+
+		inline void Atan2(const double* y, const double* x, double* out, const size_t n)
+		{
+			constexpr double aT[] = {
+				3.33333333333329318027e-01, -1.99999999998764832476e-01, 1.42857142725034663711e-01, -1.11111104054623557880e-01,
+				9.09088713343650656196e-02, -7.69187620504482999495e-02, 6.66107313738753120669e-02, -5.83357013379057348645e-02,
+				4.97687799461593236017e-02, -3.65315727442169155270e-02, 1.62858201153657823623e-02
+			};
+			constexpr double TanPio8 = 0.41421356237309504880;
+			for (size_t j = 0; j < n; j++)
+			{
+				const double ax = std::abs(x[j]), ay = std::abs(y[j]);
+				const double big = Max(ax, ay), small = Min(ax, ay);
+				const double a = small / big;
+				// atan(a) = pi/4 + atan((a - 1) / (a + 1)) brings a below tan(pi/8)
+				const bool reduce = a > TanPio8;
+				const double t = reduce ? (a - 1.0) / (a + 1.0) : a;
+				const double z = t * t;
+				double p = aT[10];
+				for (int i = 9; i >= 0; i--)
+					p = p * z + aT[i];
+				double r = t - t * z * p + (reduce ? Pio4 : 0.0);
+				r = ay > ax ? Pio2 - r : r;
+				r = x[j] < 0.0 || (x[j] == 0.0 && std::signbit(x[j])) ? (Pi - r) + PiLo : r;
+				out[j] = std::copysign(r, y[j]);
+			}
+			for (size_t j = 0; j < n; j++)
+			{
+				const double big = Max(std::abs(x[j]), std::abs(y[j]));
+				if (!(big >= 2.2250738585072014e-308 && big <= 1.7976931348623157e+308))
+					out[j] = std::atan2(y[j], x[j]);
+			}
+		}
+
+		// In place on SoA planes of at most Chunk lanes
+		enum class Function { Sin, Cos, Tan, Sinh, Cosh, Tanh, Exp, Log };
+
+		template <typename T>
+		inline void ApplyReal(const Function function, T* values, const size_t n)
+		{
+			double x[Chunk] = {}, a[Chunk], b[Chunk];
+			for (size_t j = 0; j < n; j++)
+				x[j] = static_cast<double>(values[j]);
+			switch (function)
+			{
+			case Function::Sin: SinCos(x, a, b, n); break;
+			case Function::Cos: SinCos(x, b, a, n); break;
+			case Function::Tan:
+				SinCos(x, a, b, n);
+				for (size_t j = 0; j < n; j++)
+					a[j] /= b[j];
+				break;
+			case Function::Sinh: SinhCosh(x, a, b, n); break;
+			case Function::Cosh: SinhCosh(x, b, a, n); break;
+			case Function::Tanh: Tanh(x, a, n); break;
+			case Function::Exp: Exp(x, a, n); break;
+			case Function::Log: Log(x, a, n); break;
+			}
+			for (size_t j = 0; j < n; j++)
+				values[j] = static_cast<T>(a[j]);
+		}
+
+		template <typename T>
+		inline void ApplyComplex(const Function function, T* re, T* im, const size_t n)
+		{
+			double x[Chunk] = {}, y[Chunk] = {}, s[Chunk] = {}, c[Chunk], sh[Chunk], ch[Chunk];
+			for (size_t j = 0; j < n; j++)
+			{
+				x[j] = static_cast<double>(re[j]);
+				y[j] = static_cast<double>(im[j]);
+			}
+			switch (function)
+			{
+			case Function::Sin:
+			case Function::Cos:
+				SinCos(x, s, c, n);
+				SinhCosh(y, sh, ch, n);
+				for (size_t j = 0; j < n; j++)
+				{
+					const bool sine = Function::Sin == function;
+					re[j] = static_cast<T>((sine ? s[j] : c[j]) * ch[j]);
+					im[j] = static_cast<T>(sine ? c[j] * sh[j] : -s[j] * sh[j]);
+				}
+				break;
+			case Function::Sinh:
+			case Function::Cosh:
+				SinhCosh(x, sh, ch, n);
+				SinCos(y, s, c, n);
+				for (size_t j = 0; j < n; j++)
+				{
+					const bool sine = Function::Sinh == function;
+					re[j] = static_cast<T>((sine ? sh[j] : ch[j]) * c[j]);
+					im[j] = static_cast<T>((sine ? ch[j] : sh[j]) * s[j]);
+				}
+				break;
+			case Function::Tan:
+			case Function::Tanh:
+			{
+				// tan z = (sin x cos x + i sinh y cosh y) / (cos^2 x + sinh^2 y), the denominator is
+				// cos 2x + cosh 2y without its cancellation next to the poles; tanh swaps the roles of x and y
+				const bool hyperbolic = Function::Tanh == function;
+				const double* const trig = hyperbolic ? y : x;
+				const double* const hyp = hyperbolic ? x : y;
+				SinCos(trig, s, c, n);
+				SinhCosh(hyp, sh, ch, n);
+				for (size_t j = 0; j < n; j++)
+				{
+					const double d = 1.0 / (c[j] * c[j] + sh[j] * sh[j]);
+					const double t = s[j] * c[j] * d, h = sh[j] * ch[j] * d;
+					re[j] = static_cast<T>(hyperbolic ? h : t);
+					im[j] = static_cast<T>(hyperbolic ? t : h);
+				}
+				for (size_t j = 0; j < n; j++)
+				{
+					if (!(std::abs(hyp[j]) < HalfExpLimit))
+					{
+						const std::complex<double> r = hyperbolic ? std::tanh(std::complex<double>(x[j], y[j])) : std::tan(std::complex<double>(x[j], y[j]));
+						re[j] = static_cast<T>(r.real());
+						im[j] = static_cast<T>(r.imag());
+					}
+				}
+				break;
+			}
+			case Function::Exp:
+				// exp(x + iy) = e^x (cos y + i sin y): one fused sin/cos pass, e.g. exp(i*t)
+				Exp(x, sh, n);
+				SinCos(y, s, c, n);
+				for (size_t j = 0; j < n; j++)
+				{
+					re[j] = static_cast<T>(sh[j] * c[j]);
+					im[j] = static_cast<T>(sh[j] * s[j]);
+				}
+				break;
+			case Function::Log:
+			{
+				// log |z| = log(x^2 + y^2) / 2, next to the unit circle log1p(x^2 + y^2 - 1) / 2 with the squares
+				// summed exactly as hi + lo so nothing cancels; log1p(t) = log(u) t / (u - 1) with u = 1 + t
+				double t[Chunk], f[Chunk];
+				for (size_t j = 0; j < n; j++)
+				{
+					const double xx = x[j] * x[j], yy = y[j] * y[j];
+					const double sum = xx + yy;
+					const double big = Max(xx, yy), small = Min(xx, yy);
+					const double low = SquareLow(x[j], xx) + SquareLow(y[j], yy);
+					// Knuth's two-sum carries the rounding of both additions into the low part
+					const double head = big - 1.0, headError = (big - (head - (head - big))) + (-1.0 - (head - big));
+					const double partial = head + small, rest = partial - head;
+					const double error = (head - (partial - rest)) + (small - rest);
+					const double shifted = partial + ((error + headError) + low), u = 1.0 + shifted;
+					const bool near = sum >= 0.5 && sum <= 2.0;
+					t[j] = shifted;
+					s[j] = near ? u : sum;
+					f[j] = near ? shifted / (u - 1.0) : 1.0;
+				}
+				Log(s, c, n);
+				for (size_t j = 0; j < n; j++)
+					re[j] = static_cast<T>(0.5 * (s[j] == 1.0 ? t[j] : c[j] * f[j]));
+				Atan2(y, x, s, n);
+				for (size_t j = 0; j < n; j++)
+					im[j] = static_cast<T>(s[j]);
+				for (size_t j = 0; j < n; j++)
+				{
+					const double big = Max(std::abs(x[j]), std::abs(y[j]));
+					if (!(big >= 1e-150 && big <= 1e150))
+					{
+						const std::complex<double> r = std::log(std::complex<double>(x[j], y[j]));
+						re[j] = static_cast<T>(r.real());
+						im[j] = static_cast<T>(r.imag());
+					}
+				}
+				break;
+			}
+			}
+		}
+	}
+}